@@ -21,8 +21,11 @@
  *
  */
 
+#include "config.h"
+
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <utime.h>
@@ -31,8 +34,79 @@
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef HAVE_LINUX_FS_H
+#include <linux/fs.h>
+#endif
+#ifdef HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
+
 #include "libbb.h"
 
+/* Most the kernel moves in one copy_file_range() or sendfile() call. */
+#define COPY_CHUNK 0x7ffff000
+
+/* Copy the rest of src_fd to dst_fd without passing the data through user
+ * space where possible: share the extents if the filesystem can, then try
+ * copy_file_range() and sendfile(), and read()/write() only as a last
+ * resort. The fallbacks carry on from wherever the previous one stopped. */
+static int copy_file_data(int src_fd, int dst_fd)
+{
+	char buf[BUFSIZ];
+	ssize_t n, w;
+	char *p;
+
+#ifdef FICLONE
+	if (ioctl(dst_fd, FICLONE, src_fd) == 0)
+		return 0;
+#endif
+
+#ifdef HAVE_COPY_FILE_RANGE
+	while ((n = copy_file_range(src_fd, NULL, dst_fd, NULL, COPY_CHUNK, 0)) > 0)
+		;
+	if (n == 0)
+		return 0;
+	if (errno != EXDEV && errno != EINVAL && errno != ENOSYS
+			&& errno != EOPNOTSUPP) {
+		perror_msg("copy_file_range");
+		return -1;
+	}
+#endif
+
+#ifdef HAVE_SYS_SENDFILE_H
+	while ((n = sendfile(dst_fd, src_fd, NULL, COPY_CHUNK)) > 0)
+		;
+	if (n == 0)
+		return 0;
+	if (errno != EINVAL && errno != ENOSYS) {
+		perror_msg("sendfile");
+		return -1;
+	}
+#endif
+
+	while ((n = read(src_fd, buf, sizeof(buf))) != 0) {
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror_msg("read");
+			return -1;
+		}
+		for (p = buf; n > 0; p += w, n -= w) {
+			w = write(dst_fd, p, n);
+			if (w < 0) {
+				if (errno == EINTR) {
+					w = 0;
+					continue;
+				}
+				perror_msg("write");
+				return -1;
+			}
+		}
+	}
+
+	return 0;
+}
+
 int copy_file(const char *source, const char *dest, int flags)
 {
 	struct stat source_stat;
@@ -168,7 +242,7 @@ int copy_file(const char *source, const char *dest, int flags)
 			goto end;
 		}
 
-		if (copy_file_chunk(sfp, dfp, -1) < 0)
+		if (copy_file_data(fileno(sfp), fileno(dfp)) < 0)
 			status = -1;
 
 		if (fclose(dfp) < 0) {
@@ -22,19 +22,37 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
 #include <sys/stat.h>
 #include "libbb.h"
 
+static char *chunk_buffer;
+
+/* A COPY_CHUNK_SIZE buffer shared by all copies, allocated on first use.
+ * Reads at least as large as a stream's own buffer bypass it, so the data
+ * is copied only once on its way through. */
+extern char *copy_chunk_buffer(void)
+{
+	if (chunk_buffer == NULL
+			&& posix_memalign((void **)&chunk_buffer,
+				sysconf(_SC_PAGESIZE), COPY_CHUNK_SIZE) != 0)
+		chunk_buffer = xmalloc(COPY_CHUNK_SIZE);
+
+	return chunk_buffer;
+}
+
 /* Copy CHUNKSIZE bytes (or until EOF if CHUNKSIZE equals -1) from SRC_FILE
  * to DST_FILE.  */
 extern int copy_file_chunk(FILE *src_file, FILE *dst_file, unsigned long long chunksize)
 {
 	size_t nread, nwritten, size;
-	char buffer[BUFSIZ];
+	char *buffer = copy_chunk_buffer();
 
 	while (chunksize != 0) {
-		if (chunksize > BUFSIZ)
-			size = BUFSIZ;
+		if (chunksize > COPY_CHUNK_SIZE)
+			size = COPY_CHUNK_SIZE;
 		else
 			size = chunksize;
 
@@ -68,3 +86,49 @@ extern int copy_file_chunk(FILE *src_file, FILE *dst_file, unsigned long long ch
 
 	return 0;
 }
+
+/* As copy_file_chunk, but write straight to the file descriptor DST_FD. */
+extern int copy_file_chunk_fd(FILE *src_file, int dst_fd, unsigned long long chunksize)
+{
+	size_t nread, size, off;
+	ssize_t nwritten;
+	char *buffer = copy_chunk_buffer();
+
+	while (chunksize != 0) {
+		if (chunksize > COPY_CHUNK_SIZE)
+			size = COPY_CHUNK_SIZE;
+		else
+			size = chunksize;
+
+		nread = fread (buffer, 1, size, src_file);
+
+		if (nread != size && ferror (src_file)) {
+			perror_msg ("read");
+			return -1;
+		} else if (nread == 0) {
+			if (chunksize != -1) {
+				error_msg ("Unable to read all data");
+				return -1;
+			}
+
+			return 0;
+		}
+
+		for (off = 0; off < nread; off += nwritten) {
+			nwritten = write (dst_fd, buffer + off, nread - off);
+			if (nwritten == -1 && errno == EINTR) {
+				nwritten = 0;
+				continue;
+			}
+			if (nwritten <= 0) {
+				perror_msg ("write");
+				return -1;
+			}
+		}
+
+		if (chunksize != -1)
+			chunksize -= nread;
+	}
+
+	return 0;
+}
@@ -21,13 +21,17 @@
  * USA
  */
 
+#include "config.h"
+
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <fcntl.h>
 #include <signal.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include "libbb.h"
+#include "../libopkg/opkg_profile.h"
 
 static int gz_use_vfork;
 
@@ -55,12 +59,18 @@ gz_open(FILE *compressed_file, int *pid)
 		perror_msg("pipe");
 		return(NULL);
 	}
+#ifdef F_SETPIPE_SZ
+	/* Let the unzipper run a whole chunk ahead of the reader. Failing
+	 * this only costs more context switches. */
+	fcntl(unzip_pipe[0], F_SETPIPE_SZ, COPY_CHUNK_SIZE);
+#endif
 
 	/* If we don't flush, we end up with two copies of anything pending,
 	   one from the parent, one from the child */
 	fflush(stdout);
 	fflush(stderr);
 
+	opkg_profile_count_fork();
 	if (gz_use_vfork) {
 		*pid = vfork();
 	} else {
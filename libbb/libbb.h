@@ -56,7 +56,12 @@ const char *mode_string(int mode);
 const char *time_string(time_t timeVal);
 
 int copy_file(const char *source, const char *dest, int flags);
+/* Size of the buffer archive data is copied and skipped through. */
+#define COPY_CHUNK_SIZE (256 * 1024)
+
+char *copy_chunk_buffer(void);
 int copy_file_chunk(FILE *src_file, FILE *dst_file, unsigned long long chunksize);
+int copy_file_chunk_fd(FILE *src_file, int dst_fd, unsigned long long chunksize);
 ssize_t safe_read(int fd, void *buf, size_t count);
 ssize_t full_read(int fd, char *buf, int len);
 
@@ -100,13 +105,26 @@ enum extract_functions_e {
 	extract_unconditional = 512,
 	extract_create_leading_dirs = 1024,
 	extract_quiet = 2048,
-	extract_exclude_list = 4096
+	extract_exclude_list = 4096,
+	extract_staged = 8192,
+	extract_sync = 16384,
+	extract_member_list = 32768
 };
 
 char *deb_extract(const char *package_filename, FILE *out_stream,
 		const int extract_function, const char *prefix,
 		const char *filename, int *err);
 
+/* Headers of the members of the data or control tarball of a package, as
+ * selected by extract_function, in archive order and NULL terminated. */
+file_header_t **deb_extract_members(const char *package_filename,
+		const int extract_function, int *err);
+void free_member_list(file_header_t **list);
+
+/* Resolve owner names in archives against root's /etc/passwd and
+ * /etc/group, or the host's through NSS if root is NULL. */
+void unarchive_set_root(const char *root);
+
 extern int unzip(FILE *l_in_file, FILE *l_out_file);
 extern int gz_close(int gunzip_pid);
 extern FILE *gz_open(FILE *compressed_file, int *pid);
@@ -19,18 +19,22 @@
  *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
  */
 
+#include "config.h"
+
 #include <stdio.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <stdlib.h>
-#include <stdbool.h>
 #include <string.h>
 #include <unistd.h>
-#include <utime.h>
 #include <libgen.h>
+#include <dirent.h>
 #include <grp.h>
 #include <pwd.h>
 
 #include "libbb.h"
+#include "../libopkg/hash_table.h"
+#include "../libopkg/opkg_profile.h"
 
 #define CONFIG_FEATURE_TAR_OLDGNU_COMPATABILITY 1
 #define CONFIG_FEATURE_TAR_GNU_EXTENSIONS
@@ -42,16 +46,519 @@ static char *linkname = NULL;
 
 off_t archive_offset;
 
-#define SEEK_BUF 4096
-static ssize_t
-seek_by_read(FILE* fd, size_t len)
+/* With extract_staged everything but directories is written under
+ * STAGED_SUFFIX next to its final name, so on the same filesystem, and
+ * renamed into place only once the whole archive has been read. */
+#define STAGED_SUFFIX ".opkg-new"
+
+struct staged_entry {
+	char *name;
+	char *tmp_name;
+	dev_t dev;
+};
+
+#define STAGED_BUCKETS 256
+
+static struct staged_entry *staged;
+static unsigned int staged_len, staged_size;
+/* Final names to their staged names. An archive may list a member twice,
+ * the second copy is written over the first under the same staged name. */
+static hash_table_t staged_names;
+static int staged_names_loaded;
+/* A file's data could not be copied: the archive is cut short or the
+ * disk is full. Unlike other errors this must not be committed. */
+static int staged_broken;
+
+/* Whatever is left under the returned name by an interrupted install is
+ * replaced when it is created. */
+static char *
+stage_name(const char *full_name)
+{
+	char *tmp_name;
+
+	tmp_name = xmalloc(strlen(full_name) + sizeof(STAGED_SUFFIX));
+	strcpy(tmp_name, full_name);
+	strcat(tmp_name, STAGED_SUFFIX);
+
+	return tmp_name;
+}
+
+static void
+stage_add(const char *full_name, char *tmp_name, dev_t dev)
+{
+	if (!staged_names_loaded) {
+		hash_table_init("staged", &staged_names, STAGED_BUCKETS);
+		staged_names_loaded = 1;
+	} else if (hash_table_get(&staged_names, full_name)) {
+		free(tmp_name);
+		return;
+	}
+
+	if (staged_len == staged_size) {
+		staged_size = staged_size ? staged_size * 2 : 64;
+		staged = xrealloc(staged, staged_size * sizeof(*staged));
+	}
+
+	staged[staged_len].name = xstrdup(full_name);
+	staged[staged_len].tmp_name = tmp_name;
+	staged[staged_len].dev = dev;
+	hash_table_insert(&staged_names, full_name, tmp_name);
+	staged_len++;
+}
+
+/* Hard links must point at the staged copy of an earlier entry. */
+static const char *
+stage_lookup(const char *full_name)
+{
+	const char *tmp_name = NULL;
+
+	if (staged_names_loaded)
+		tmp_name = hash_table_get(&staged_names, full_name);
+
+	return tmp_name ? tmp_name : full_name;
+}
+
+static void
+stage_free(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < staged_len; i++) {
+		free(staged[i].name);
+		free(staged[i].tmp_name);
+	}
+	staged_len = 0;
+
+	if (staged_names_loaded) {
+		hash_table_deinit(&staged_names);
+		staged_names_loaded = 0;
+	}
+}
+
+/* One syncfs() per filesystem instead of an fsync() per file. */
+static void
+stage_sync(void)
+{
+#ifdef HAVE_SYNCFS
+	dev_t devs[16];
+	unsigned int i, j, ndevs = 0;
+	char *dir;
+	int fd;
+
+	for (i = 0; i < staged_len; i++) {
+		for (j = 0; j < ndevs; j++)
+			if (devs[j] == staged[i].dev)
+				break;
+		if (j < ndevs)
+			continue;
+		if (ndevs == sizeof(devs) / sizeof(devs[0])) {
+			sync();
+			return;
+		}
+		devs[ndevs++] = staged[i].dev;
+
+		dir = xstrdup(staged[i].name);
+		fd = open(dirname(dir), O_RDONLY);
+		free(dir);
+		if (fd == -1) {
+			sync();
+			return;
+		}
+		syncfs(fd);
+		close(fd);
+	}
+#else
+	sync();
+#endif
+}
+
+static void
+stage_abort(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < staged_len; i++)
+		unlink(staged[i].tmp_name);
+
+	stage_free();
+	staged_broken = 0;
+}
+
+/* Whether path is a directory with nothing in it. */
+static int
+dir_is_empty(const char *path)
+{
+	DIR *dir;
+	struct dirent *d;
+	int empty = 1;
+
+	dir = opendir(path);
+	if (dir == NULL)
+		return 0;
+	while (empty && (d = readdir(dir)) != NULL)
+		if (strcmp(d->d_name, ".") && strcmp(d->d_name, ".."))
+			empty = 0;
+	closedir(dir);
+
+	return empty;
+}
+
+/* With extract_sync, make the data durable before renaming, and the renames
+ * after. Offline root installs are not worth the flushes.
+ *
+ * A file may take the place of an empty directory but not of one with
+ * something in it. Every target is checked before the first rename, and a
+ * conflict commits nothing, returning the number of conflicts. Past that
+ * point a rename that fails is reported and the rest go ahead, the install
+ * must record the files that did land. */
+static int
+stage_commit(int sync)
+{
+	struct stat st;
+	unsigned int i;
+	int conflicts = 0;
+
+	if (staged_len == 0)
+		return 0;
+
+	for (i = 0; i < staged_len; i++) {
+		if (lstat(staged[i].name, &st) == 0 && S_ISDIR(st.st_mode)
+				&& !dir_is_empty(staged[i].name)) {
+			error_msg("Cannot replace directory %s with a file, "
+					"it is not empty", staged[i].name);
+			conflicts++;
+		}
+	}
+	if (conflicts) {
+		stage_abort();
+		return conflicts;
+	}
+
+	/* The data must be on disk before any name points at it. */
+	if (sync)
+		stage_sync();
+
+	for (i = 0; i < staged_len; i++) {
+		if (rename(staged[i].tmp_name, staged[i].name) == 0)
+			continue;
+		if (errno == EISDIR && rmdir(staged[i].name) == 0
+				&& rename(staged[i].tmp_name, staged[i].name) == 0)
+			continue;
+		perror_msg("Cannot rename %s to %s",
+				staged[i].tmp_name, staged[i].name);
+		unlink(staged[i].tmp_name);
+	}
+
+	/* And so must the renames. */
+	if (sync)
+		stage_sync();
+
+	stage_free();
+
+	return 0;
+}
+
+/* Entries are created relative to an open descriptor of their directory,
+ * so the kernel walks each path once per directory rather than several
+ * times per file. Archives are mostly sorted, a few descriptors suffice. */
+#define DIR_CACHE_SIZE 16
+
+struct dir_cache_entry {
+	char *path;
+	int fd;
+	dev_t dev;
+	unsigned long used;
+};
+
+static struct dir_cache_entry dir_cache[DIR_CACHE_SIZE];
+static unsigned long dir_cache_clock;
+
+static void
+dir_cache_close(void)
+{
+	int i;
+
+	for (i = 0; i < DIR_CACHE_SIZE; i++) {
+		if (dir_cache[i].path == NULL)
+			continue;
+		close(dir_cache[i].fd);
+		free(dir_cache[i].path);
+		dir_cache[i].path = NULL;
+	}
+}
+
+static struct dir_cache_entry *
+dir_cache_insert(const char *path, int fd)
+{
+	struct dir_cache_entry *e = &dir_cache[0];
+	struct stat st;
+	int i;
+
+	if (fstat(fd, &st) == -1) {
+		close(fd);
+		return NULL;
+	}
+
+	for (i = 1; i < DIR_CACHE_SIZE && e->path; i++)
+		if (dir_cache[i].path == NULL || dir_cache[i].used < e->used)
+			e = &dir_cache[i];
+
+	if (e->path) {
+		close(e->fd);
+		free(e->path);
+	}
+
+	e->path = xstrdup(path);
+	e->fd = fd;
+	e->dev = st.st_dev;
+	e->used = ++dir_cache_clock;
+
+	return e;
+}
+
+/* Split path into its directory, returned, and its last component. */
+static char *
+split_path(const char *path, const char **base)
+{
+	size_t len = strlen(path);
+	char *dir;
+
+	while (len > 1 && path[len - 1] == '/')
+		len--;
+	dir = xmalloc(len + 3);
+	memcpy(dir, path, len);
+	dir[len] = '\0';
+
+	*base = strrchr(dir, '/');
+	if (*base == NULL) {
+		memmove(dir + 2, dir, len + 1);
+		dir[0] = '.';
+		dir[1] = '\0';
+		*base = dir + 2;
+	} else if (*base == dir) {
+		memmove(dir + 2, dir + 1, len);
+		dir[1] = '\0';
+		*base = dir + 2;
+	} else {
+		*(char *)*base = '\0';
+		(*base)++;
+	}
+
+	return dir;
+}
+
+/* Descriptor of directory path, creating it and its parents with the
+ * default umask if create is set. */
+static struct dir_cache_entry *
+dir_cache_open(const char *path, int create)
+{
+	struct dir_cache_entry *parent;
+	const char *base;
+	char *dir;
+	int i, fd;
+
+	for (i = 0; i < DIR_CACHE_SIZE; i++) {
+		if (dir_cache[i].path && strcmp(dir_cache[i].path, path) == 0) {
+			dir_cache[i].used = ++dir_cache_clock;
+			return &dir_cache[i];
+		}
+	}
+
+	fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd == -1 && errno == ENOENT && create) {
+		dir = split_path(path, &base);
+		parent = dir_cache_open(dir, create);
+		if (parent) {
+			if (mkdirat(parent->fd, base, 0777) == -1
+					&& errno != EEXIST)
+				perror_msg("Cannot make dir %s", path);
+			fd = openat(parent->fd, base,
+					O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		}
+		free(dir);
+	}
+	if (fd == -1)
+		return NULL;
+
+	return dir_cache_insert(path, fd);
+}
+
+/* Headers collected by extract_member_list, NULL terminated once done. */
+static file_header_t **members;
+static unsigned int members_len, members_size;
+
+static void
+member_add(file_header_t *file_entry)
+{
+	if (members_len == members_size) {
+		members_size = members_size ? members_size * 2 : 64;
+		members = xrealloc(members, members_size * sizeof(*members));
+	}
+
+	members[members_len++] = file_entry;
+}
+
+/* Owner names in tar headers are resolved to ids through the passwd and
+ * group files of the root being installed to, each name once. For the host
+ * root the lookups go through NSS, an offline root's files are read whole.
+ * A map is dropped when its file changes, e.g. when a package installs it. */
+#define ID_MAP_BUCKETS 64
+
+struct id_entry {
+	int found;
+	unsigned long id;
+};
+
+struct id_map {
+	const char *file;
+	int is_group;
+	int loaded;
+	int checked;	/* file stat'ed for the current archive */
+	struct stat st;
+	hash_table_t names;
+};
+
+static char *id_root;
+static struct id_map user_map = { .file = "/etc/passwd" };
+static struct id_map group_map = { .file = "/etc/group", .is_group = 1 };
+
+static void
+free_id_entry(const char *key, void *entry, void *data)
+{
+	free(entry);
+}
+
+static void
+id_map_clear(struct id_map *map)
+{
+	if (!map->loaded)
+		return;
+
+	hash_table_foreach(&map->names, free_id_entry, NULL);
+	hash_table_deinit(&map->names);
+	map->loaded = 0;
+}
+
+static struct id_entry *
+id_map_add(struct id_map *map, const char *name, int found, unsigned long id)
 {
-        ssize_t cc, total = 0;
-        char buf[SEEK_BUF];
+	struct id_entry *e;
+
+	e = xmalloc(sizeof(*e));
+	e->found = found;
+	e->id = id;
+	hash_table_insert(&map->names, name, e);
+
+	return e;
+}
+
+static void
+id_map_load(struct id_map *map)
+{
+	struct passwd *pw;
+	struct group *gr;
+	struct stat st;
+	char *path;
+	FILE *fp;
+
+	path = concat_path_file(id_root ? id_root : "/", map->file);
+	if (stat(path, &st) == -1)
+		memset(&st, 0, sizeof(st));
+
+	if (map->loaded && st.st_dev == map->st.st_dev
+			&& st.st_ino == map->st.st_ino
+			&& st.st_size == map->st.st_size
+			&& st.st_mtime == map->st.st_mtime) {
+		free(path);
+		return;
+	}
+
+	id_map_clear(map);
+	hash_table_init(map->file, &map->names, ID_MAP_BUCKETS);
+	map->loaded = 1;
+	map->st = st;
+
+	if (id_root && (fp = fopen(path, "r")) != NULL) {
+		/* The first entry for a name wins, as with getpwnam(). */
+		if (map->is_group) {
+			while ((gr = fgetgrent(fp)) != NULL)
+				if (!hash_table_get(&map->names, gr->gr_name))
+					id_map_add(map, gr->gr_name, 1, gr->gr_gid);
+		} else {
+			while ((pw = fgetpwent(fp)) != NULL)
+				if (!hash_table_get(&map->names, pw->pw_name))
+					id_map_add(map, pw->pw_name, 1, pw->pw_uid);
+		}
+		fclose(fp);
+	}
+
+	free(path);
+}
+
+/* Id for a uname or gname header field, or 0 if it is not known there. */
+static int
+id_lookup(struct id_map *map, const char *field, unsigned long *id)
+{
+	struct id_entry *e;
+	struct passwd *pw;
+	struct group *gr;
+	char name[33];
+
+	memcpy(name, field, 32);
+	name[32] = '\0';
+	if (name[0] == '\0')
+		return 0;
+
+	if (!map->checked) {
+		id_map_load(map);
+		map->checked = 1;
+	}
+
+	e = hash_table_get(&map->names, name);
+	if (e == NULL) {
+		/* An offline root's file is loaded whole, unknown is final. */
+		if (id_root)
+			return 0;
+		if (map->is_group) {
+			gr = getgrnam(name);
+			e = id_map_add(map, name, gr != NULL, gr ? gr->gr_gid : 0);
+		} else {
+			pw = getpwnam(name);
+			e = id_map_add(map, name, pw != NULL, pw ? pw->pw_uid : 0);
+		}
+	}
+	if (!e->found)
+		return 0;
+
+	*id = e->id;
+	return 1;
+}
+
+void
+unarchive_set_root(const char *root)
+{
+	if (root && strcmp(root, "/") == 0)
+		root = NULL;
+
+	if (root == id_root || (root && id_root && strcmp(root, id_root) == 0))
+		return;
+
+	free(id_root);
+	id_root = root ? xstrdup(root) : NULL;
+	id_map_clear(&user_map);
+	id_map_clear(&group_map);
+}
+
+static off_t
+seek_by_read(FILE* fd, off_t len)
+{
+        off_t total = 0;
+        size_t cc;
+        char *buf = copy_chunk_buffer();
 
         while (len) {
                 cc = fread(buf, sizeof(buf[0]),
-                                len > SEEK_BUF ? SEEK_BUF : len,
+                                len > COPY_CHUNK_SIZE ? COPY_CHUNK_SIZE : len,
                                 fd);
 
                 total += cc;
@@ -64,13 +571,18 @@ seek_by_read(FILE* fd, size_t len)
 }
 
 static void
-seek_sub_file(FILE *fd, const int count)
+seek_sub_file(FILE *fd, const off_t count)
 {
 	archive_offset += count;
 
 	/* Do not use fseek() on a pipe. It may fail with ESPIPE, leaving the
-	 * stream at an undefined location.
+	 * stream at an undefined location. Short skips are mostly buffered
+	 * already, only large ones are worth asking whether fd can seek.
 	 */
+	if (count >= COPY_CHUNK_SIZE && lseek(fileno(fd), 0, SEEK_CUR) != -1
+			&& fseeko(fd, count, SEEK_CUR) == 0)
+		return;
+
         seek_by_read(fd, count);
 
 	return;
@@ -95,11 +607,13 @@ extract_archive(FILE *src_stream, FILE *out_stream,
 		const char *prefix,
 		int *err)
 {
-	FILE *dst_stream = NULL;
 	char *full_name = NULL;
 	char *full_link_name = NULL;
 	char *buffer = NULL;
-	struct utimbuf t;
+	char *tmp_name = NULL;
+	char *tmp_base_name = NULL;
+	char *dir_name = NULL;
+	const char *target;
 
 	*err = 0;
 
@@ -146,15 +660,34 @@ extract_archive(FILE *src_stream, FILE *out_stream,
 		}
 	}
 	else if (function & extract_all_to_fs) {
-		struct stat oldfile;
-		int stat_res;
-		stat_res = lstat (full_name, &oldfile);
-		if (stat_res == 0) { /* The file already exists */
-			if ((function & extract_unconditional) || (oldfile.st_mtime < file_entry->mtime)) {
-				if (!S_ISDIR(oldfile.st_mode)) {
-					unlink(full_name); /* Directories might not be empty etc */
-				}
-			} else {
+		struct dir_cache_entry *dir;
+		struct timespec times[2];
+		const char *base, *tmp_base;
+		int fd, created;
+
+		dir_name = split_path(full_name, &base);
+		dir = dir_cache_open(dir_name,
+				function & extract_create_leading_dirs);
+		if (dir == NULL) {
+			if ((function & extract_quiet) != extract_quiet) {
+				*err = -1;
+				if (function & extract_create_leading_dirs)
+					error_msg("couldn't create leading directories");
+				else
+					perror_msg("Cannot open directory of %s",
+							full_name);
+			}
+			seek_sub_file(src_stream, file_entry->size);
+			goto cleanup;
+		}
+
+		/* Unconditionally replaced files need not be looked at, an
+		 * existing one is unlinked when creating its name fails. */
+		if (!(function & extract_unconditional)) {
+			struct stat oldfile;
+
+			if (fstatat(dir->fd, base, &oldfile, AT_SYMLINK_NOFOLLOW) == 0
+					&& oldfile.st_mtime >= file_entry->mtime) {
 				if ((function & extract_quiet) != extract_quiet) {
 					*err = -1;
 					error_msg("%s not created: newer or same age file exists", file_entry->name);
@@ -163,69 +696,116 @@ extract_archive(FILE *src_stream, FILE *out_stream,
 				goto cleanup;
 			}
 		}
-		if (function & extract_create_leading_dirs) { /* Create leading directories with default umask */
-			char *buf, *parent;
-			buf = xstrdup(full_name);
-			parent = dirname(buf);
-			if (make_directory (parent, -1, FILEUTILS_RECUR) != 0) {
-				if ((function & extract_quiet) != extract_quiet) {
-					*err = -1;
-					error_msg("couldn't create leading directories");
-				}
-			}
-			free (buf);
+		target = full_name;
+		tmp_base = base;
+		if ((function & extract_staged) && !S_ISDIR(file_entry->mode)) {
+			target = tmp_name = stage_name(full_name);
+			tmp_base = tmp_base_name = stage_name(base);
 		}
+		times[0].tv_sec = times[1].tv_sec = file_entry->mtime;
+		times[0].tv_nsec = times[1].tv_nsec = 0;
+		created = 0;
 		switch(file_entry->mode & S_IFMT) {
 			case S_IFREG:
 				if (file_entry->link_name) { /* Found a cpio hard link */
-					if (link(full_link_name, full_name) != 0) {
+					if (tmp_name) {
+						char *staged_link = xstrdup(stage_lookup(full_link_name));
+						free(full_link_name);
+						full_link_name = staged_link;
+					}
+					if (linkat(AT_FDCWD, full_link_name, dir->fd, tmp_base, 0) != 0
+							&& (errno != EEXIST
+							|| unlinkat(dir->fd, tmp_base, 0) != 0
+							|| linkat(AT_FDCWD, full_link_name, dir->fd, tmp_base, 0) != 0)) {
 						if ((function & extract_quiet) != extract_quiet) {
 							*err = -1;
 							perror_msg("Cannot link from %s to '%s'",
 								file_entry->name, file_entry->link_name);
 						}
+					} else {
+						opkg_profile_count_file_created();
+						created = 1;
 					}
-				} else {
-					if ((dst_stream = wfopen(full_name, "w")) == NULL) {
-						*err = -1;
-						seek_sub_file(src_stream, file_entry->size);
-						goto cleanup;
-					}
-					archive_offset += file_entry->size;
-					*err = copy_file_chunk(src_stream, dst_stream, file_entry->size);
-					fclose(dst_stream);
+					break;
+				}
+				fd = openat(dir->fd, tmp_base,
+						O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+				if (fd == -1 && errno == EEXIST
+						&& unlinkat(dir->fd, tmp_base, 0) == 0)
+					fd = openat(dir->fd, tmp_base,
+							O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+				if (fd == -1) {
+					*err = -1;
+					perror_msg("%s", target);
+					seek_sub_file(src_stream, file_entry->size);
+					goto cleanup;
 				}
+				opkg_profile_count_file_created();
+				archive_offset += file_entry->size;
+				*err = copy_file_chunk_fd(src_stream, fd, file_entry->size);
+				if (*err && tmp_name)
+					staged_broken = 1;
+				/* Set ownership before the mode, chown clears set-id bits. */
+				fchown(fd, file_entry->uid, file_entry->gid);
+				fchmod(fd, file_entry->mode);
+				if (function & extract_preserve_date)
+					futimens(fd, times);
+#ifdef HAVE_SYNC_FILE_RANGE
+				/* Start writeback now, the commit waits for it. */
+				if (tmp_name && (function & extract_sync))
+					sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+#endif
+				close(fd);
+				created = 1;
 				break;
-			case S_IFDIR:
-				if (stat_res != 0) {
-					if (mkdir(full_name, file_entry->mode) < 0) {
-						if ((function & extract_quiet) != extract_quiet) {
-							*err = -1;
-							perror_msg("Cannot make dir %s", full_name);
-						}
+			case S_IFDIR: {
+				struct stat oldfile;
+
+				/* A file or symlink of an older version
+				 * where there now is a directory goes. */
+				if (mkdirat(dir->fd, base, file_entry->mode) < 0
+						&& (errno != EEXIST
+						|| (fstatat(dir->fd, base, &oldfile, AT_SYMLINK_NOFOLLOW) == 0
+						&& !S_ISDIR(oldfile.st_mode)
+						&& (unlinkat(dir->fd, base, 0) != 0
+						|| mkdirat(dir->fd, base, file_entry->mode) < 0)))) {
+					if ((function & extract_quiet) != extract_quiet) {
+						*err = -1;
+						perror_msg("Cannot make dir %s", full_name);
 					}
 				}
 				break;
+			}
 			case S_IFLNK:
-				if (symlink(file_entry->link_name, full_name) < 0) {
+				if (symlinkat(file_entry->link_name, dir->fd, tmp_base) < 0
+						&& (errno != EEXIST
+						|| unlinkat(dir->fd, tmp_base, 0) != 0
+						|| symlinkat(file_entry->link_name, dir->fd, tmp_base) < 0)) {
 					if ((function & extract_quiet) != extract_quiet) {
 						*err = -1;
 						perror_msg("Cannot create symlink from %s to '%s'", file_entry->name, file_entry->link_name);
 					}
 					goto cleanup;
 				}
+				opkg_profile_count_file_created();
+				created = 1;
 				break;
 			case S_IFSOCK:
 			case S_IFBLK:
 			case S_IFCHR:
 			case S_IFIFO:
-				if (mknod(full_name, file_entry->mode, file_entry->device) == -1) {
+				if (mknodat(dir->fd, tmp_base, file_entry->mode, file_entry->device) == -1
+						&& (errno != EEXIST
+						|| unlinkat(dir->fd, tmp_base, 0) != 0
+						|| mknodat(dir->fd, tmp_base, file_entry->mode, file_entry->device) == -1)) {
 					if ((function & extract_quiet) != extract_quiet) {
 						*err = -1;
 						perror_msg("Cannot create node %s", file_entry->name);
 					}
 					goto cleanup;
 				}
+				opkg_profile_count_file_created();
+				created = 1;
 				break;
                          default:
 				*err = -1;
@@ -234,20 +814,21 @@ extract_archive(FILE *src_stream, FILE *out_stream,
 		}
 
 		/* Changing a symlink's properties normally changes the properties of the
-		 * file pointed to, so dont try and change the date or mode, lchown does
-		 * does the right thing, but isnt available in older versions of libc */
+		 * file pointed to, so dont try and change the date or mode, only its
+		 * owner. */
 		if (S_ISLNK(file_entry->mode)) {
-#if (__GLIBC__ > 2) && (__GLIBC_MINOR__ > 1)
-			lchown(full_name, file_entry->uid, file_entry->gid);
-#endif
-		} else {
-			if (function & extract_preserve_date) {
-				t.actime = file_entry->mtime;
-				t.modtime = file_entry->mtime;
-				utime(full_name, &t);
-			}
-			chown(full_name, file_entry->uid, file_entry->gid);
-			chmod(full_name, file_entry->mode);
+			fchownat(dir->fd, tmp_base, file_entry->uid, file_entry->gid,
+					AT_SYMLINK_NOFOLLOW);
+		} else if (!S_ISREG(file_entry->mode)) {
+			fchownat(dir->fd, tmp_base, file_entry->uid, file_entry->gid, 0);
+			fchmodat(dir->fd, tmp_base, file_entry->mode, 0);
+			if (function & extract_preserve_date)
+				utimensat(dir->fd, tmp_base, times, 0);
+		}
+
+		if (tmp_name && created) {
+			stage_add(full_name, tmp_name, dir->dev);
+			tmp_name = NULL;
 		}
 	} else {
 		/* If we arent extracting data we have to skip it,
@@ -269,6 +850,12 @@ extract_archive(FILE *src_stream, FILE *out_stream,
 	}
 
 cleanup:
+	if (tmp_name) {
+		unlink(tmp_name);
+		free(tmp_name);
+	}
+	free(tmp_base_name);
+	free(dir_name);
 	free(full_name);
         if ( full_link_name )
 	    free(full_link_name);
@@ -293,6 +880,7 @@ unarchive(FILE *src_stream, FILE *out_stream,
 	*err = 0;
 
 	archive_offset = 0;
+	user_map.checked = group_map.checked = 0;
 	while ((file_entry = get_headers(src_stream)) != NULL) {
 		extract_flag = TRUE;
 
@@ -321,6 +909,13 @@ unarchive(FILE *src_stream, FILE *out_stream,
 			}
 		}
 
+		if (extract_flag == TRUE
+				&& (extract_function & extract_member_list)) {
+			/* The header now belongs to the member list. */
+			member_add(file_entry);
+			seek_sub_file(src_stream, file_entry->size);
+			continue;
+		}
 		if (extract_flag == TRUE) {
 			buffer = extract_archive(src_stream, out_stream,
 					file_entry, extract_function,
@@ -337,6 +932,8 @@ unarchive(FILE *src_stream, FILE *out_stream,
 		free_headers(file_entry);
 	}
 
+	dir_cache_close();
+
 	return buffer;
 }
 
@@ -439,43 +1036,6 @@ free_header_ar(file_header_t *ar_entry)
 	free(ar_entry);
 }
 
-static char uname_cache[32] = "";
-static uid_t uid_cache;
-
-static bool update_unamecache(char *uname) {
-	struct passwd *passwd;
-	if (!uname)
-		return FALSE;
-	if (!uname_cache[0] && strcmp(uname_cache, uname) == 0)
-		return TRUE;
-	passwd = getpwnam(uname);
-	if (passwd) {
-		uid_cache = passwd->pw_uid;
-		strncpy(uname, uname_cache, 32);
-		return TRUE;
-	}
-	return FALSE;
-}
-
-static char gname_cache[32] = "";
-static gid_t gid_cache;
-
-static bool update_gnamecache(char *gname) {
-	struct group *group;
-	if (!gname)
-		return FALSE;
-	if (!gname_cache[0] && strcmp(gname_cache, gname) == 0)
-		return TRUE;
-	group = getgrnam(gname);
-	if (group) {
-		gid_cache = group->gr_gid;
-		strncpy(gname, gname_cache, 32);
-		return TRUE;
-	}
-	return FALSE;
-}
-
-
 static file_header_t *
 get_header_tar(FILE *tar_stream)
 {
@@ -502,6 +1062,7 @@ get_header_tar(FILE *tar_stream)
 		} formated;
 	} tar;
 	file_header_t *tar_entry = NULL;
+	unsigned long id;
 	long i;
 	long sum = 0;
 
@@ -554,12 +1115,12 @@ get_header_tar(FILE *tar_stream)
 */
         tar_entry->mode = 07777 & strtol(tar.formated.mode, NULL, 8);
 
-	if (update_unamecache(tar.formated.uname))
-		tar_entry->uid = uid_cache;
+	if (id_lookup(&user_map, tar.formated.uname, &id))
+		tar_entry->uid = id;
 	else
 		tar_entry->uid = strtol(tar.formated.uid, NULL, 8);
-	if (update_gnamecache(tar.formated.gname))
-		tar_entry->gid = gid_cache;
+	if (id_lookup(&group_map, tar.formated.gname, &id))
+		tar_entry->gid = id;
 	else
 		tar_entry->gid = strtol(tar.formated.gid, NULL, 8);
 	tar_entry->size  = strtol(tar.formated.size, NULL, 8);
@@ -715,7 +1276,7 @@ deb_extract(const char *package_filename, FILE *out_stream,
 		goto cleanup;
 	}
 	/* set the buffer size */
-	setvbuf(deb_stream, NULL, _IOFBF, 0x8000);
+	setvbuf(deb_stream, NULL, _IOFBF, COPY_CHUNK_SIZE);
 
 	/* check ar magic */
 	fread(ar_magic, 1, 8, deb_stream);
@@ -740,6 +1301,7 @@ deb_extract(const char *package_filename, FILE *out_stream,
 						free_header_tar,
 						extract_function, prefix,
 						file_list, err);
+				opkg_profile_add_decompressed(archive_offset);
 				fclose(uncompressed_stream);
 				gz_err = gz_close(gunzip_pid);
 				if (gz_err)
@@ -797,6 +1359,7 @@ deb_extract(const char *package_filename, FILE *out_stream,
 							  prefix,
 							  file_list,
 							  err);
+				opkg_profile_add_decompressed(archive_offset);
 
 				free_header_tar(tar_header);
 				fclose(uncompressed_stream);
@@ -820,6 +1383,15 @@ deb_extract(const char *package_filename, FILE *out_stream,
 	}
 
 cleanup:
+	if (extract_function & extract_staged) {
+		if (*err || staged_broken) {
+			stage_abort();
+			*err = -1;
+		} else if (stage_commit(extract_function & extract_sync)) {
+			*err = -1;
+		}
+	}
+
 	if (deb_stream)
 		fclose(deb_stream);
 	if (file_list)
@@ -827,3 +1399,41 @@ cleanup:
 
 	return output_buffer;
 }
+
+file_header_t **
+deb_extract_members(const char *package_filename,
+	const int extract_function, int *err)
+{
+	file_header_t **list;
+
+	members = NULL;
+	members_len = members_size = 0;
+
+	deb_extract(package_filename, NULL,
+			extract_function | extract_member_list,
+			NULL, NULL, err);
+
+	member_add(NULL);
+	list = members;
+	members = NULL;
+
+	if (*err) {
+		free_member_list(list);
+		return NULL;
+	}
+
+	return list;
+}
+
+void
+free_member_list(file_header_t **list)
+{
+	file_header_t **m;
+
+	if (list == NULL)
+		return;
+
+	for (m = list; *m; m++)
+		free_header_tar(*m);
+	free(list);
+}
@@ -15,14 +15,23 @@
    General Public License for more details.
 */
 
+#include "config.h"
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <sys/stat.h>
 
 #include "opkg_message.h"
 #include "conffile.h"
 #include "file_util.h"
 #include "sprintf_alloc.h"
 #include "opkg_conf.h"
+#include "opkg_defines.h"
+#include "hash_table.h"
+#include "libbb/libbb.h"
 
 int conffile_init(conffile_t *conffile, const char *file_name, const char *md5sum)
 {
@@ -34,6 +43,191 @@ void conffile_deinit(conffile_t *conffile)
     nv_pair_deinit(conffile);
 }
 
+/*
+ * The md5sums of conffiles, remembered along with what stat() said about
+ * the file when it was hashed. A file whose dev, inode, size, mtime and
+ * ctime are unchanged is answered without reading it. Kept across runs in
+ * OPKG_CONFFILE_CACHE.
+ */
+#define MD5_CACHE_BUCKETS 2048
+
+struct md5_cache_entry {
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    struct timespec ctime;
+    char md5sum[33];
+};
+
+static hash_table_t md5_cache;
+static int md5_cache_loaded;
+static int md5_cache_dirty;
+
+static void
+md5_cache_load(void)
+{
+    struct md5_cache_entry *e;
+    unsigned long long dev, ino, size;
+    long long msec, csec;
+    long mnsec, cnsec;
+    char *cache_file, *line;
+    int path_off;
+    FILE *fp;
+
+    if (md5_cache_loaded)
+	return;
+
+    hash_table_init("conffile-md5", &md5_cache, MD5_CACHE_BUCKETS);
+    md5_cache_loaded = 1;
+
+    cache_file = root_filename_alloc(OPKG_CONFFILE_CACHE);
+    fp = fopen(cache_file, "r");
+    free(cache_file);
+    if (fp == NULL)
+	return;
+
+    while ((line = file_read_line_alloc(fp))) {
+	e = xmalloc(sizeof(*e));
+	if (sscanf(line, "%32s %llu %llu %llu %lld.%ld %lld.%ld %n",
+		    e->md5sum, &dev, &ino, &size, &msec, &mnsec,
+		    &csec, &cnsec, &path_off) == 8 && line[path_off]) {
+	    e->dev = dev;
+	    e->ino = ino;
+	    e->size = size;
+	    e->mtime.tv_sec = msec;
+	    e->mtime.tv_nsec = mnsec;
+	    e->ctime.tv_sec = csec;
+	    e->ctime.tv_nsec = cnsec;
+	    free(hash_table_get(&md5_cache, line + path_off));
+	    hash_table_insert(&md5_cache, line + path_off, e);
+	} else
+	    free(e);
+	free(line);
+    }
+
+    fclose(fp);
+}
+
+static int
+md5_cache_matches(const struct md5_cache_entry *e, const struct stat *st)
+{
+    return e->dev == st->st_dev && e->ino == st->st_ino
+	&& e->size == st->st_size
+	&& e->mtime.tv_sec == st->st_mtim.tv_sec
+	&& e->mtime.tv_nsec == st->st_mtim.tv_nsec
+	&& e->ctime.tv_sec == st->st_ctim.tv_sec
+	&& e->ctime.tv_nsec == st->st_ctim.tv_nsec;
+}
+
+static void
+md5_cache_forget(const char *root_filename, struct md5_cache_entry *e)
+{
+    if (e == NULL)
+	return;
+
+    hash_table_remove(&md5_cache, root_filename);
+    free(e);
+    md5_cache_dirty = 1;
+}
+
+static char *
+conffile_md5sum_alloc(const char *root_filename)
+{
+    struct md5_cache_entry *e;
+    struct stat st;
+    char *md5sum;
+
+    md5_cache_load();
+
+    e = hash_table_get(&md5_cache, root_filename);
+    if (stat(root_filename, &st) == -1) {
+	md5_cache_forget(root_filename, e);
+	return file_md5sum_alloc(root_filename);	/* for the error */
+    }
+
+    if (e && md5_cache_matches(e, &st))
+	return xstrdup(e->md5sum);
+
+    md5sum = file_md5sum_alloc(root_filename);
+    if (md5sum == NULL || strlen(md5sum) != 32)
+	return md5sum;
+
+    /*
+     * A file changed again within the timestamp granularity would keep
+     * its stat, so only remember files that have been left alone a while.
+     */
+    if (st.st_mtime >= time(NULL) - 1 || st.st_ctime >= time(NULL) - 1) {
+	md5_cache_forget(root_filename, e);
+	return md5sum;
+    }
+
+    if (e == NULL) {
+	e = xmalloc(sizeof(*e));
+	hash_table_insert(&md5_cache, root_filename, e);
+    }
+    e->dev = st.st_dev;
+    e->ino = st.st_ino;
+    e->size = st.st_size;
+    e->mtime = st.st_mtim;
+    e->ctime = st.st_ctim;
+    strcpy(e->md5sum, md5sum);
+    md5_cache_dirty = 1;
+
+    return md5sum;
+}
+
+static void
+md5_cache_write_entry(const char *key, void *entry, void *data)
+{
+    struct md5_cache_entry *e = entry;
+
+    fprintf(data, "%s %llu %llu %llu %lld.%09ld %lld.%09ld %s\n",
+	    e->md5sum, (unsigned long long)e->dev,
+	    (unsigned long long)e->ino, (unsigned long long)e->size,
+	    (long long)e->mtime.tv_sec, (long)e->mtime.tv_nsec,
+	    (long long)e->ctime.tv_sec, (long)e->ctime.tv_nsec, key);
+}
+
+static void
+md5_cache_free_entry(const char *key, void *entry, void *data)
+{
+    free(entry);
+}
+
+/* Write back the md5sums learnt by this run and forget them. */
+void
+conffile_cache_flush(void)
+{
+    char *cache_file, *cache_dir, *buf = NULL;
+    size_t len = 0;
+    FILE *fp;
+
+    if (!md5_cache_loaded)
+	return;
+
+    if (md5_cache_dirty && !conf->noaction) {
+	fp = open_memstream(&buf, &len);
+	if (fp) {
+	    hash_table_foreach(&md5_cache, md5_cache_write_entry, fp);
+	    fclose(fp);
+	    cache_file = root_filename_alloc(OPKG_CONFFILE_CACHE);
+	    cache_dir = xstrdup(cache_file);
+	    /* Queries may be run by users who cannot update it. */
+	    if (access(dirname(cache_dir), W_OK) == 0)
+		file_write_atomic(cache_file, buf, len);
+	    free(cache_dir);
+	    free(cache_file);
+	    free(buf);
+	}
+    }
+
+    hash_table_foreach(&md5_cache, md5_cache_free_entry, NULL);
+    hash_table_deinit(&md5_cache);
+    md5_cache_loaded = 0;
+    md5_cache_dirty = 0;
+}
+
 int conffile_has_been_modified(conffile_t *conffile)
 {
     char *md5sum;
@@ -48,7 +242,7 @@ int conffile_has_been_modified(conffile_t *conffile)
 
     root_filename = root_filename_alloc(filename);
 
-    md5sum = file_md5sum_alloc(root_filename);
+    md5sum = conffile_md5sum_alloc(root_filename);
 
     if (md5sum && (ret = strcmp(md5sum, conffile->value))) {
         opkg_msg(INFO, "Conffile %s:\n\told md5=%s\n\tnew md5=%s\n",
@@ -22,17 +22,15 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <libgen.h>
 #include <unistd.h>
 
 #include "sprintf_alloc.h"
 #include "file_util.h"
-#include "md5.h"
+#include "opkg_profile.h"
 #include "libbb/libbb.h"
 
-#if defined HAVE_SHA256
-#include "sha256.h"
-#endif
-
 int
 file_exists(const char *file_name)
 {
@@ -129,107 +127,407 @@ file_copy(const char *src, const char *dest)
 	return err;
 }
 
+/* Returns 1 if file_name exists and holds exactly len bytes of buf. */
+int
+file_content_equals(const char *file_name, const char *buf, size_t len)
+{
+	struct stat st;
+	char tmp[4096];
+	size_t off = 0;
+	ssize_t n;
+	int fd, ret = 0;
+
+	if (stat(file_name, &st) == -1 || st.st_size != len)
+		return 0;
+
+	fd = open(file_name, O_RDONLY);
+	if (fd == -1)
+		return 0;
+
+	while (off < len) {
+		n = read(fd, tmp, sizeof(tmp));
+		if (n <= 0 || off + n > len || memcmp(buf + off, tmp, n))
+			goto out;
+		off += n;
+	}
+
+	ret = (read(fd, tmp, 1) == 0);
+out:
+	close(fd);
+	return ret;
+}
+
+/*
+ * Replace file_name with the contents of buf such that a crash leaves
+ * either the old or the new file behind, never a truncated one.
+ */
+int
+file_write_atomic(const char *file_name, const char *buf, size_t len)
+{
+	char *tmp_name, *dir_name;
+	ssize_t n;
+	size_t off = 0;
+	int fd;
+
+	sprintf_alloc(&tmp_name, "%s.XXXXXX", file_name);
+	fd = mkstemp(tmp_name);
+	if (fd == -1) {
+		if (errno != EROFS)
+			opkg_perror(ERROR, "Failed to make temp file %s",
+					tmp_name);
+		free(tmp_name);
+		return -1;
+	}
+
+	while (off < len) {
+		n = write(fd, buf + off, len - off);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			opkg_perror(ERROR, "Failed to write %s", tmp_name);
+			goto err;
+		}
+		off += n;
+	}
+
+	if (fchmod(fd, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH) == -1
+			|| fsync(fd) == -1) {
+		opkg_perror(ERROR, "Failed to sync %s", tmp_name);
+		goto err;
+	}
+
+	if (close(fd) == -1) {
+		opkg_perror(ERROR, "Couldn't close %s", tmp_name);
+		fd = -1;
+		goto err;
+	}
+	fd = -1;
+
+	if (rename(tmp_name, file_name) == -1) {
+		opkg_perror(ERROR, "Failed to rename %s to %s",
+				tmp_name, file_name);
+		goto err;
+	}
+	free(tmp_name);
+
+	/* Make the rename itself durable. */
+	tmp_name = xstrdup(file_name);
+	dir_name = dirname(tmp_name);
+	fd = open(dir_name, O_RDONLY);
+	if (fd != -1) {
+		fsync(fd);
+		close(fd);
+	}
+	free(tmp_name);
+
+	return 0;
+
+err:
+	if (fd != -1)
+		close(fd);
+	unlink(tmp_name);
+	free(tmp_name);
+	return -1;
+}
+
 int
 file_mkdir_hier(const char *path, long mode)
 {
 	return make_directory(path, mode, FILEUTILS_RECUR);
 }
 
-char *file_md5sum_alloc(const char *file_name)
+static char *
+hex_alloc(const unsigned char *bin, int len)
 {
-    static const int md5sum_bin_len = 16;
-    static const int md5sum_hex_len = 32;
+    static const char bin2hex[16] = "0123456789abcdef";
+    char *hex = xmalloc(len * 2 + 1);
+    int i;
 
-    static const unsigned char bin2hex[16] = {
-	'0', '1', '2', '3',
-	'4', '5', '6', '7',
-	'8', '9', 'a', 'b',
-	'c', 'd', 'e', 'f'
-    };
+    for (i = 0; i < len; i++) {
+	hex[i*2] = bin2hex[bin[i] >> 4];
+	hex[i*2+1] = bin2hex[bin[i] & 0xf];
+    }
+    hex[len * 2] = '\0';
 
-    int i, err;
-    FILE *file;
-    char *md5sum_hex;
-    unsigned char md5sum_bin[md5sum_bin_len];
+    return hex;
+}
 
-    md5sum_hex = xcalloc(1, md5sum_hex_len + 1);
+#ifdef HAVE_OPENSSL
+static EVP_MD_CTX *
+evp_init(const EVP_MD *type)
+{
+    EVP_MD_CTX *ctx = EVP_MD_CTX_create();
 
-    file = fopen(file_name, "r");
-    if (file == NULL) {
-	opkg_perror(ERROR, "Failed to open file %s", file_name);
-	free(md5sum_hex);
+    if (ctx == NULL || !EVP_DigestInit_ex(ctx, type, NULL)) {
+	opkg_msg(INFO, "OpenSSL cannot compute %s, using the bundled code.\n",
+			EVP_MD_name(type));
+	if (ctx)
+	    EVP_MD_CTX_destroy(ctx);
 	return NULL;
     }
 
-    err = md5_stream(file, md5sum_bin);
-    if (err) {
-	opkg_msg(ERROR, "Could't compute md5sum for %s.\n", file_name);
-	fclose(file);
-	free(md5sum_hex);
+    return ctx;
+}
+
+/* Finish a copy of ctx, so more data may still be added to it. */
+static char *
+evp_hex_alloc(EVP_MD_CTX *ctx)
+{
+    unsigned char bin[EVP_MAX_MD_SIZE];
+    unsigned int len;
+    EVP_MD_CTX *copy = EVP_MD_CTX_create();
+
+    if (copy == NULL || !EVP_MD_CTX_copy_ex(copy, ctx)
+	    || !EVP_DigestFinal_ex(copy, bin, &len)) {
+	EVP_MD_CTX_destroy(copy);
 	return NULL;
     }
+    EVP_MD_CTX_destroy(copy);
 
-    fclose(file);
+    return hex_alloc(bin, len);
+}
+#endif
 
-    for (i=0; i < md5sum_bin_len; i++) {
-	md5sum_hex[i*2] = bin2hex[md5sum_bin[i] >> 4];
-	md5sum_hex[i*2+1] = bin2hex[md5sum_bin[i] & 0xf];
-    }
+void
+file_digest_init(file_digest_t *digest, int types)
+{
+    digest->types = types & FILE_DIGEST_ALL;
 
-    md5sum_hex[md5sum_hex_len] = '\0';
+#ifdef HAVE_OPENSSL
+    digest->evp_md5 = NULL;
+    digest->evp_sha256 = NULL;
+    if (digest->types & FILE_DIGEST_MD5)
+	digest->evp_md5 = evp_init(EVP_md5());
+#ifdef HAVE_SHA256
+    if (digest->types & FILE_DIGEST_SHA256)
+	digest->evp_sha256 = evp_init(EVP_sha256());
+#endif
+#endif
+    if (digest->types & FILE_DIGEST_MD5)
+	md5_init_ctx(&digest->md5);
+#ifdef HAVE_SHA256
+    if (digest->types & FILE_DIGEST_SHA256)
+	sha256_init_ctx(&digest->sha256);
+#endif
+}
 
-    return md5sum_hex;
+void
+file_digest_deinit(file_digest_t *digest)
+{
+#ifdef HAVE_OPENSSL
+    if (digest->evp_md5)
+	EVP_MD_CTX_destroy(digest->evp_md5);
+    if (digest->evp_sha256)
+	EVP_MD_CTX_destroy(digest->evp_sha256);
+    digest->evp_md5 = NULL;
+    digest->evp_sha256 = NULL;
+#endif
+    digest->types = 0;
 }
 
+void
+file_digest_update(file_digest_t *digest, const void *buf, size_t len)
+{
+    opkg_profile_begin(OPKG_PROFILE_CHECKSUM);
+    if (digest->types & FILE_DIGEST_MD5) {
+#ifdef HAVE_OPENSSL
+	if (digest->evp_md5)
+	    EVP_DigestUpdate(digest->evp_md5, buf, len);
+	else
+#endif
+	    md5_process_bytes(buf, len, &digest->md5);
+    }
 #ifdef HAVE_SHA256
-char *file_sha256sum_alloc(const char *file_name)
+    if (digest->types & FILE_DIGEST_SHA256) {
+#ifdef HAVE_OPENSSL
+	if (digest->evp_sha256)
+	    EVP_DigestUpdate(digest->evp_sha256, buf, len);
+	else
+#endif
+	    sha256_process_bytes(buf, len, &digest->sha256);
+    }
+#endif
+    opkg_profile_end(OPKG_PROFILE_CHECKSUM);
+}
+
+/*
+ * The buffer is page aligned and only handed over in whole, so the hash
+ * code always works on aligned full blocks and never copies.
+ */
+#define DIGEST_BUF_SIZE (256 * 1024)
+#define DIGEST_BUF_ALIGN 4096
+
+int
+file_digest_update_file(file_digest_t *digest, const char *file_name)
 {
-    static const int sha256sum_bin_len = 32;
-    static const int sha256sum_hex_len = 64;
+    void *buf;
+    size_t len;
+    ssize_t n;
+    int fd, err = 0;
+
+    fd = open(file_name, O_RDONLY);
+    if (fd == -1) {
+	opkg_perror(ERROR, "Failed to open file %s", file_name);
+	return -1;
+    }
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+    if (posix_memalign(&buf, DIGEST_BUF_ALIGN, DIGEST_BUF_SIZE)) {
+	opkg_msg(ERROR, "Out of memory checksumming %s.\n", file_name);
+	close(fd);
+	return -1;
+    }
 
-    static const unsigned char bin2hex[16] = {
-	'0', '1', '2', '3',
-	'4', '5', '6', '7',
-	'8', '9', 'a', 'b',
-	'c', 'd', 'e', 'f'
-    };
+    do {
+	for (len = 0; len < DIGEST_BUF_SIZE; len += n) {
+	    n = read(fd, (char *)buf + len, DIGEST_BUF_SIZE - len);
+	    if (n == 0)
+		break;
+	    if (n == -1) {
+		if (errno == EINTR) {
+		    n = 0;
+		    continue;
+		}
+		opkg_perror(ERROR, "Failed to read %s", file_name);
+		err = -1;
+		goto out;
+	    }
+	}
+	file_digest_update(digest, buf, len);
+    } while (len == DIGEST_BUF_SIZE);
 
-    int i, err;
-    FILE *file;
-    char *sha256sum_hex;
-    unsigned char sha256sum_bin[sha256sum_bin_len];
+out:
+    free(buf);
+    close(fd);
+    return err;
+}
 
-    sha256sum_hex = xcalloc(1, sha256sum_hex_len + 1);
+char *
+file_digest_md5_alloc(const file_digest_t *digest)
+{
+    struct md5_ctx ctx;
+    unsigned char bin[MD5_DIGEST_SIZE];
 
-    file = fopen(file_name, "r");
-    if (file == NULL) {
-	opkg_perror(ERROR, "Failed to open file %s", file_name);
-	free(sha256sum_hex);
+    if (!(digest->types & FILE_DIGEST_MD5))
 	return NULL;
-    }
 
-    err = sha256_stream(file, sha256sum_bin);
-    if (err) {
-	opkg_msg(ERROR, "Could't compute sha256sum for %s.\n", file_name);
-	fclose(file);
-	free(sha256sum_hex);
+#ifdef HAVE_OPENSSL
+    if (digest->evp_md5)
+	return evp_hex_alloc(digest->evp_md5);
+#endif
+    ctx = digest->md5;
+    md5_finish_ctx(&ctx, bin);
+    return hex_alloc(bin, sizeof(bin));
+}
+
+#ifdef HAVE_SHA256
+char *
+file_digest_sha256_alloc(const file_digest_t *digest)
+{
+    struct sha256_ctx ctx;
+    unsigned char bin[SHA256_DIGEST_SIZE];
+
+    if (!(digest->types & FILE_DIGEST_SHA256))
 	return NULL;
-    }
 
-    fclose(file);
+#ifdef HAVE_OPENSSL
+    if (digest->evp_sha256)
+	return evp_hex_alloc(digest->evp_sha256);
+#endif
+    ctx = digest->sha256;
+    sha256_finish_ctx(&ctx, bin);
+    return hex_alloc(bin, sizeof(bin));
+}
+#endif
 
-    for (i=0; i < sha256sum_bin_len; i++) {
-	sha256sum_hex[i*2] = bin2hex[sha256sum_bin[i] >> 4];
-	sha256sum_hex[i*2+1] = bin2hex[sha256sum_bin[i] & 0xf];
-    }
+char *file_md5sum_alloc(const char *file_name)
+{
+    file_digest_t digest;
+    char *md5sum = NULL;
 
-    sha256sum_hex[sha256sum_hex_len] = '\0';
+    file_digest_init(&digest, FILE_DIGEST_MD5);
+    if (file_digest_update_file(&digest, file_name) == 0)
+	md5sum = file_digest_md5_alloc(&digest);
+    file_digest_deinit(&digest);
 
-    return sha256sum_hex;
+    return md5sum;
 }
 
+#ifdef HAVE_SHA256
+char *file_sha256sum_alloc(const char *file_name)
+{
+    file_digest_t digest;
+    char *sha256sum = NULL;
+
+    file_digest_init(&digest, FILE_DIGEST_SHA256);
+    if (file_digest_update_file(&digest, file_name) == 0)
+	sha256sum = file_digest_sha256_alloc(&digest);
+    file_digest_deinit(&digest);
+
+    return sha256sum;
+}
 #endif
 
+/*
+ * Copy src to dest through a user space buffer, feeding digest on the way
+ * so the copy never has to be read back.
+ */
+int
+file_copy_digest(const char *src, const char *dest, file_digest_t *digest)
+{
+    char buf[65536];
+    ssize_t n, w;
+    size_t off;
+    int src_fd, dest_fd, err = -1;
+
+    src_fd = open(src, O_RDONLY);
+    if (src_fd == -1) {
+	opkg_perror(ERROR, "Failed to open file %s", src);
+	return -1;
+    }
+
+    dest_fd = open(dest, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (dest_fd == -1) {
+	opkg_perror(ERROR, "Failed to open file %s", dest);
+	close(src_fd);
+	return -1;
+    }
+
+    while ((n = read(src_fd, buf, sizeof(buf))) != 0) {
+	if (n == -1) {
+	    if (errno == EINTR)
+		continue;
+	    opkg_perror(ERROR, "Failed to read %s", src);
+	    goto out;
+	}
+	for (off = 0; off < n; off += w) {
+	    w = write(dest_fd, buf + off, n - off);
+	    if (w == -1) {
+		if (errno == EINTR) {
+		    w = 0;
+		    continue;
+		}
+		opkg_perror(ERROR, "Failed to write %s", dest);
+		goto out;
+	    }
+	}
+	file_digest_update(digest, buf, n);
+    }
+    err = 0;
+
+out:
+    close(src_fd);
+    if (close(dest_fd) == -1 && !err) {
+	opkg_perror(ERROR, "Failed to close %s", dest);
+	err = -1;
+    }
+    if (err)
+	unlink(dest);
+
+    return err;
+}
 
 int
 rm_r(const char *path)
@@ -18,14 +18,66 @@
 #ifndef FILE_UTIL_H
 #define FILE_UTIL_H
 
+#include "config.h"
+#if defined HAVE_OPENSSL
+#include <openssl/evp.h>
+#endif
+#include "md5.h"
+#if defined HAVE_SHA256
+#include "sha256.h"
+#endif
+
 int file_exists(const char *file_name);
 int file_is_dir(const char *file_name);
 char *file_read_line_alloc(FILE *file);
 int file_move(const char *src, const char *dest);
 int file_copy(const char *src, const char *dest);
+int file_content_equals(const char *file_name, const char *buf, size_t len);
+int file_write_atomic(const char *file_name, const char *buf, size_t len);
 int file_mkdir_hier(const char *path, long mode);
 char *file_md5sum_alloc(const char *file_name);
 char *file_sha256sum_alloc(const char *file_name);
+
+/*
+ * Checksums of a file, any combination of them computed in one pass,
+ * updated as its bytes go past. OpenSSL is used when it is linked in and
+ * provides the algorithm, otherwise the bundled md5.c and sha256.c.
+ */
+enum {
+	FILE_DIGEST_MD5 = 1,
+	FILE_DIGEST_SHA256 = 2,
+};
+#ifdef HAVE_SHA256
+#define FILE_DIGEST_ALL (FILE_DIGEST_MD5 | FILE_DIGEST_SHA256)
+#else
+#define FILE_DIGEST_ALL FILE_DIGEST_MD5
+#endif
+
+typedef struct file_digest file_digest_t;
+struct file_digest {
+	int types;
+#ifdef HAVE_OPENSSL
+	/* NULL where OpenSSL refused the algorithm, e.g. md5 in FIPS mode */
+	EVP_MD_CTX *evp_md5;
+	EVP_MD_CTX *evp_sha256;
+#endif
+	struct md5_ctx md5;
+#ifdef HAVE_SHA256
+	struct sha256_ctx sha256;
+#endif
+};
+
+void file_digest_init(file_digest_t *digest, int types);
+void file_digest_deinit(file_digest_t *digest);
+void file_digest_update(file_digest_t *digest, const void *buf, size_t len);
+int file_digest_update_file(file_digest_t *digest, const char *file_name);
+/* These return NULL if the digest was not asked for at init. */
+char *file_digest_md5_alloc(const file_digest_t *digest);
+#ifdef HAVE_SHA256
+char *file_digest_sha256_alloc(const file_digest_t *digest);
+#endif
+int file_copy_digest(const char *src, const char *dest, file_digest_t *digest);
+
 int rm_r(const char *path);
 
 #endif
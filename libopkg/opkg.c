@@ -27,6 +27,10 @@
 #include "opkg_install.h"
 #include "opkg_configure.h"
 #include "opkg_download.h"
+#include "opkg_cache.h"
+#include "pkg_contents.h"
+#include "conffile.h"
+#include "stat_cache.h"
 #include "opkg_remove.h"
 #include "opkg_upgrade.h"
 
@@ -64,7 +68,8 @@ opkg_configure_packages(char *pkg_name)
 			r = opkg_configure(pkg);
 			if (r == 0) {
 				pkg->state_status = SS_INSTALLED;
-				pkg->parent->state_status = SS_INSTALLED;
+				abstract_pkg_set_state_status(pkg->parent,
+						SS_INSTALLED);
 				pkg->state_flag &= ~SF_PREFER;
 			} else {
 				if (!err)
@@ -144,6 +149,9 @@ err0:
 void
 opkg_free(void)
 {
+	opkg_cache_flush();
+	conffile_cache_flush();
+	stat_cache_flush();
 #ifdef HAVE_CURL
 	opkg_curl_cleanup();
 #endif
@@ -577,6 +585,7 @@ opkg_update_package_lists(opkg_progress_callback_t progress_callback,
 
 	list_for_each_entry(iter, &conf->pkg_src_list.head, node) {
 		char *url, *list_file_name = NULL;
+		int list_err;
 
 		src = (pkg_src_t *) iter->data;
 
@@ -635,6 +644,7 @@ opkg_update_package_lists(opkg_progress_callback_t progress_callback,
 			opkg_msg(ERROR, "Couldn't retrieve %s\n", url);
 			result = -1;
 		}
+		list_err = err;
 		free(url);
 
 #if defined(HAVE_GPGME) || defined(HAVE_OPENSSL)
@@ -660,7 +670,6 @@ opkg_update_package_lists(opkg_progress_callback_t progress_callback,
 			if (err) {
 				opkg_msg(ERROR, "Couldn't retrieve %s\n", url);
 			} else {
-				int err;
 				err = opkg_verify_file(list_file_name,
 						     sig_file_name);
 				if (err == 0) {
@@ -681,6 +690,12 @@ opkg_update_package_lists(opkg_progress_callback_t progress_callback,
 				" has not been enabled in this build\n",
 				list_file_name);
 #endif
+		/* Only a list that was fetched and checked vouches for its
+		 * manifest. */
+		if (list_err || err)
+			pkg_contents_remove(src, lists_dir);
+		else
+			pkg_contents_update(src, lists_dir, tmp);
 		free(list_file_name);
 
 		sources_done++;
@@ -885,3 +900,23 @@ opkg_compare_versions (const char *ver1, const char *ver2)
   return pkg_compare_versions(pkg1, pkg2);
 }
 
+
+/*
+ * Phase timings and counters accumulated since the last
+ * opkg_reset_profile(), see opkg_profile.h.
+ */
+opkg_profile_t
+opkg_get_profile (void)
+{
+  opkg_profile_t profile;
+
+  opkg_profile_get (&profile);
+
+  return profile;
+}
+
+void
+opkg_reset_profile (void)
+{
+  opkg_profile_reset ();
+}
@@ -20,6 +20,7 @@
 
 #include "pkg.h"
 #include "opkg_message.h"
+#include "opkg_profile.h"
 
 typedef struct _opkg_progress_data_t opkg_progress_data_t;
 
@@ -60,4 +61,7 @@ int opkg_repository_accessibility_check(void);
 
 int opkg_compare_versions (const char *ver1, const char *ver2);
 
+opkg_profile_t opkg_get_profile (void);
+void opkg_reset_profile (void);
+
 #endif /* OPKG_H */
@@ -0,0 +1,390 @@
+/* opkg_cache.c - the opkg package management system
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2, or (at
+   your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   Content addressed package cache.
+
+   Packages are stored in the --cache directory under the checksum the
+   feed gave for them, "sha256-<hex>" or "md5-<hex>", so the same package
+   from two mirrors is stored once. Entries are verified as they are
+   added, a hit is trusted without hashing the file again.
+
+   The index file keeps the size and last use of every entry so that
+   option cache_max_size (in kilobytes) can be enforced without scanning
+   the directory. The size is the one verified when the entry was added:
+   an entry that no longer has it, or not the size the feed gives, was
+   cut short or overwritten and is dropped so it is downloaded again.
+*/
+
+#include "config.h"
+
+#include <stdio.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "opkg_cache.h"
+#include "opkg_conf.h"
+#include "opkg_message.h"
+#include "hash_table.h"
+#include "file_util.h"
+#include "sprintf_alloc.h"
+#include "libbb/libbb.h"
+
+#define CACHE_INDEX "index"
+#define CACHE_INDEX_BUCKETS 1024
+
+struct cache_entry {
+	char *key;
+	off_t size;
+	time_t used;
+	int pinned;	/* used by this run, the caller may be reading it */
+};
+
+static hash_table_t index_hash;
+static int index_loaded;
+static int index_dirty;
+static off_t index_total;
+
+static int
+is_hex(const char *s, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		if (!isxdigit((unsigned char)s[i]))
+			return 0;
+
+	return s[len] == '\0';
+}
+
+static int
+key_is_valid(const char *key)
+{
+	if (!strncmp(key, "sha256-", 7))
+		return is_hex(key + 7, 64);
+	if (!strncmp(key, "md5-", 4))
+		return is_hex(key + 4, 32);
+	return 0;
+}
+
+char *
+opkg_cache_key_alloc(pkg_t *pkg)
+{
+	char *key = NULL, *p;
+
+#ifdef HAVE_SHA256
+	if (pkg->sha256sum && is_hex(pkg->sha256sum, 64))
+		sprintf_alloc(&key, "sha256-%s", pkg->sha256sum);
+	else
+#endif
+	if (pkg->md5sum && is_hex(pkg->md5sum, 32))
+		sprintf_alloc(&key, "md5-%s", pkg->md5sum);
+
+	if (key)
+		for (p = key; *p; p++)
+			*p = tolower((unsigned char)*p);
+
+	return key;
+}
+
+static struct cache_entry *
+index_insert(const char *key, off_t size, time_t used)
+{
+	struct cache_entry *e;
+
+	e = xcalloc(1, sizeof(*e));
+	e->key = xstrdup(key);
+	e->size = size;
+	e->used = used;
+
+	hash_table_insert(&index_hash, key, e);
+	index_total += size;
+	index_dirty = 1;
+
+	return e;
+}
+
+static void
+index_remove(struct cache_entry *e)
+{
+	hash_table_remove(&index_hash, e->key);
+	index_total -= e->size;
+	index_dirty = 1;
+
+	free(e->key);
+	free(e);
+}
+
+static void
+index_use(struct cache_entry *e)
+{
+	e->used = time(NULL);
+	e->pinned = 1;
+	index_dirty = 1;
+}
+
+/* Without an index, start from what is in the directory. */
+static void
+index_rebuild(void)
+{
+	DIR *dir;
+	struct dirent *dent;
+	struct stat st;
+	char *path;
+
+	dir = opendir(conf->cache);
+	if (dir == NULL)
+		return;
+
+	while ((dent = readdir(dir)) != NULL) {
+		if (!key_is_valid(dent->d_name))
+			continue;
+		sprintf_alloc(&path, "%s/%s", conf->cache, dent->d_name);
+		if (stat(path, &st) == 0 && S_ISREG(st.st_mode))
+			index_insert(dent->d_name, st.st_size, st.st_mtime);
+		free(path);
+	}
+
+	closedir(dir);
+}
+
+static void
+index_load(void)
+{
+	FILE *fp;
+	char *path, *line;
+	char key[80];
+	long long size;
+	long used;
+
+	if (index_loaded)
+		return;
+
+	hash_table_init("cache-index", &index_hash, CACHE_INDEX_BUCKETS);
+	index_loaded = 1;
+	index_total = 0;
+
+	sprintf_alloc(&path, "%s/%s", conf->cache, CACHE_INDEX);
+	fp = fopen(path, "r");
+	free(path);
+	if (fp == NULL) {
+		index_rebuild();
+		return;
+	}
+
+	while ((line = file_read_line_alloc(fp))) {
+		if (sscanf(line, "%79s %lld %ld", key, &size, &used) == 3
+				&& key_is_valid(key)
+				&& !hash_table_get(&index_hash, key))
+			index_insert(key, size, used);
+		free(line);
+	}
+	fclose(fp);
+
+	index_dirty = 0;
+}
+
+static void
+collect_entry(const char *key, void *entry, void *data)
+{
+	struct cache_entry ***p = data;
+
+	*(*p)++ = entry;
+}
+
+static int
+entry_used_cmp(const void *a, const void *b)
+{
+	const struct cache_entry *ea = *(const struct cache_entry **)a;
+	const struct cache_entry *eb = *(const struct cache_entry **)b;
+
+	if (ea->used != eb->used)
+		return ea->used < eb->used ? -1 : 1;
+	return 0;
+}
+
+/* Drop least recently used entries until the cache fits cache_max_size. */
+static void
+cache_evict(void)
+{
+	struct cache_entry **entries, **p;
+	off_t max = (off_t)conf->cache_max_size * 1024;
+	unsigned int i, n;
+	char *path;
+
+	if (conf->cache_max_size <= 0 || index_total <= max)
+		return;
+
+	entries = xcalloc(index_hash.n_elements + 1, sizeof(*entries));
+	p = entries;
+	hash_table_foreach(&index_hash, collect_entry, &p);
+	n = p - entries;
+	qsort(entries, n, sizeof(*entries), entry_used_cmp);
+
+	for (i = 0; i < n && index_total > max; i++) {
+		if (entries[i]->pinned)
+			continue;
+		sprintf_alloc(&path, "%s/%s", conf->cache, entries[i]->key);
+		opkg_msg(INFO, "Evicting %s from the cache.\n", path);
+		if (unlink(path) == -1 && errno != ENOENT)
+			opkg_perror(ERROR, "Failed to unlink %s", path);
+		free(path);
+		index_remove(entries[i]);
+	}
+
+	free(entries);
+}
+
+char *
+opkg_cache_lookup_alloc(const char *key, off_t size)
+{
+	struct cache_entry *e;
+	struct stat st;
+	char *path;
+
+	index_load();
+
+	e = hash_table_get(&index_hash, key);
+	sprintf_alloc(&path, "%s/%s", conf->cache, key);
+	if (stat(path, &st) == -1 || !S_ISREG(st.st_mode)) {
+		if (e)
+			index_remove(e);
+		free(path);
+		return NULL;
+	}
+
+	if ((e && e->size != st.st_size) || (size && size != st.st_size)) {
+		opkg_msg(NOTICE, "Size of %s is %lld, expected %lld, "
+				"removing it from the cache.\n", path,
+				(long long)st.st_size,
+				(long long)(size ? size : e->size));
+		if (unlink(path) == -1 && errno != ENOENT)
+			opkg_perror(ERROR, "Failed to unlink %s", path);
+		if (e)
+			index_remove(e);
+		free(path);
+		return NULL;
+	}
+
+	if (e == NULL)
+		e = index_insert(key, st.st_size, 0);
+	index_use(e);
+
+	return path;
+}
+
+static char *
+key_checksum_alloc(const char *key, const char *file_name,
+		const file_digest_t *digest)
+{
+#ifdef HAVE_SHA256
+	if (!strncmp(key, "sha256-", 7))
+		return digest ? file_digest_sha256_alloc(digest)
+			: file_sha256sum_alloc(file_name);
+#endif
+	if (!strncmp(key, "md5-", 4))
+		return digest ? file_digest_md5_alloc(digest)
+			: file_md5sum_alloc(file_name);
+
+	return NULL;
+}
+
+char *
+opkg_cache_add(const char *key, const char *file_name,
+		const file_digest_t *digest)
+{
+	struct cache_entry *e;
+	struct stat st;
+	char *sum, *path;
+
+	sum = key_checksum_alloc(key, file_name, digest);
+	if (sum == NULL || strcmp(sum, strchr(key, '-') + 1)) {
+		opkg_msg(ERROR, "Checksum of %s does not match the feed, "
+				"not caching it.\n", file_name);
+		free(sum);
+		unlink(file_name);
+		return NULL;
+	}
+	free(sum);
+
+	index_load();
+
+	sprintf_alloc(&path, "%s/%s", conf->cache, key);
+	if (stat(file_name, &st) == -1 || rename(file_name, path) == -1) {
+		opkg_perror(ERROR, "Failed to rename %s to %s",
+				file_name, path);
+		unlink(file_name);
+		free(path);
+		return NULL;
+	}
+
+	e = hash_table_get(&index_hash, key);
+	if (e)
+		index_remove(e);
+	e = index_insert(key, st.st_size, 0);
+	index_use(e);
+
+	cache_evict();
+
+	return path;
+}
+
+static void
+write_entry(const char *key, void *entry, void *data)
+{
+	struct cache_entry *e = entry;
+
+	fprintf(data, "%s %lld %ld\n", e->key, (long long)e->size,
+			(long)e->used);
+}
+
+static void
+free_entry(const char *key, void *entry, void *data)
+{
+	struct cache_entry *e = entry;
+
+	free(e->key);
+	free(e);
+}
+
+void
+opkg_cache_flush(void)
+{
+	FILE *fp;
+	char *path, *buf = NULL;
+	size_t len = 0;
+
+	if (!index_loaded)
+		return;
+
+	cache_evict();
+
+	if (index_dirty) {
+		fp = open_memstream(&buf, &len);
+		if (fp) {
+			hash_table_foreach(&index_hash, write_entry, fp);
+			fclose(fp);
+			sprintf_alloc(&path, "%s/%s", conf->cache,
+					CACHE_INDEX);
+			file_write_atomic(path, buf, len);
+			free(path);
+			free(buf);
+		}
+	}
+
+	hash_table_foreach(&index_hash, free_entry, NULL);
+	hash_table_deinit(&index_hash);
+	index_loaded = 0;
+	index_dirty = 0;
+}
@@ -0,0 +1,41 @@
+/* opkg_cache.h - the opkg package management system
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2, or (at
+   your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+*/
+
+#ifndef OPKG_CACHE_H
+#define OPKG_CACHE_H
+
+#include "pkg.h"
+#include "file_util.h"
+
+/* Name of pkg in the cache, from its feed checksum, or NULL if it has none. */
+char *opkg_cache_key_alloc(pkg_t *pkg);
+
+/*
+ * Path of key in the cache, or NULL if not cached. Marks key as used. An
+ * entry whose size is not the one it was added with, or not size unless
+ * that is 0, is removed.
+ */
+char *opkg_cache_lookup_alloc(const char *key, off_t size);
+
+/*
+ * Check file_name against the checksum in key and move it into the cache.
+ * digest, if not NULL, holds the checksums of file_name taken while it was
+ * written. Returns the cached path, or NULL if the checksum does not match.
+ */
+char *opkg_cache_add(const char *key, const char *file_name,
+		const file_digest_t *digest);
+
+/* Write back the cache index. */
+void opkg_cache_flush(void);
+
+#endif
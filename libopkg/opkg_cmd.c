@@ -31,6 +31,7 @@
 #include "pkg.h"
 #include "pkg_dest.h"
 #include "pkg_parse.h"
+#include "pkg_contents.h"
 #include "sprintf_alloc.h"
 #include "pkg.h"
 #include "file_util.h"
@@ -150,6 +151,7 @@ opkg_update_cmd(int argc, char **argv)
 
      for (iter = void_list_first(&conf->pkg_src_list); iter; iter = void_list_next(&conf->pkg_src_list, iter)) {
 	  char *url, *list_file_name;
+	  int list_err;
 
 	  src = (pkg_src_t *)iter->data;
 
@@ -192,6 +194,7 @@ opkg_update_cmd(int argc, char **argv)
 	       opkg_msg(NOTICE, "Updated list of available packages in %s.\n",
 			    list_file_name);
 	  }
+	  list_err = err;
 	  free(url);
 #if defined(HAVE_GPGME) || defined(HAVE_OPENSSL)
           if (conf->check_signature) {
@@ -234,6 +237,11 @@ opkg_update_cmd(int argc, char **argv)
 #else
           // Do nothing
 #endif
+	  /* Only a list that was fetched and checked vouches for its manifest. */
+	  if (list_err || err)
+	       pkg_contents_remove(src, lists_dir);
+	  else
+	       pkg_contents_update(src, lists_dir, tmp);
 	  free(list_file_name);
      }
      rmdir (tmp);
@@ -449,7 +457,7 @@ opkg_configure_packages(char *pkg_name)
 	       r = opkg_configure(pkg);
 	       if (r == 0) {
 		    pkg->state_status = SS_INSTALLED;
-		    pkg->parent->state_status = SS_INSTALLED;
+		    abstract_pkg_set_state_status(pkg->parent, SS_INSTALLED);
 		    pkg->state_flag &= ~SF_PREFER;
 		    opkg_state_changed++;
 	       } else {
@@ -796,7 +804,7 @@ opkg_remove_cmd(int argc, char **argv)
      int i, a, done, err = 0;
      pkg_t *pkg;
      pkg_t *pkg_to_remove;
-     pkg_vec_t *available;
+     pkg_vec_t *available, *to_remove;
 
      done = 0;
 
@@ -804,6 +812,7 @@ opkg_remove_cmd(int argc, char **argv)
 
      pkg_info_preinstall_check();
 
+     to_remove = pkg_vec_alloc();
      available = pkg_vec_alloc();
      pkg_hash_fetch_all_installed(available);
 
@@ -830,13 +839,19 @@ opkg_remove_cmd(int argc, char **argv)
                  continue;
             }
 
-            if (opkg_remove_pkg(pkg_to_remove, 0))
-	         err = -1;
-	    else
-                 done = 1;
+            pkg_vec_insert(to_remove, pkg_to_remove);
         }
      }
 
+     /* Removed as one set, so they may depend on each other. */
+     if (opkg_remove_pkgs(to_remove, 0))
+          err = -1;
+     for (a=0; a<to_remove->len; a++) {
+          if (to_remove->pkgs[a]->state_status == SS_NOT_INSTALLED)
+               done = 1;
+     }
+
+     pkg_vec_free(to_remove);
      pkg_vec_free(available);
 
      if (done == 0)
@@ -1263,40 +1278,60 @@ opkg_print_architecture_cmd(int argc, char **argv)
 /* XXX: CLEANUP: The usage strings should be incorporated into this
    array for easier maintenance */
 static opkg_cmd_t cmds[] = {
-     {"update", 0, (opkg_cmd_fun_t)opkg_update_cmd, PFM_DESCRIPTION|PFM_SOURCE},
-     {"upgrade", 0, (opkg_cmd_fun_t)opkg_upgrade_cmd, PFM_DESCRIPTION|PFM_SOURCE},
-     {"list", 0, (opkg_cmd_fun_t)opkg_list_cmd, PFM_SOURCE},
-     {"list_installed", 0, (opkg_cmd_fun_t)opkg_list_installed_cmd, PFM_SOURCE},
-     {"list-installed", 0, (opkg_cmd_fun_t)opkg_list_installed_cmd, PFM_SOURCE},
-     {"list_upgradable", 0, (opkg_cmd_fun_t)opkg_list_upgradable_cmd, PFM_SOURCE},
-     {"list-upgradable", 0, (opkg_cmd_fun_t)opkg_list_upgradable_cmd, PFM_SOURCE},
-     {"list_changed_conffiles", 0, (opkg_cmd_fun_t)opkg_list_changed_conffiles_cmd, PFM_SOURCE},
-     {"list-changed-conffiles", 0, (opkg_cmd_fun_t)opkg_list_changed_conffiles_cmd, PFM_SOURCE},
-     {"info", 0, (opkg_cmd_fun_t)opkg_info_cmd, 0},
-     {"flag", 1, (opkg_cmd_fun_t)opkg_flag_cmd, PFM_DESCRIPTION|PFM_SOURCE},
-     {"status", 0, (opkg_cmd_fun_t)opkg_status_cmd, PFM_DESCRIPTION|PFM_SOURCE},
-     {"install", 1, (opkg_cmd_fun_t)opkg_install_cmd, PFM_DESCRIPTION|PFM_SOURCE},
-     {"remove", 1, (opkg_cmd_fun_t)opkg_remove_cmd, PFM_DESCRIPTION|PFM_SOURCE},
-     {"configure", 0, (opkg_cmd_fun_t)opkg_configure_cmd, PFM_DESCRIPTION|PFM_SOURCE},
-     {"files", 1, (opkg_cmd_fun_t)opkg_files_cmd, PFM_DESCRIPTION|PFM_SOURCE},
-     {"search", 1, (opkg_cmd_fun_t)opkg_search_cmd, PFM_DESCRIPTION|PFM_SOURCE},
-     {"download", 1, (opkg_cmd_fun_t)opkg_download_cmd, PFM_DESCRIPTION|PFM_SOURCE},
-     {"compare_versions", 1, (opkg_cmd_fun_t)opkg_compare_versions_cmd, PFM_DESCRIPTION|PFM_SOURCE},
-     {"compare-versions", 1, (opkg_cmd_fun_t)opkg_compare_versions_cmd, PFM_DESCRIPTION|PFM_SOURCE},
-     {"print-architecture", 0, (opkg_cmd_fun_t)opkg_print_architecture_cmd, PFM_DESCRIPTION|PFM_SOURCE},
-     {"print_architecture", 0, (opkg_cmd_fun_t)opkg_print_architecture_cmd, PFM_DESCRIPTION|PFM_SOURCE},
-     {"print-installation-architecture", 0, (opkg_cmd_fun_t)opkg_print_architecture_cmd, PFM_DESCRIPTION|PFM_SOURCE},
-     {"print_installation_architecture", 0, (opkg_cmd_fun_t)opkg_print_architecture_cmd, PFM_DESCRIPTION|PFM_SOURCE},
-     {"depends", 1, (opkg_cmd_fun_t)opkg_depends_cmd, PFM_DESCRIPTION|PFM_SOURCE},
-     {"whatdepends", 1, (opkg_cmd_fun_t)opkg_whatdepends_cmd, PFM_DESCRIPTION|PFM_SOURCE},
-     {"whatdependsrec", 1, (opkg_cmd_fun_t)opkg_whatdepends_recursively_cmd, PFM_DESCRIPTION|PFM_SOURCE},
-     {"whatrecommends", 1, (opkg_cmd_fun_t)opkg_whatrecommends_cmd, PFM_DESCRIPTION|PFM_SOURCE},
-     {"whatsuggests", 1, (opkg_cmd_fun_t)opkg_whatsuggests_cmd, PFM_DESCRIPTION|PFM_SOURCE},
-     {"whatprovides", 1, (opkg_cmd_fun_t)opkg_whatprovides_cmd, PFM_DESCRIPTION|PFM_SOURCE},
-     {"whatreplaces", 1, (opkg_cmd_fun_t)opkg_whatreplaces_cmd, PFM_DESCRIPTION|PFM_SOURCE},
-     {"whatconflicts", 1, (opkg_cmd_fun_t)opkg_whatconflicts_cmd, PFM_DESCRIPTION|PFM_SOURCE},
+     {"update", 0, (opkg_cmd_fun_t)opkg_update_cmd, PFM_DESCRIPTION|PFM_SOURCE, 0},
+     {"upgrade", 0, (opkg_cmd_fun_t)opkg_upgrade_cmd, PFM_DESCRIPTION|PFM_SOURCE, 0},
+     {"list", 0, (opkg_cmd_fun_t)opkg_list_cmd, PFM_SOURCE, 1},
+     {"list_installed", 0, (opkg_cmd_fun_t)opkg_list_installed_cmd, PFM_SOURCE, 1},
+     {"list-installed", 0, (opkg_cmd_fun_t)opkg_list_installed_cmd, PFM_SOURCE, 1},
+     {"list_upgradable", 0, (opkg_cmd_fun_t)opkg_list_upgradable_cmd, PFM_SOURCE, 1},
+     {"list-upgradable", 0, (opkg_cmd_fun_t)opkg_list_upgradable_cmd, PFM_SOURCE, 1},
+     {"list_changed_conffiles", 0, (opkg_cmd_fun_t)opkg_list_changed_conffiles_cmd, PFM_SOURCE, 1},
+     {"list-changed-conffiles", 0, (opkg_cmd_fun_t)opkg_list_changed_conffiles_cmd, PFM_SOURCE, 1},
+     {"info", 0, (opkg_cmd_fun_t)opkg_info_cmd, 0, 1},
+     {"flag", 1, (opkg_cmd_fun_t)opkg_flag_cmd, PFM_DESCRIPTION|PFM_SOURCE, 0},
+     {"status", 0, (opkg_cmd_fun_t)opkg_status_cmd, PFM_DESCRIPTION|PFM_SOURCE, 1},
+     {"install", 1, (opkg_cmd_fun_t)opkg_install_cmd, PFM_DESCRIPTION|PFM_SOURCE, 0},
+     {"remove", 1, (opkg_cmd_fun_t)opkg_remove_cmd, PFM_DESCRIPTION|PFM_SOURCE, 0},
+     {"configure", 0, (opkg_cmd_fun_t)opkg_configure_cmd, PFM_DESCRIPTION|PFM_SOURCE, 0},
+     {"files", 1, (opkg_cmd_fun_t)opkg_files_cmd, PFM_DESCRIPTION|PFM_SOURCE, 1},
+     {"search", 1, (opkg_cmd_fun_t)opkg_search_cmd, PFM_DESCRIPTION|PFM_SOURCE, 1},
+     {"download", 1, (opkg_cmd_fun_t)opkg_download_cmd, PFM_DESCRIPTION|PFM_SOURCE, 0},
+     {"compare_versions", 1, (opkg_cmd_fun_t)opkg_compare_versions_cmd, PFM_DESCRIPTION|PFM_SOURCE, 1},
+     {"compare-versions", 1, (opkg_cmd_fun_t)opkg_compare_versions_cmd, PFM_DESCRIPTION|PFM_SOURCE, 1},
+     {"print-architecture", 0, (opkg_cmd_fun_t)opkg_print_architecture_cmd, PFM_DESCRIPTION|PFM_SOURCE, 1},
+     {"print_architecture", 0, (opkg_cmd_fun_t)opkg_print_architecture_cmd, PFM_DESCRIPTION|PFM_SOURCE, 1},
+     {"print-installation-architecture", 0, (opkg_cmd_fun_t)opkg_print_architecture_cmd, PFM_DESCRIPTION|PFM_SOURCE, 1},
+     {"print_installation_architecture", 0, (opkg_cmd_fun_t)opkg_print_architecture_cmd, PFM_DESCRIPTION|PFM_SOURCE, 1},
+     {"depends", 1, (opkg_cmd_fun_t)opkg_depends_cmd, PFM_DESCRIPTION|PFM_SOURCE, 1},
+     {"whatdepends", 1, (opkg_cmd_fun_t)opkg_whatdepends_cmd, PFM_DESCRIPTION|PFM_SOURCE, 1},
+     {"whatdependsrec", 1, (opkg_cmd_fun_t)opkg_whatdepends_recursively_cmd, PFM_DESCRIPTION|PFM_SOURCE, 1},
+     {"whatrecommends", 1, (opkg_cmd_fun_t)opkg_whatrecommends_cmd, PFM_DESCRIPTION|PFM_SOURCE, 1},
+     {"whatsuggests", 1, (opkg_cmd_fun_t)opkg_whatsuggests_cmd, PFM_DESCRIPTION|PFM_SOURCE, 1},
+     {"whatprovides", 1, (opkg_cmd_fun_t)opkg_whatprovides_cmd, PFM_DESCRIPTION|PFM_SOURCE, 1},
+     {"whatreplaces", 1, (opkg_cmd_fun_t)opkg_whatreplaces_cmd, PFM_DESCRIPTION|PFM_SOURCE, 1},
+     {"whatconflicts", 1, (opkg_cmd_fun_t)opkg_whatconflicts_cmd, PFM_DESCRIPTION|PFM_SOURCE, 1},
 };
 
+/* Commands which only look at installed packages do not load the feeds. */
+int
+opkg_cmd_reads_feeds(const char *name)
+{
+	static const char *no_feeds[] = {
+		"flag", "configure", "remove", "files", "search",
+		"compare_versions", "compare-versions",
+		"list_installed", "list-installed",
+		"list_changed_conffiles", "list-changed-conffiles",
+		"status",
+	};
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(no_feeds); i++)
+		if (strcmp(name, no_feeds[i]) == 0)
+			return 0;
+
+	return 1;
+}
+
 opkg_cmd_t *
 opkg_cmd_find(const char *name)
 {
@@ -26,10 +26,12 @@ struct opkg_cmd
     int requires_args;
     opkg_cmd_fun_t fun;
     unsigned int pfm; /* package field mask */
+    int query; /* read-only, may be served by opkgd */
 };
 typedef struct opkg_cmd opkg_cmd_t;
 
 opkg_cmd_t *opkg_cmd_find(const char *name);
+int opkg_cmd_reads_feeds(const char *name);
 int opkg_cmd_exec(opkg_cmd_t *cmd, int argc, const char **argv);
 
 extern int opkg_state_changed;
@@ -28,6 +28,8 @@
 #include "opkg_conf.h"
 #include "pkg_vec.h"
 #include "pkg.h"
+#include "pkg_hash.h"
+#include "opkg_profile.h"
 #include "xregex.h"
 #include "sprintf_alloc.h"
 #include "opkg_message.h"
@@ -35,7 +37,12 @@
 #include "opkg_defines.h"
 #include "libbb/libbb.h"
 
-static int lock_fd;
+/* How long a writer waits for queries to let go of the lock: 10s. */
+#define LOCK_WAIT_TRIES 200
+#define LOCK_WAIT_USEC 50000
+
+static int lock_fd = -1;
+static int lock_exclusive;
 static char *lock_file = NULL;
 
 static opkg_conf_t _conf;
@@ -46,6 +53,7 @@ opkg_conf_t *conf = &_conf;
  */
 opkg_option_t options[] = {
 	  { "cache", OPKG_OPT_TYPE_STRING, &_conf.cache},
+	  { "cache_max_size", OPKG_OPT_TYPE_INT, &_conf.cache_max_size },
 	  { "force_defaults", OPKG_OPT_TYPE_BOOL, &_conf.force_defaults },
           { "force_maintainer", OPKG_OPT_TYPE_BOOL, &_conf.force_maintainer },
 	  { "force_depends", OPKG_OPT_TYPE_BOOL, &_conf.force_depends },
@@ -66,7 +74,9 @@ opkg_option_t options[] = {
 	  { "overlay_root", OPKG_OPT_TYPE_STRING, &_conf.overlay_root },
 	  { "proxy_passwd", OPKG_OPT_TYPE_STRING, &_conf.proxy_passwd },
 	  { "proxy_user", OPKG_OPT_TYPE_STRING, &_conf.proxy_user },
+	  { "profile", OPKG_OPT_TYPE_BOOL, &_conf.profile },
 	  { "query-all", OPKG_OPT_TYPE_BOOL, &_conf.query_all },
+	  { "status_journal_max", OPKG_OPT_TYPE_INT, &_conf.status_journal_max },
 	  { "tmp_dir", OPKG_OPT_TYPE_STRING, &_conf.tmp_dir },
 	  { "verbosity", OPKG_OPT_TYPE_INT, &_conf.verbosity },
 #if defined(HAVE_OPENSSL)
@@ -355,61 +365,255 @@ err0:
      return err;
 }
 
+/* We don't need most uninstalled packages in the status file */
+static int
+status_file_wants(pkg_t *pkg)
+{
+     return !(pkg->state_status == SS_NOT_INSTALLED
+	      && (pkg->state_want == SW_UNKNOWN
+		  || (pkg->state_want == SW_DEINSTALL
+			  && pkg->state_flag != SF_HOLD)
+		  || pkg->state_want == SW_PURGE));
+}
+
+/* A package needs a journal record if its state changed since last written */
+static int
+status_journal_wants(pkg_t *pkg)
+{
+     if (pkg_state_is_recorded(pkg))
+	  return 0;
+
+     return pkg->recorded.valid || status_file_wants(pkg);
+}
+
+/* Append len bytes of buf to the status journal of dest and sync it */
+static int
+status_journal_write(pkg_dest_t *dest, const char *buf, size_t len)
+{
+     size_t off = 0;
+     ssize_t n;
+     int fd, ret = 0;
+
+     fd = open(dest->status_journal_name, O_WRONLY | O_APPEND);
+     if (fd == -1) {
+	  opkg_perror(ERROR, "Failed to open %s", dest->status_journal_name);
+	  return 1;
+     }
+
+     while (off < len) {
+	  n = write(fd, buf + off, len - off);
+	  if (n == -1) {
+	       if (errno == EINTR)
+		    continue;
+	       opkg_perror(ERROR, "Failed to write %s",
+			       dest->status_journal_name);
+	       ret = 1;
+	       break;
+	  }
+	  off += n;
+     }
+
+     if (ret == 0 && fsync(fd) == -1) {
+	  opkg_perror(ERROR, "Failed to sync %s", dest->status_journal_name);
+	  ret = 1;
+     }
+
+     close(fd);
+
+     return ret;
+}
+
+/* Whether the journal of dest starts with header, i.e. extends its status */
+static int
+status_journal_current(pkg_dest_t *dest, const char *header)
+{
+     FILE *fp;
+     char *buf;
+     size_t len = strlen(header);
+     int ret;
+
+     fp = fopen(dest->status_journal_name, "r");
+     if (fp == NULL)
+	  return 0;
+
+     buf = xmalloc(len);
+     ret = fread(buf, 1, len, fp) == len && memcmp(buf, header, len) == 0;
+     fclose(fp);
+     free(buf);
+
+     return ret;
+}
+
+/*
+ * Append the packages whose state has changed to the status journal, or
+ * start a new one if it does not extend the current status file.
+ * Returns 1 if the status file should be rewritten instead, either because
+ * the journal has grown too large or because it couldn't be written.
+ */
+static int
+append_status_journal(pkg_dest_t *dest, pkg_vec_t *pkgs)
+{
+     struct stat st;
+     FILE *fp;
+     char *buf = NULL, *header;
+     size_t len = 0, header_len = 0;
+     int i, ret;
+
+     if (stat(dest->status_file_name, &st) == -1)
+	  return 1;
+
+     header = pkg_dest_journal_header(&st);
+     if (!status_journal_current(dest, header)
+		     || stat(dest->status_journal_name, &st) == -1) {
+	  header_len = strlen(header);
+	  st.st_size = 0;
+     }
+
+     fp = open_memstream(&buf, &len);
+     if (fp == NULL) {
+	  free(header);
+	  return 1;
+     }
+
+     fwrite(header, 1, header_len, fp);
+     free(header);
+
+     for (i = 0; i < pkgs->len; i++) {
+	  if (pkgs->pkgs[i]->dest == dest && status_journal_wants(pkgs->pkgs[i]))
+	       pkg_print_status(pkgs->pkgs[i], fp);
+     }
+
+     if (fclose(fp) == EOF) {
+	  free(buf);
+	  return 1;
+     }
+
+     if (len == header_len) {
+	  opkg_msg(DEBUG, "Status journal %s is up to date.\n",
+		       dest->status_journal_name);
+	  free(buf);
+	  return 0;
+     }
+
+     if (st.st_size + len > conf->status_journal_max) {
+	  opkg_msg(INFO, "Compacting status journal %s.\n",
+		       dest->status_journal_name);
+	  free(buf);
+	  return 1;
+     }
+
+     if (header_len) {
+	  /* Replaced whole, a query never sees it without its header. */
+	  ret = file_write_atomic(dest->status_journal_name, buf, len) ? 1 : 0;
+     } else {
+	  ret = status_journal_write(dest, buf, len);
+     }
+     free(buf);
+
+     if (ret)
+	  return ret;
+
+     for (i = 0; i < pkgs->len; i++) {
+	  if (pkgs->pkgs[i]->dest == dest && status_journal_wants(pkgs->pkgs[i]))
+	       pkg_mark_state_recorded(pkgs->pkgs[i]);
+     }
+
+     return 0;
+}
+
+static int
+write_status_file(pkg_dest_t *dest, pkg_vec_t *pkgs)
+{
+     FILE *fp;
+     char *buf = NULL;
+     size_t len = 0;
+     int i;
+
+     fp = open_memstream(&buf, &len);
+     if (fp == NULL) {
+	  opkg_perror(ERROR, "Failed to buffer status file %s",
+		       dest->status_file_name);
+	  return -1;
+     }
+
+     for (i = 0; i < pkgs->len; i++) {
+	  if (pkgs->pkgs[i]->dest == dest && status_file_wants(pkgs->pkgs[i]))
+	       pkg_print_status(pkgs->pkgs[i], fp);
+     }
+
+     if (fclose(fp) == EOF) {
+	  opkg_perror(ERROR, "Failed to buffer status file %s",
+		       dest->status_file_name);
+	  free(buf);
+	  return -1;
+     }
+
+     if (file_content_equals(dest->status_file_name, buf, len)) {
+	  opkg_msg(DEBUG, "Status file %s is unchanged.\n",
+		       dest->status_file_name);
+     } else if (file_write_atomic(dest->status_file_name, buf, len)) {
+	  free(buf);
+	  return (errno == EROFS) ? 0 : -1;
+     }
+
+     free(buf);
+
+     /* The status file now holds everything the journal did. */
+     if (unlink(dest->status_journal_name) == -1 && errno != ENOENT)
+	  opkg_perror(ERROR, "Couldn't unlink %s", dest->status_journal_name);
+
+     for (i = 0; i < pkgs->len; i++) {
+	  if (pkgs->pkgs[i]->dest != dest)
+	       continue;
+	  if (status_file_wants(pkgs->pkgs[i]))
+	       pkg_mark_state_recorded(pkgs->pkgs[i]);
+	  else
+	       pkgs->pkgs[i]->recorded.valid = 0;
+     }
+
+     return 0;
+}
+
 int
 opkg_conf_write_status_files(void)
 {
      pkg_dest_list_elt_t *iter;
      pkg_dest_t *dest;
-     pkg_vec_t *all;
+     pkg_vec_t *pkgs;
      pkg_t *pkg;
      int i, ret = 0;
 
      if (conf->noaction)
 	  return 0;
 
-     list_for_each_entry(iter, &conf->pkg_dest_list.head, node) {
-          dest = (pkg_dest_t *)iter->data;
-
-          dest->status_fp = fopen(dest->status_file_name, "w");
-          if (dest->status_fp == NULL && errno != EROFS) {
-               opkg_perror(ERROR, "Can't open status file %s",
-                    dest->status_file_name);
-               ret = -1;
-          }
-     }
+     opkg_profile_begin(OPKG_PROFILE_STATUS_WRITE);
 
-     all = pkg_vec_alloc();
-     pkg_hash_fetch_available(all);
+     pkgs = pkg_vec_alloc();
+     pkg_hash_fetch_status_set(pkgs);
 
-     for(i = 0; i < all->len; i++) {
-	  pkg = all->pkgs[i];
-	  /* We don't need most uninstalled packages in the status file */
-	  if (pkg->state_status == SS_NOT_INSTALLED
-	      && (pkg->state_want == SW_UNKNOWN
-		  || (pkg->state_want == SW_DEINSTALL
-			  && pkg->state_flag != SF_HOLD)
-		  || pkg->state_want == SW_PURGE)) {
-	       continue;
-	  }
-	  if (pkg->dest == NULL) {
+     for(i = 0; i < pkgs->len; i++) {
+	  pkg = pkgs->pkgs[i];
+	  if (pkg->dest == NULL && status_file_wants(pkg)) {
 	       opkg_msg(ERROR, "Internal error: package %s has a NULL dest\n",
 		       pkg->name);
-	       continue;
 	  }
-	  if (pkg->dest->status_fp)
-	       pkg_print_status(pkg, pkg->dest->status_fp);
      }
 
-     pkg_vec_free(all);
-
      list_for_each_entry(iter, &conf->pkg_dest_list.head, node) {
           dest = (pkg_dest_t *)iter->data;
-          if (dest->status_fp && fclose(dest->status_fp) == EOF) {
-               opkg_perror(ERROR, "Couldn't close %s", dest->status_file_name);
+
+	  if (conf->status_journal_max > 0
+			  && append_status_journal(dest, pkgs) == 0)
+	       continue;
+
+          if (write_status_file(dest, pkgs))
 	       ret = -1;
-          }
      }
 
+     pkg_vec_free(pkgs);
+
+     opkg_profile_end(OPKG_PROFILE_STATUS_WRITE);
+
      return ret;
 }
 
@@ -446,8 +650,137 @@ opkg_conf_init(void)
 	return 0;
 }
 
+/*
+ * Whether lock_fd is still the file named lock_file. The holder of the
+ * exclusive lock unlinks the file when it lets go, as opkg always has, so
+ * a process that opened it just before then holds a lock on a file nobody
+ * else will open.
+ */
+static int
+lock_file_current(void)
+{
+	struct stat fd_st, path_st;
+
+	if (fstat(lock_fd, &fd_st) == -1 || stat(lock_file, &path_st) == -1)
+		return 0;
+
+	return fd_st.st_dev == path_st.st_dev && fd_st.st_ino == path_st.st_ino;
+}
+
+/*
+ * Lock the package database: shared for query commands, exclusive for
+ * commands that change it.
+ *
+ * A query that finds the database being changed carries on without the
+ * lock, reported at INFO level. Status files and fresh journals are
+ * replaced by rename, journals are otherwise only appended to and name the
+ * status file they extend in their header, so it replays no journal over
+ * a status file that has already absorbed it. It must leave both alone;
+ * only the holder of the exclusive lock trims or compacts the journal, see
+ * load_dest_status() in pkg_hash.c.
+ */
 int
-opkg_conf_load(void)
+opkg_conf_lock(void)
+{
+	struct flock fl, held;
+	int ret, tries;
+
+	if (lock_fd != -1)
+		return 0;
+
+retry:
+	lock_fd = open(lock_file, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP);
+	if (lock_fd == -1 && conf->lock_shared)
+		lock_fd = open(lock_file, O_RDONLY);
+	if (lock_fd == -1) {
+		if (conf->lock_shared)
+			opkg_msg(INFO, "Could not open lock file %s: %s.\n",
+					lock_file, strerror(errno));
+		else
+			opkg_perror(ERROR, "Could not create lock file %s",
+					lock_file);
+		return -1;
+	}
+
+	memset(&fl, 0, sizeof(fl));
+	fl.l_type = conf->lock_shared ? F_RDLCK : F_WRLCK;
+	fl.l_whence = SEEK_SET;
+
+	/* Queries only hold the lock while they parse the status files, so
+	 * wait for them rather than fail. Not for a writer that takes the
+	 * lock meanwhile: that one fails us as it always did. */
+	for (tries = 0; ; tries++) {
+		ret = fcntl(lock_fd, F_SETLK, &fl);
+		if (ret == 0 || conf->lock_shared
+				|| tries == LOCK_WAIT_TRIES)
+			break;
+		held = fl;
+		if (fcntl(lock_fd, F_GETLK, &held) == -1)
+			break;
+		if (held.l_type == F_UNLCK)
+			continue;
+		if (held.l_type != F_RDLCK) {
+			errno = EAGAIN;
+			break;
+		}
+		if (tries == 0)
+			opkg_msg(INFO, "Waiting for queries to release %s.\n",
+					lock_file);
+		usleep(LOCK_WAIT_USEC);
+	}
+
+	if (ret == -1) {
+		if (conf->lock_shared)
+			opkg_msg(INFO, "Package database is being changed, "
+					"reading the last committed state.\n");
+		else
+			opkg_perror(ERROR, "Could not lock %s", lock_file);
+		if (close(lock_fd) == -1)
+			opkg_perror(ERROR, "Couldn't close descriptor %d (%s)",
+				lock_fd, lock_file);
+		lock_fd = -1;
+		return -1;
+	}
+
+	if (!lock_file_current()) {
+		close(lock_fd);
+		lock_fd = -1;
+		goto retry;
+	}
+	lock_exclusive = !conf->lock_shared;
+
+	return 0;
+}
+
+void
+opkg_conf_unlock(void)
+{
+	struct flock fl;
+
+	if (lock_fd == -1)
+		return;
+
+	/* Nobody else holds it, and anyone who opened it meanwhile finds it
+	 * gone once they have the lock. */
+	if (lock_exclusive && unlink(lock_file) == -1 && errno != ENOENT)
+		opkg_perror(ERROR, "Couldn't unlink %s", lock_file);
+	lock_exclusive = 0;
+
+	memset(&fl, 0, sizeof(fl));
+	fl.l_type = F_UNLCK;
+	fl.l_whence = SEEK_SET;
+
+	if (fcntl(lock_fd, F_SETLK, &fl) == -1)
+		opkg_perror(ERROR, "Couldn't unlock %s", lock_file);
+
+	if (close(lock_fd) == -1)
+		opkg_perror(ERROR, "Couldn't close descriptor %d (%s)",
+				lock_fd, lock_file);
+	lock_fd = -1;
+}
+
+static int
+conf_load(void)
 {
 	int i, glob_ret;
 	char *tmp, *tmp_dir_base, **tmp_val;
@@ -513,20 +846,8 @@ opkg_conf_load(void)
 	else
 		sprintf_alloc (&lock_file, "%s", OPKGLOCKFILE);
 
-	lock_fd = creat(lock_file, S_IRUSR | S_IWUSR | S_IRGRP);
-	if (lock_fd == -1) {
-		opkg_perror(ERROR, "Could not create lock file %s", lock_file);
-		goto err2;
-	}
-
-	if (lockf(lock_fd, F_TLOCK, (off_t)0) == -1) {
-		opkg_perror(ERROR, "Could not lock %s", lock_file);
-		if (close(lock_fd) == -1)
-			opkg_perror(ERROR, "Couldn't close descriptor %d (%s)",
-				lock_fd, lock_file);
-		lock_fd = -1;
+	if (opkg_conf_lock() && !conf->lock_shared)
 		goto err2;
-	}
 
 	if (conf->tmp_dir)
 		tmp_dir_base = conf->tmp_dir;
@@ -589,14 +910,7 @@ err4:
 	if (rmdir(conf->tmp_dir) == -1)
 		opkg_perror(ERROR, "Couldn't remove dir %s", conf->tmp_dir);
 err3:
-	if (lockf(lock_fd, F_ULOCK, (off_t)0) == -1)
-		opkg_perror(ERROR, "Couldn't unlock %s", lock_file);
-
-	if (close(lock_fd) == -1)
-		opkg_perror(ERROR, "Couldn't close descriptor %d (%s)",
-				lock_fd, lock_file);
-	if (unlink(lock_file) == -1)
-		opkg_perror(ERROR, "Couldn't unlink %s", lock_file);
+	opkg_conf_unlock();
 err2:
 	if (lock_file) {
 		free(lock_file);
@@ -627,6 +941,18 @@ err0:
 	return -1;
 }
 
+int
+opkg_conf_load(void)
+{
+	int ret;
+
+	opkg_profile_begin(OPKG_PROFILE_CONF_LOAD);
+	ret = conf_load();
+	opkg_profile_end(OPKG_PROFILE_CONF_LOAD);
+
+	return ret;
+}
+
 void
 opkg_conf_deinit(void)
 {
@@ -670,20 +996,10 @@ opkg_conf_deinit(void)
 	hash_table_deinit(&conf->file_hash);
 	hash_table_deinit(&conf->obs_file_hash);
 
-	if (lock_fd != -1) {
-		if (lockf(lock_fd, F_ULOCK, (off_t)0) == -1)
-			opkg_perror(ERROR, "Couldn't unlock %s", lock_file);
-
-		if (close(lock_fd) == -1)
-			opkg_perror(ERROR, "Couldn't close descriptor %d (%s)",
-					lock_fd, lock_file);
-
-	}
+	opkg_conf_unlock();
 
 	if (lock_file) {
-		if (unlink(lock_file) == -1)
-			opkg_perror(ERROR, "Couldn't unlink %s", lock_file);
-
 		free(lock_file);
+		lock_file = NULL;
 	}
 }
@@ -60,6 +60,7 @@ struct opkg_conf
      char *lists_dir;
 
      unsigned int pfm; /* package field mask */
+     int lock_shared; /* read-only command, take a shared lock */
 
      /* For libopkg users to capture messages. */
      void (*opkg_vmessage)(int, const char *fmt, va_list ap);
@@ -87,6 +88,9 @@ struct opkg_conf
      int noaction;
      int download_only;
      char *cache;
+     int cache_max_size; /* kilobytes, 0 for no limit */
+     int status_journal_max; /* bytes, 0 disables the status journal */
+     int profile; /* print phase timings and counters on exit */
 
 #ifdef HAVE_SSLCURL
      /* some options could be used by
@@ -139,6 +143,8 @@ struct opkg_option {
 int opkg_conf_init(void);
 int opkg_conf_load(void);
 void opkg_conf_deinit(void);
+int opkg_conf_lock(void);
+void opkg_conf_unlock(void);
 
 int opkg_conf_write_status_files(void);
 char *root_filename_alloc(char *filename);
@@ -0,0 +1,719 @@
+/* opkg_daemon.c - the opkg package management system
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2, or (at
+   your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+*/
+
+/*
+ * opkgd keeps the package database parsed in memory and answers query
+ * commands on a UNIX socket.
+ *
+ * A request is a 32 bit length followed by that many bytes of NUL
+ * terminated strings: "<verbosity> <query_all>", the client's offline root
+ * and configuration file (empty when not given), the command name and its
+ * arguments. The client's stdout and stderr travel with the length as
+ * SCM_RIGHTS, so each command is run in a forked child writing straight
+ * to the client's terminal. The child replies with two bytes: whether it
+ * served the request, which it does not for another root or configuration
+ * than its own, and the exit status.
+ *
+ * Mutating commands are never served; they run in opkg-cl under the
+ * exclusive lock as before. The daemon takes the lock shared, and only
+ * while it reparses the status files and feed lists after inotify reports
+ * a change to them.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <libgen.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#endif
+
+#include "opkg_daemon.h"
+#include "opkg_cmd.h"
+#include "opkg_conf.h"
+#include "opkg_defines.h"
+#include "opkg_message.h"
+#include "pkg_hash.h"
+#include "pkg_parse.h"
+#include "file_util.h"
+#include "sprintf_alloc.h"
+#include "libbb/libbb.h"
+
+/* Largest request accepted, arguments included. */
+#define OPKGD_MAX_REQUEST (256 * 1024)
+/* How long a connected client may take to send its request. */
+#define OPKGD_RECV_TIMEOUT 5
+
+union fd_control {
+	struct cmsghdr align;
+	char buf[CMSG_SPACE(2 * sizeof(int))];
+};
+
+static volatile sig_atomic_t terminate;
+static int db_stale;
+/* The installed packages alone, for the commands that skip the feeds. */
+static pkg_hash_db_t status_db;
+#ifdef HAVE_SYS_INOTIFY_H
+static int lists_wd = -1;
+#endif
+
+char *
+opkg_daemon_socket_alloc(void)
+{
+	return root_filename_alloc(OPKGD_SOCKET);
+}
+
+static int
+write_full(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+	ssize_t n;
+
+	while (len) {
+		n = write(fd, p, len);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+static int
+read_full(int fd, void *buf, size_t len)
+{
+	char *p = buf;
+	ssize_t n;
+
+	while (len) {
+		n = read(fd, p, len);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		p += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+static int
+socket_addr(const char *socket_path, struct sockaddr_un *addr)
+{
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+
+	if (strlen(socket_path) >= sizeof(addr->sun_path)) {
+		opkg_msg(ERROR, "Socket path %s is too long.\n", socket_path);
+		return -1;
+	}
+	strcpy(addr->sun_path, socket_path);
+
+	return 0;
+}
+
+int
+opkg_daemon_forward(const char *socket_path, int argc, const char **argv)
+{
+	struct sockaddr_un addr;
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	union fd_control control;
+	int fds[2] = { STDOUT_FILENO, STDERR_FILENO };
+	const char *head[3];
+	char *opts, *req, *p;
+	unsigned char reply[2];
+	uint32_t len;
+	int i, sock;
+
+	if (socket_addr(socket_path, &addr))
+		return -1;
+
+	sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock == -1) {
+		opkg_perror(ERROR, "Failed to create socket");
+		return -1;
+	}
+
+	if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+		opkg_msg(INFO, "opkgd is not listening on %s, "
+				"running the command locally.\n", socket_path);
+		close(sock);
+		return -1;
+	}
+
+	sprintf_alloc(&opts, "%d %d", conf->verbosity, conf->query_all);
+	head[0] = opts;
+	/* The configuration is not loaded yet, see opkg_conf_load(). */
+	head[1] = conf->offline_root ? conf->offline_root : getenv("OFFLINE_ROOT");
+	head[2] = conf->conf_file;
+	for (i = 0; i < 3; i++)
+		if (head[i] == NULL)
+			head[i] = "";
+
+	len = 0;
+	for (i = 0; i < 3; i++)
+		len += strlen(head[i]) + 1;
+	for (i = 0; i < argc; i++)
+		len += strlen(argv[i]) + 1;
+
+	p = req = xmalloc(len);
+	for (i = 0; i < 3; i++) {
+		strcpy(p, head[i]);
+		p += strlen(head[i]) + 1;
+	}
+	for (i = 0; i < argc; i++) {
+		strcpy(p, argv[i]);
+		p += strlen(argv[i]) + 1;
+	}
+	free(opts);
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = &len;
+	iov.iov_len = sizeof(len);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+	/* Anything buffered must reach the terminal before the daemon's output. */
+	fflush(stdout);
+	fflush(stderr);
+
+	if (sendmsg(sock, &msg, 0) != sizeof(len)
+			|| write_full(sock, req, len)) {
+		opkg_perror(ERROR, "Failed to send request to opkgd");
+		free(req);
+		close(sock);
+		return 1;
+	}
+	free(req);
+
+	if (read_full(sock, reply, 2)) {
+		opkg_msg(ERROR, "opkgd closed the connection without "
+				"completing %s.\n", argv[0]);
+		reply[0] = 1;
+		reply[1] = 1;
+	}
+	close(sock);
+
+	if (!reply[0]) {
+		opkg_msg(INFO, "opkgd on %s serves another root or "
+				"configuration, running the command locally.\n",
+				socket_path);
+		return -1;
+	}
+
+	return reply[1];
+}
+
+/* Read a request into a NULL terminated vector, argv[0] owning the strings. */
+static char **
+request_recv(int sock, int fds[2])
+{
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	union fd_control control;
+	char *buf, **argv;
+	uint32_t len, i;
+	int argc;
+	ssize_t n;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = &len;
+	iov.iov_len = sizeof(len);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+
+	do {
+		n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+	} while (n == -1 && errno == EINTR);
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (n != sizeof(len) || cmsg == NULL
+			|| cmsg->cmsg_level != SOL_SOCKET
+			|| cmsg->cmsg_type != SCM_RIGHTS) {
+		opkg_msg(ERROR, "Malformed request header.\n");
+		return NULL;
+	}
+
+	if (cmsg->cmsg_len != CMSG_LEN(2 * sizeof(int))) {
+		int *fd = (int *)CMSG_DATA(cmsg);
+		int nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		while (nfds--)
+			close(fd[nfds]);
+		opkg_msg(ERROR, "Request must pass stdout and stderr.\n");
+		return NULL;
+	}
+	memcpy(fds, CMSG_DATA(cmsg), 2 * sizeof(int));
+
+	if (len == 0 || len > OPKGD_MAX_REQUEST) {
+		opkg_msg(ERROR, "Bad request length %u.\n", len);
+		goto err0;
+	}
+
+	buf = xmalloc(len);
+	if (read_full(sock, buf, len) || buf[len - 1] != '\0') {
+		opkg_msg(ERROR, "Truncated request.\n");
+		goto err1;
+	}
+
+	for (argc = 0, i = 0; i < len; i++)
+		if (buf[i] == '\0')
+			argc++;
+
+	argv = xcalloc(argc + 1, sizeof(char *));
+	argv[0] = buf;
+	for (argc = 1, i = 0; i < len - 1; i++)
+		if (buf[i] == '\0')
+			argv[argc++] = buf + i + 1;
+
+	return argv;
+
+err1:
+	free(buf);
+err0:
+	close(fds[0]);
+	close(fds[1]);
+	return NULL;
+}
+
+/* Whether the client's path, "" for none, names the same file as ours. */
+static int
+same_path(const char *theirs, const char *ours)
+{
+	char *a, *b;
+	int same;
+
+	if (ours == NULL || *theirs == '\0')
+		return (ours == NULL || *ours == '\0') && *theirs == '\0';
+
+	a = realpath(theirs, NULL);
+	b = realpath(ours, NULL);
+	if (a && b)
+		same = !strcmp(a, b);
+	else
+		same = !strcmp(theirs, ours);
+	free(a);
+	free(b);
+
+	return same;
+}
+
+/*
+ * The database is loaded with every field, drop the ones the command's
+ * parse field mask would have kept out of a local run, so that the
+ * output is the same either way.
+ */
+static void
+fields_mask(uint pfm)
+{
+	pkg_vec_t *all;
+	pkg_t *pkg;
+	int i;
+
+	if (!(pfm & (PFM_DESCRIPTION | PFM_SOURCE)))
+		return;
+
+	all = pkg_vec_alloc();
+	pkg_hash_fetch_available(all);
+	for (i = 0; i < all->len; i++) {
+		pkg = all->pkgs[i];
+		if (pfm & PFM_DESCRIPTION) {
+			free(pkg->description);
+			pkg->description = NULL;
+		}
+		if (pfm & PFM_SOURCE) {
+			free(pkg->source);
+			pkg->source = NULL;
+		}
+	}
+	pkg_vec_free(all);
+	conf->pfm = pfm;
+}
+
+/* Runs in the forked child and never returns. */
+static void
+request_run(int sock, int fds[2], char **argv)
+{
+	opkg_cmd_t *cmd;
+	unsigned char reply[2] = { 1, 0 };
+	int argc, verbosity, query_all, err = -1;
+
+	signal(SIGCHLD, SIG_DFL);
+	signal(SIGPIPE, SIG_DFL);
+	signal(SIGTERM, SIG_DFL);
+	signal(SIGINT, SIG_DFL);
+
+	if (dup2(fds[0], STDOUT_FILENO) == -1
+			|| dup2(fds[1], STDERR_FILENO) == -1)
+		_exit(1);
+	close(fds[0]);
+	close(fds[1]);
+
+	for (argc = 0; argv[argc]; argc++)
+		;
+
+	if (argc < 4 || sscanf(argv[0], "%d %d", &verbosity, &query_all) != 2) {
+		opkg_msg(ERROR, "Malformed request.\n");
+		goto out;
+	}
+	conf->verbosity = verbosity;
+	conf->query_all = query_all;
+
+	if (!same_path(argv[1], conf->offline_root)
+			|| !same_path(argv[2], conf->conf_file)) {
+		reply[0] = 0;
+		goto out;
+	}
+
+	cmd = opkg_cmd_find(argv[3]);
+	if (cmd == NULL || !cmd->query)
+		opkg_msg(ERROR, "opkgd does not serve the %s command.\n",
+				argv[3]);
+	else if (cmd->requires_args && argc == 4)
+		opkg_msg(ERROR, "The %s command requires at least one "
+				"argument.\n", argv[3]);
+	else {
+		if (!opkg_cmd_reads_feeds(cmd->name))
+			pkg_hash_swap(&status_db);
+		fields_mask(cmd->pfm);
+		err = opkg_cmd_exec(cmd, argc - 4, (const char **)(argv + 4));
+	}
+
+out:
+	print_error_list();
+	fflush(stdout);
+	fflush(stderr);
+
+	reply[1] = err;
+	write_full(sock, reply, 2);
+	_exit(0);
+}
+
+static int
+db_load(void)
+{
+	/* The status files on their own first, merging in the feeds fills
+	 * in fields that a local run of status_db's commands never shows. */
+	if (pkg_hash_load_status_files())
+		return -1;
+	pkg_hash_swap(&status_db);
+	pkg_hash_init();
+
+	if (pkg_hash_load_feeds())
+		return -1;
+
+	if (pkg_hash_load_status_files())
+		return -1;
+
+	db_stale = 0;
+
+	return 0;
+}
+
+static void
+db_reload(void)
+{
+	if (opkg_conf_lock()) {
+		/* Keep answering from the old state until the running
+		 * command has written the status files and let go. */
+		return;
+	}
+
+	opkg_msg(INFO, "Reloading the package database.\n");
+
+	pkg_hash_deinit();
+	pkg_hash_swap(&status_db);
+	pkg_hash_deinit();
+	hash_table_deinit(&conf->file_hash);
+	hash_table_deinit(&conf->obs_file_hash);
+
+	pkg_hash_init();
+	hash_table_init("file-hash", &conf->file_hash,
+			OPKG_CONF_DEFAULT_HASH_LEN);
+	hash_table_init("obs-file-hash", &conf->obs_file_hash,
+			OPKG_CONF_DEFAULT_HASH_LEN/16);
+
+	db_load();
+
+	opkg_conf_unlock();
+}
+
+#ifdef HAVE_SYS_INOTIFY_H
+static int
+watch_init(void)
+{
+	pkg_dest_list_elt_t *iter;
+	pkg_dest_t *dest;
+	char *tmp;
+	int fd;
+	uint32_t mask = IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM
+			| IN_CREATE | IN_DELETE | IN_MODIFY;
+
+	fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (fd == -1) {
+		opkg_perror(ERROR, "Failed to initialise inotify");
+		return -1;
+	}
+
+	/* Watch the lists dir even if 'opkg update' has not made it yet. */
+	file_mkdir_hier(conf->lists_dir, 0755);
+	lists_wd = inotify_add_watch(fd, conf->lists_dir, mask);
+	if (lists_wd == -1)
+		goto err;
+
+	/* Status files are replaced by rename, so watch their directory. */
+	for (iter = void_list_first(&conf->pkg_dest_list); iter;
+			iter = void_list_next(&conf->pkg_dest_list, iter)) {
+		dest = (pkg_dest_t *)iter->data;
+
+		tmp = xstrdup(dest->status_file_name);
+		if (inotify_add_watch(fd, dirname(tmp), mask) == -1) {
+			free(tmp);
+			goto err;
+		}
+		free(tmp);
+	}
+
+	return fd;
+
+err:
+	opkg_perror(ERROR, "Failed to watch the package database");
+	close(fd);
+	return -1;
+}
+
+static int
+is_status_file(const char *name)
+{
+	pkg_dest_list_elt_t *iter;
+	pkg_dest_t *dest;
+
+	for (iter = void_list_first(&conf->pkg_dest_list); iter;
+			iter = void_list_next(&conf->pkg_dest_list, iter)) {
+		dest = (pkg_dest_t *)iter->data;
+
+		if (!strcmp(name, strrchr(dest->status_file_name, '/') + 1)
+				|| !strcmp(name, strrchr(
+					dest->status_journal_name, '/') + 1))
+			return 1;
+	}
+
+	return 0;
+}
+
+static void
+watch_drain(int fd)
+{
+	char buf[4096]
+		__attribute__ ((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *ev;
+	ssize_t len;
+	char *p;
+
+	while ((len = read(fd, buf, sizeof(buf))) > 0) {
+		for (p = buf; p < buf + len; p += sizeof(*ev) + ev->len) {
+			ev = (const struct inotify_event *)p;
+
+			if (ev->mask & IN_Q_OVERFLOW || ev->wd == lists_wd
+					|| (ev->len && is_status_file(ev->name)))
+				db_stale = 1;
+		}
+	}
+}
+#else
+/* Without change notification every request reparses the database. */
+static int
+watch_init(void)
+{
+	return -1;
+}
+
+static void
+watch_drain(int fd)
+{
+}
+#endif
+
+static void
+terminate_handler(int sig)
+{
+	terminate = 1;
+}
+
+static void
+child_handler(int sig)
+{
+}
+
+int
+opkg_daemon_serve(const char *socket_path)
+{
+	struct sockaddr_un addr;
+	struct sigaction sa;
+	struct pollfd pfd[2];
+	struct timeval tv = { OPKGD_RECV_TIMEOUT, 0 };
+	int listen_fd, watch_fd, client, fds[2];
+	char **argv;
+	pid_t pid;
+
+	if (socket_addr(socket_path, &addr))
+		return -1;
+
+	/* Watch before unlocking so that no change can slip in between. */
+	if (db_load())
+		return -1;
+	watch_fd = watch_init();
+	opkg_conf_unlock();
+
+	listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (listen_fd == -1) {
+		opkg_perror(ERROR, "Failed to create socket");
+		goto err0;
+	}
+
+	unlink(socket_path);
+	if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+		opkg_perror(ERROR, "Failed to bind to %s", socket_path);
+		goto err1;
+	}
+
+	if (chmod(socket_path, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP) == -1
+			|| listen(listen_fd, 16) == -1) {
+		opkg_perror(ERROR, "Failed to listen on %s", socket_path);
+		goto err2;
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = terminate_handler;
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+	/* No SA_RESTART, so that poll() wakes up to reap children. */
+	sa.sa_handler = child_handler;
+	sigaction(SIGCHLD, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	opkg_msg(NOTICE, "Listening on %s.\n", socket_path);
+	print_error_list();
+	free_error_list();
+	fflush(stdout);
+
+	while (!terminate) {
+		while (waitpid(-1, NULL, WNOHANG) > 0)
+			;
+
+		pfd[0].fd = listen_fd;
+		pfd[0].events = POLLIN;
+		pfd[1].fd = watch_fd;
+		pfd[1].events = POLLIN;
+
+		if (poll(pfd, 2, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			opkg_perror(ERROR, "poll failed");
+			break;
+		}
+
+		if (pfd[1].revents & POLLIN)
+			watch_drain(watch_fd);
+
+		if (!(pfd[0].revents & POLLIN))
+			continue;
+
+		client = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+		if (client == -1)
+			continue;
+
+		setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+		argv = request_recv(client, fds);
+		if (argv == NULL)
+			goto next;
+
+		if (watch_fd == -1)
+			db_stale = 1;
+		if (db_stale)
+			db_reload();
+
+		fflush(stdout);
+		fflush(stderr);
+
+		pid = fork();
+		if (pid == 0) {
+			close(listen_fd);
+			if (watch_fd != -1)
+				close(watch_fd);
+			request_run(client, fds, argv);
+		}
+		if (pid == -1)
+			opkg_perror(ERROR, "Failed to fork");
+
+		close(fds[0]);
+		close(fds[1]);
+		free(argv[0]);
+		free(argv);
+next:
+		close(client);
+		print_error_list();
+		free_error_list();
+		fflush(stdout);
+	}
+
+	opkg_msg(INFO, "Shutting down.\n");
+
+	pkg_hash_swap(&status_db);
+	pkg_hash_deinit();
+	pkg_hash_swap(&status_db);
+
+	close(listen_fd);
+	unlink(socket_path);
+	if (watch_fd != -1)
+		close(watch_fd);
+
+	return 0;
+
+err2:
+	unlink(socket_path);
+err1:
+	close(listen_fd);
+err0:
+	if (watch_fd != -1)
+		close(watch_fd);
+	return -1;
+}
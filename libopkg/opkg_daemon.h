@@ -0,0 +1,28 @@
+/* opkg_daemon.h - the opkg package management system
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2, or (at
+   your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+*/
+
+#ifndef OPKG_DAEMON_H
+#define OPKG_DAEMON_H
+
+char *opkg_daemon_socket_alloc(void);
+
+/* Called with the configuration loaded and locked. Returns on SIGTERM. */
+int opkg_daemon_serve(const char *socket_path);
+
+/*
+ * Run a query command in opkgd, argv[0] being the command name. Returns
+ * the command's exit status, or -1 if no daemon is listening.
+ */
+int opkg_daemon_forward(const char *socket_path, int argc, const char **argv);
+
+#endif
@@ -27,6 +27,10 @@
 #define OPKG_LISTS_DIR_SUFFIX "lists"
 #define OPKG_INFO_DIR_SUFFIX "info"
 #define OPKG_STATUS_FILE_SUFFIX "status"
+#define OPKG_STATUS_JOURNAL_SUFFIX "status.journal"
+
+#define OPKGD_SOCKET OPKG_STATE_DIR_PREFIX"/opkgd.sock"
+#define OPKG_CONFFILE_CACHE OPKG_STATE_DIR_PREFIX"/conffile.cache"
 
 #define OPKG_BACKUP_SUFFIX "-opkg.backup"
 
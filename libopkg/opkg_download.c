@@ -24,12 +24,14 @@
 #include <libgen.h>
 
 #include "opkg_download.h"
+#include "opkg_cache.h"
 #include "opkg_message.h"
 
 #include "sprintf_alloc.h"
 #include "xsystem.h"
 #include "file_util.h"
 #include "opkg_defines.h"
+#include "opkg_profile.h"
 #include "libbb/libbb.h"
 
 #ifdef HAVE_CURL
@@ -80,8 +82,25 @@ str_starts_with(const char *str, const char *prefix)
     return (strncmp(str, prefix, strlen(prefix)) == 0);
 }
 
-int
-opkg_download(const char *src, const char *dest_file_name,
+#ifdef HAVE_CURL
+struct digest_writer {
+    FILE *file;
+    file_digest_t *digest;
+};
+
+static size_t
+digest_write(void *ptr, size_t size, size_t nmemb, void *userdata)
+{
+    struct digest_writer *w = userdata;
+    size_t n = fwrite(ptr, size, nmemb, w->file);
+
+    file_digest_update(w->digest, ptr, n * size);
+    return n;
+}
+#endif
+
+static int
+download(const char *src, const char *dest_file_name, file_digest_t *digest,
 	curl_progress_func cb, void *data, const short hide_error)
 {
     int err = 0;
@@ -95,7 +114,10 @@ opkg_download(const char *src, const char *dest_file_name,
     if (str_starts_with(src, "file:")) {
 	const char *file_src = src + 5;
 	opkg_msg(INFO, "Copying %s to %s...", file_src, dest_file_name);
-	err = file_copy(file_src, dest_file_name);
+	if (digest)
+	    err = file_copy_digest(file_src, dest_file_name, digest);
+	else
+	    err = file_copy(file_src, dest_file_name);
 	opkg_msg(INFO, "Done.\n");
         free(src_basec);
 	return err;
@@ -133,8 +155,16 @@ opkg_download(const char *src, const char *dest_file_name,
     curl = opkg_curl_init (cb, data);
     if (curl)
     {
+	struct digest_writer writer = { file, digest };
+
 	curl_easy_setopt (curl, CURLOPT_URL, src);
-	curl_easy_setopt (curl, CURLOPT_WRITEDATA, file);
+	if (digest) {
+	    curl_easy_setopt (curl, CURLOPT_WRITEFUNCTION, digest_write);
+	    curl_easy_setopt (curl, CURLOPT_WRITEDATA, &writer);
+	} else {
+	    curl_easy_setopt (curl, CURLOPT_WRITEFUNCTION, NULL);
+	    curl_easy_setopt (curl, CURLOPT_WRITEDATA, file);
+	}
 
 	res = curl_easy_perform (curl);
 	fclose (file);
@@ -142,7 +172,7 @@ opkg_download(const char *src, const char *dest_file_name,
 	{
 	    long error_code;
 	    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &error_code);
-	    opkg_msg(hide_error?DEBUG2:ERROR, "Failed to download %s: %s.\n",
+	    opkg_msg((hide_error ? DEBUG2 : ERROR), "Failed to download %s: %s.\n",
 		    src, curl_easy_strerror(res));
 	    free(tmp_file_location);
 	    return -1;
@@ -173,7 +203,13 @@ opkg_download(const char *src, const char *dest_file_name,
       res = xsystem(argv);
 
       if (res) {
-	opkg_msg(ERROR, "Failed to download %s, wget returned %d.\n", src, res);
+	opkg_msg((hide_error ? DEBUG2 : ERROR), "Failed to download %s, wget returned %d.\n", src, res);
+	free(tmp_file_location);
+	return -1;
+      }
+
+      /* wget wrote the file, it is still hot in the page cache. */
+      if (digest && file_digest_update_file(digest, tmp_file_location)) {
 	free(tmp_file_location);
 	return -1;
       }
@@ -187,34 +223,64 @@ opkg_download(const char *src, const char *dest_file_name,
     return err;
 }
 
+int
+opkg_download(const char *src, const char *dest_file_name,
+	curl_progress_func cb, void *data, const short hide_error)
+{
+    return opkg_download_digest(src, dest_file_name, NULL, cb, data,
+		    hide_error);
+}
+
+/* As opkg_download(), also feeding the downloaded bytes to digest. */
+int
+opkg_download_digest(const char *src, const char *dest_file_name,
+	file_digest_t *digest, curl_progress_func cb, void *data,
+	const short hide_error)
+{
+    int err;
+
+    opkg_profile_begin(OPKG_PROFILE_DOWNLOAD);
+    err = download(src, dest_file_name, digest, cb, data, hide_error);
+    opkg_profile_end(OPKG_PROFILE_DOWNLOAD);
+
+    return err;
+}
+
+/*
+ * Start a digest of what is about to be written to pkg->local_filename,
+ * or return NULL if the feed gave no checksum to compare it to.
+ */
+static file_digest_t *
+pkg_digest_new(pkg_t *pkg)
+{
+    int types = pkg_digest_types(pkg);
+
+    pkg_free_local_digest(pkg);
+    if (!types)
+	return NULL;
+
+    pkg->local_digest = xmalloc(sizeof(*pkg->local_digest));
+    file_digest_init(pkg->local_digest, types);
+
+    return pkg->local_digest;
+}
+
+/* Packages without a checksum in the feed are cached under their name. */
 static int
-opkg_download_cache(const char *src, const char *dest_file_name,
-	curl_progress_func cb, void *data)
+cache_fetch_by_name(const char *src, pkg_t *pkg,
+	char **cache_location, curl_progress_func cb, void *data)
 {
+    const char *dest_file_name = pkg->local_filename;
     char *cache_name = xstrdup(src);
-    char *cache_location, *p;
+    char *p;
     int err = 0;
 
-    if (!conf->cache || str_starts_with(src, "file:")) {
-	err = opkg_download(src, dest_file_name, cb, data, 0);
-	goto out1;
-    }
-
-    if(!file_is_dir(conf->cache)){
-	    opkg_msg(ERROR, "%s is not a directory.\n",
-			    conf->cache);
-	    err = 1;
-	    goto out1;
-    }
-
     for (p = cache_name; *p; p++)
 	if (*p == '/')
 	    *p = ',';	/* looks nicer than | or # */
 
-    sprintf_alloc(&cache_location, "%s/%s", conf->cache, cache_name);
-    if (file_exists(cache_location))
-	opkg_msg(NOTICE, "Copying %s.\n", cache_location);
-    else {
+    sprintf_alloc(cache_location, "%s/%s", conf->cache, cache_name);
+    if (!file_exists(*cache_location)) {
        /* cache file with funky name not found, try simple name */
         free(cache_name);
         char *filename = strrchr(dest_file_name,'/');
@@ -222,26 +288,111 @@ opkg_download_cache(const char *src, const char *dest_file_name,
            cache_name = xstrdup(filename+1); // strip leading '/'
         else
            cache_name = xstrdup(dest_file_name);
-        free(cache_location);
-        sprintf_alloc(&cache_location, "%s/%s", conf->cache, cache_name);
-        if (file_exists(cache_location))
-           opkg_msg(NOTICE, "Copying %s.\n", cache_location);
-        else  {
- 	    err = opkg_download(src, cache_location, cb, data, 0);
+        free(*cache_location);
+        sprintf_alloc(cache_location, "%s/%s", conf->cache, cache_name);
+        if (!file_exists(*cache_location)) {
+ 	    err = opkg_download_digest(src, *cache_location,
+			    pkg_digest_new(pkg), cb, data, 0);
 	    if (err) {
-	       (void) unlink(cache_location);
-	       goto out2;
+	       pkg_free_local_digest(pkg);
+	       (void) unlink(*cache_location);
+	       free(*cache_location);
+	       *cache_location = NULL;
 	  }
 	}
     }
 
-    err = file_copy(cache_location, dest_file_name);
+    free(cache_name);
+    return err;
+}
+
+/* Returns the verified cache entry for key, downloading it if needed.
+ * size is the one the feed gives, 0 if it gives none. */
+static char *
+cache_fetch_by_key(const char *src, const char *key, off_t size,
+	curl_progress_func cb, void *data)
+{
+    char *cache_location, *part_name;
+    file_digest_t digest;
+
+    cache_location = opkg_cache_lookup_alloc(key, size);
+    if (cache_location)
+	return cache_location;
+
+    file_digest_init(&digest, strncmp(key, "md5-", 4) ?
+		    FILE_DIGEST_SHA256 : FILE_DIGEST_MD5);
+    sprintf_alloc(&part_name, "%s/%s.part", conf->cache, key);
+    if (opkg_download_digest(src, part_name, &digest, cb, data, 0) == 0)
+	cache_location = opkg_cache_add(key, part_name, &digest);
+    else
+	(void) unlink(part_name);
+    free(part_name);
+    file_digest_deinit(&digest);
+
+    return cache_location;
+}
+
+/*
+ * Fetch src into pkg->local_filename, going through the cache if there is
+ * one. With in_place the caller only reads the package, so a file: URL or
+ * a cached copy is used where it is and local_filename is pointed at it.
+ */
+static int
+opkg_download_cache(const char *src, pkg_t *pkg, int in_place,
+	curl_progress_func cb, void *data)
+{
+    char *cache_location, *key;
+    int err = 0;
+
+    pkg_free_local_digest(pkg);
+
+    if (in_place && str_starts_with(src, "file:") && file_exists(src + 5)) {
+	opkg_msg(INFO, "Reading %s in place.\n", src + 5);
+	free(pkg->local_filename);
+	pkg->local_filename = xstrdup(src + 5);
+	return 0;
+    }
+
+    if (!conf->cache || str_starts_with(src, "file:")) {
+	err = opkg_download_digest(src, pkg->local_filename,
+			pkg_digest_new(pkg), cb, data, 0);
+	if (err)
+	    pkg_free_local_digest(pkg);
+	return err;
+    }
+
+    if(!file_is_dir(conf->cache)){
+	    opkg_msg(ERROR, "%s is not a directory.\n",
+			    conf->cache);
+	    return 1;
+    }
+
+    key = opkg_cache_key_alloc(pkg);
+    if (key) {
+	cache_location = cache_fetch_by_key(src, key, pkg->size, cb, data);
+	if (cache_location == NULL)
+	    err = -1;
+	else
+	    pkg->local_verified = 1;
+	free(key);
+    } else
+	err = cache_fetch_by_name(src, pkg, &cache_location, cb, data);
+    if (err)
+	return err;
+
+    if (in_place) {
+	opkg_msg(INFO, "Reading %s in place.\n", cache_location);
+	free(pkg->local_filename);
+	pkg->local_filename = cache_location;
+	return 0;
+    }
 
+    opkg_msg(NOTICE, "Copying %s.\n", cache_location);
+    err = file_copy(cache_location, pkg->local_filename);
+    if (err)
+	pkg->local_verified = 0;
 
-out2:
     free(cache_location);
-out1:
-    free(cache_name);
     return err;
 }
 
@@ -276,7 +427,9 @@ opkg_download_pkg(pkg_t *pkg, const char *dir)
 
     sprintf_alloc(&pkg->local_filename, "%s/%s", dir, stripped_filename);
 
-    err = opkg_download_cache(url, pkg->local_filename, NULL, NULL);
+    /* Packages fetched for installation are only read, from tmp_dir. */
+    err = opkg_download_cache(url, pkg,
+		    strcmp(dir, conf->tmp_dir) == 0, NULL, NULL);
     free(url);
 
     return err;
@@ -19,6 +19,7 @@
 
 #include <stdio.h>
 #include <time.h>
+#include <limits.h>
 #include <signal.h>
 #include <unistd.h>
 #include <sys/stat.h>
@@ -26,6 +27,8 @@
 #include "pkg.h"
 #include "pkg_hash.h"
 #include "pkg_extract.h"
+#include "pkg_contents.h"
+#include "stat_cache.h"
 
 #include "opkg_install.h"
 #include "opkg_configure.h"
@@ -42,6 +45,38 @@
 #include "xsystem.h"
 #include "libbb/libbb.h"
 
+/*
+ * Whether satisfy_dependencies_for() has anything to install or upgrade
+ * for pkg. Unlike it, this leaves the dependency checked marks alone.
+ */
+static int
+dependencies_pending(pkg_t *pkg)
+{
+     compound_depend_t *cdep;
+     int i, j, count, satisfied;
+
+     if (conf->nodeps)
+	  return 0;
+
+     count = pkg->pre_depends_count + pkg->depends_count
+	     + pkg->recommends_count + pkg->suggests_count;
+     for (i = 0; i < count; i++) {
+	  cdep = &pkg->depends[i];
+	  if (cdep->type == SUGGEST)
+	       continue;
+	  /* Pulls in every provider, installed or not. */
+	  if (cdep->type == GREEDY_DEPEND)
+	       return 1;
+	  satisfied = 0;
+	  for (j = 0; j < cdep->possibility_count && !satisfied; j++)
+	       satisfied = pkg_dependence_satisfied(cdep->possibilities[j]);
+	  if (!satisfied)
+	       return 1;
+     }
+
+     return 0;
+}
+
 static int
 satisfy_dependencies_for(pkg_t *pkg)
 {
@@ -114,6 +149,7 @@ satisfy_dependencies_for(pkg_t *pkg)
 	       depends->pkgs[i]->dest = pkg->dest;
 	  }
 	  depends->pkgs[i]->state_want = SW_INSTALL;
+	  pkg_hash_status_set_add(depends->pkgs[i]);
      }
 
      for (i = 0; i < depends->len; i++) {
@@ -663,6 +699,7 @@ backup_make_backup(const char *file_name)
 	  opkg_msg(ERROR, "Failed to copy %s to %s\n",
 		       file_name, backup);
      }
+     stat_cache_forget(backup);
 
      free(backup);
 
@@ -672,14 +709,18 @@ backup_make_backup(const char *file_name)
 static int
 backup_exists_for(const char *file_name)
 {
+     char buf[PATH_MAX], *backup = buf;
      int ret;
-     char *backup;
 
-     backup = backup_filename_alloc(file_name);
+     /* Asked for every existing file, so spare the allocation. */
+     if (snprintf(buf, sizeof(buf), "%s%s", file_name,
+			     OPKG_BACKUP_SUFFIX) >= sizeof(buf))
+	  backup = backup_filename_alloc(file_name);
 
-     ret = file_exists(backup);
+     ret = stat_cache_type(backup) != STAT_CACHE_MISSING;
 
-     free(backup);
+     if (backup != buf)
+	  free(backup);
 
      return ret;
 }
@@ -691,6 +732,7 @@ backup_remove(const char *file_name)
 
      backup = backup_filename_alloc(file_name);
      unlink(backup);
+     stat_cache_forget(backup);
      free(backup);
 
      return 0;
@@ -766,7 +808,7 @@ backup_modified_conffiles_unwind(pkg_t *pkg, pkg_t *old_pkg)
 
 
 static int
-check_data_file_clashes(pkg_t *pkg, pkg_t *old_pkg)
+data_file_clashes(pkg_t *pkg, pkg_t *old_pkg, int before_ownership)
 {
      /* DPKG_INCOMPATIBILITY:
 	opkg takes a slightly different approach than dpkg at this
@@ -789,12 +831,13 @@ check_data_file_clashes(pkg_t *pkg, pkg_t *old_pkg)
      files_list = pkg_get_installed_files(pkg);
      if (files_list == NULL)
 	     return -1;
+     stat_cache_prefetch(files_list);
 
      for (iter = str_list_first(files_list), niter = str_list_next(files_list, iter);
              iter;
              iter = niter, niter = str_list_next(files_list, iter)) {
 	  filename = (char *) iter->data;
-	  if (file_exists(filename) && (! file_is_dir(filename))) {
+	  if (stat_cache_type(filename) == STAT_CACHE_OTHER) {
 	       pkg_t *owner;
 	       pkg_t *obs;
 
@@ -811,6 +854,11 @@ check_data_file_clashes(pkg_t *pkg, pkg_t *old_pkg)
 
 	       owner = file_hash_get_file_owner(filename);
 
+	       /* update_file_ownership() will hand unowned files to pkg. */
+	       if (!owner && before_ownership) {
+		    continue;
+	       }
+
 	       /* Pre-existing files are OK if owned by the pkg being upgraded. */
 	       if (owner && old_pkg) {
 		    if (strcmp(owner->name, old_pkg->name) == 0) {
@@ -862,6 +910,12 @@ check_data_file_clashes(pkg_t *pkg, pkg_t *old_pkg)
      return clashes;
 }
 
+static int
+check_data_file_clashes(pkg_t *pkg, pkg_t *old_pkg)
+{
+     return data_file_clashes(pkg, old_pkg, 0);
+}
+
 /*
  * XXX: This function sucks, as does the below comment.
  */
@@ -879,22 +933,16 @@ check_data_file_clashes_change(pkg_t *pkg, pkg_t *old_pkg)
      str_list_t *files_list;
      str_list_elt_t *iter, *niter;
 
-     char *root_filename = NULL;
-
      files_list = pkg_get_installed_files(pkg);
      if (files_list == NULL)
 	     return -1;
+     stat_cache_prefetch(files_list);
 
      for (iter = str_list_first(files_list), niter = str_list_next(files_list, iter);
              iter;
              iter = niter, niter = str_list_next(files_list, niter)) {
 	  char *filename = (char *) iter->data;
-          if (root_filename) {
-              free(root_filename);
-              root_filename = NULL;
-          }
-	  root_filename = root_filename_alloc(filename);
-	  if (file_exists(root_filename) && (! file_is_dir(root_filename))) {
+	  if (stat_cache_type(filename) == STAT_CACHE_OTHER) {
 	       pkg_t *owner;
 
 	       owner = file_hash_get_file_owner(filename);
@@ -921,10 +969,6 @@ check_data_file_clashes_change(pkg_t *pkg, pkg_t *old_pkg)
 
 	  }
      }
-     if (root_filename) {
-         free(root_filename);
-         root_filename = NULL;
-     }
      pkg_free_installed_files(pkg);
 
      return 0;
@@ -960,15 +1004,45 @@ postrm_upgrade_old_pkg_unwind(pkg_t *pkg, pkg_t *old_pkg)
     return 0;
 }
 
+static int
+file_name_cmp(const void *a, const void *b)
+{
+     return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/* The names in files, sorted, in a vector of *n entries. */
+static char **
+sorted_file_names(str_list_t *files, size_t *n)
+{
+     str_list_elt_t *iter;
+     char **names = NULL;
+     size_t size = 0;
+
+     *n = 0;
+     for (iter = str_list_first(files); iter; iter = str_list_next(files, iter)) {
+	  if (iter->data == NULL)
+	       continue;
+	  if (*n == size) {
+	       size = size ? size * 2 : 256;
+	       names = xrealloc(names, size * sizeof(*names));
+	  }
+	  names[(*n)++] = iter->data;
+     }
+
+     if (*n)
+	  qsort(names, *n, sizeof(*names), file_name_cmp);
+
+     return names;
+}
+
 static int
 remove_obsolesced_files(pkg_t *pkg, pkg_t *old_pkg)
 {
      int err = 0;
      str_list_t *old_files;
-     str_list_elt_t *of;
      str_list_t *new_files;
-     str_list_elt_t *nf;
-     hash_table_t new_files_table;
+     char **old_names, **new_names;
+     size_t n_old, n_new, i, j;
 
      old_files = pkg_get_installed_files(old_pkg);
      if (old_files == NULL)
@@ -980,30 +1054,31 @@ remove_obsolesced_files(pkg_t *pkg, pkg_t *old_pkg)
 	  return -1;
      }
 
-     new_files_table.entries = NULL;
-     hash_table_init("new_files" , &new_files_table, 20);
-     for (nf = str_list_first(new_files); nf; nf = str_list_next(new_files, nf)) {
-         if (nf && nf->data)
-            hash_table_insert(&new_files_table, nf->data, nf->data);
-     }
+     /* Walk both lists in order, the old files the new list skips over
+	are the obsolete ones. */
+     old_names = sorted_file_names(old_files, &n_old);
+     new_names = sorted_file_names(new_files, &n_new);
 
-     for (of = str_list_first(old_files); of; of = str_list_next(old_files, of)) {
+     for (i = 0, j = 0; i < n_old; i++) {
 	  pkg_t *owner;
-	  char *old, *new;
-	  old = (char *)of->data;
-          new = (char *) hash_table_get (&new_files_table, old);
-          if (new)
-               continue;
+	  char *old = old_names[i];
+	  int cmp = 1;
 
-	  if (file_is_dir(old)) {
+	  while (j < n_new && (cmp = strcmp(new_names[j], old)) < 0)
+	       j++;
+	  if (j < n_new && cmp == 0)
 	       continue;
-	  }
+
 	  owner = file_hash_get_file_owner(old);
 	  if (owner != old_pkg) {
 	       /* in case obsolete file no longer belongs to old_pkg */
 	       continue;
 	  }
 
+	  if (stat_cache_type(old) == STAT_CACHE_DIR) {
+	       continue;
+	  }
+
 	  /* old file is obsolete */
 	  opkg_msg(NOTICE, "Removing obsolete file %s.\n", old);
 	  if (!conf->noaction) {
@@ -1011,10 +1086,12 @@ remove_obsolesced_files(pkg_t *pkg, pkg_t *old_pkg)
 	       if (err) {
 		    opkg_perror(ERROR, "unlinking %s failed", old);
 	       }
+	       stat_cache_forget(old);
 	  }
      }
 
-     hash_table_deinit(&new_files_table);
+     free(new_names);
+     free(old_names);
      pkg_free_installed_files(old_pkg);
      pkg_free_installed_files(pkg);
 
@@ -1060,6 +1137,8 @@ static int
 install_data_files(pkg_t *pkg)
 {
      int err;
+     str_list_t *files_list;
+     str_list_elt_t *iter;
 
      /* opkg takes a slightly different approach to data file backups
 	than dpkg. Rather than removing backups at this point, we
@@ -1072,6 +1151,14 @@ install_data_files(pkg_t *pkg)
 	  return err;
      }
 
+     files_list = pkg_get_installed_files(pkg);
+     if (files_list) {
+	  for (iter = str_list_first(files_list); iter;
+			  iter = str_list_next(files_list, iter))
+	       stat_cache_forget(iter->data);
+	  pkg_free_installed_files(pkg);
+     }
+
      /* The "Essential" control field may only be present in the control
       * file and not in the Packages list. Ensure we capture it regardless.
       *
@@ -1141,10 +1228,13 @@ resolve_conffiles(pkg_t *pkg)
                            root_filename, new_conffile);
                       rename(root_filename, new_conffile);
                       rename(cf_backup, root_filename);
+                      stat_cache_forget(new_conffile);
+                      stat_cache_forget(root_filename);
                       free(new_conffile);
 		  }
               }
               unlink(cf_backup);
+              stat_cache_forget(cf_backup);
 	      if (md5sum)
                   free(md5sum);
           }
@@ -1272,6 +1362,7 @@ opkg_install_pkg(pkg_t *pkg, int from_upgrade)
 	     return -1;
 
      pkg->state_want = SW_INSTALL;
+     pkg_hash_status_set_add(pkg);
      if (old_pkg){
          old_pkg->state_want = SW_DEINSTALL; /* needed for check_data_file_clashes of dependencies */
      }
@@ -1291,6 +1382,20 @@ opkg_install_pkg(pkg_t *pkg, int from_upgrade)
      if (err)
 	     return -1;
 
+     /* With a file manifest from the feed, clashes are found before the
+        package is downloaded. Dependencies installed first may still take
+        files away from their current owners, so with any to install the
+        check is left to the one made once the payload is unpacked. */
+     if (pkg->local_filename == NULL && !conf->force_overwrite
+		     && !conf->download_only
+		     && pkg_contents_has(pkg)
+		     && !dependencies_pending(pkg)
+		     && data_file_clashes(pkg, old_pkg, 1)) {
+	  opkg_msg(ERROR, "Not downloading %s, its files clash with "
+			  "installed packages.\n", pkg->name);
+	  return -1;
+     }
+
      if (pkg->local_filename == NULL) {
          if(!conf->cache && conf->download_only){
              char cwd[4096];
@@ -1343,10 +1448,21 @@ opkg_install_pkg(pkg_t *pkg, int from_upgrade)
      }
      #endif
 
+     /* Unless it was hashed on download or the cache has checked it,
+        read the package once for every checksum the feed gives. */
+     if (!pkg->local_verified && !pkg->local_digest && pkg_digest_types(pkg)) {
+	 pkg->local_digest = xmalloc(sizeof(*pkg->local_digest));
+	 file_digest_init(pkg->local_digest, pkg_digest_types(pkg));
+	 if (file_digest_update_file(pkg->local_digest, pkg->local_filename)) {
+	      pkg_free_local_digest(pkg);
+	      return -1;
+	 }
+     }
+
      /* Check for md5 values */
-     if (pkg->md5sum)
+     if (pkg->md5sum && !pkg->local_verified)
      {
-         file_md5 = file_md5sum_alloc(pkg->local_filename);
+         file_md5 = file_digest_md5_alloc(pkg->local_digest);
          if (file_md5 && strcmp(file_md5, pkg->md5sum))
          {
               opkg_msg(ERROR, "Package %s md5sum mismatch. "
@@ -1362,9 +1478,9 @@ opkg_install_pkg(pkg_t *pkg, int from_upgrade)
 
 #ifdef HAVE_SHA256
      /* Check for sha256 value */
-     if(pkg->sha256sum)
+     if(pkg->sha256sum && !pkg->local_verified)
      {
-         file_sha256 = file_sha256sum_alloc(pkg->local_filename);
+         file_sha256 = file_digest_sha256_alloc(pkg->local_digest);
          if (file_sha256 && strcmp(file_sha256, pkg->sha256sum))
          {
               opkg_msg(ERROR, "Package %s sha256sum mismatch. "
@@ -1515,6 +1631,7 @@ opkg_install_pkg(pkg_t *pkg, int from_upgrade)
 	  resolve_conffiles(pkg);
 
 	  pkg->state_status = SS_UNPACKED;
+	  pkg_free_data_members(pkg);
 	  old_state_flag = pkg->state_flag;
 	  pkg->state_flag &= ~SF_PREFER;
 	  opkg_msg(DEBUG, "pkg=%s old_state_flag=%x state_flag=%x\n",
@@ -1527,7 +1644,7 @@ opkg_install_pkg(pkg_t *pkg, int from_upgrade)
 
 	  ab_pkg = pkg->parent;
 	  if (ab_pkg)
-	       ab_pkg->state_status = pkg->state_status;
+	       abstract_pkg_set_state_status(ab_pkg, pkg->state_status);
 
 	  sigprocmask(SIG_UNBLOCK, &newset, &oldset);
           pkg_vec_free (replacees);
@@ -56,6 +56,8 @@ free_error_list(void)
 		err = err->next;
 		free(err_tmp);
 	}
+
+	error_list_head = error_list_tail = NULL;
 }
 
 void
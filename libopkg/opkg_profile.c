@@ -0,0 +1,123 @@
+/* opkg_profile.c - the opkg package management system
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2, or (at
+   your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+*/
+
+#include "config.h"
+
+#include <string.h>
+#include <time.h>
+
+#include "opkg_profile.h"
+
+static opkg_profile_t profile;
+
+/* Per phase nesting depth and the time the outermost level started. */
+static unsigned int depth[OPKG_PROFILE_PHASES];
+static unsigned long long started[OPKG_PROFILE_PHASES];
+
+static const char *phase_names[OPKG_PROFILE_PHASES] = {
+	[OPKG_PROFILE_CONF_LOAD] = "conf load",
+	[OPKG_PROFILE_FEED_PARSE] = "feed parse",
+	[OPKG_PROFILE_STATUS_PARSE] = "status parse",
+	[OPKG_PROFILE_PREINSTALL_CHECK] = "preinstall check",
+	[OPKG_PROFILE_RESOLVE] = "resolution",
+	[OPKG_PROFILE_DOWNLOAD] = "download",
+	[OPKG_PROFILE_CHECKSUM] = "checksum",
+	[OPKG_PROFILE_EXTRACT] = "extract",
+	[OPKG_PROFILE_SCRIPTS] = "scripts",
+	[OPKG_PROFILE_STATUS_WRITE] = "status write",
+};
+
+static unsigned long long
+now_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void
+opkg_profile_begin(opkg_profile_phase_t phase)
+{
+	if (depth[phase]++ == 0) {
+		started[phase] = now_usec();
+		profile.phase[phase].count++;
+	}
+}
+
+void
+opkg_profile_end(opkg_profile_phase_t phase)
+{
+	if (depth[phase] == 0)
+		return;
+
+	if (--depth[phase] == 0)
+		profile.phase[phase].usec += now_usec() - started[phase];
+}
+
+void
+opkg_profile_count_fork(void)
+{
+	profile.forks++;
+}
+
+void
+opkg_profile_count_file_created(void)
+{
+	profile.files_created++;
+}
+
+void
+opkg_profile_add_decompressed(unsigned long long bytes)
+{
+	profile.bytes_decompressed += bytes;
+}
+
+const char *
+opkg_profile_phase_name(opkg_profile_phase_t phase)
+{
+	if (phase >= OPKG_PROFILE_PHASES)
+		return NULL;
+
+	return phase_names[phase];
+}
+
+void
+opkg_profile_get(opkg_profile_t *p)
+{
+	*p = profile;
+}
+
+void
+opkg_profile_reset(void)
+{
+	memset(&profile, 0, sizeof(profile));
+	memset(depth, 0, sizeof(depth));
+}
+
+void
+opkg_profile_print(FILE *fp)
+{
+	int i;
+
+	fprintf(fp, "%-18s %8s %12s\n", "phase", "count", "ms");
+	for (i = 0; i < OPKG_PROFILE_PHASES; i++)
+		fprintf(fp, "%-18s %8lu %12.3f\n", phase_names[i],
+				profile.phase[i].count,
+				profile.phase[i].usec / 1000.0);
+
+	fprintf(fp, "%-18s %8lu\n", "forks", profile.forks);
+	fprintf(fp, "%-18s %8lu\n", "files created", profile.files_created);
+	fprintf(fp, "%-18s %8llu\n", "bytes decompressed",
+			profile.bytes_decompressed);
+}
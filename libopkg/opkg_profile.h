@@ -0,0 +1,61 @@
+/* opkg_profile.h - the opkg package management system
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2, or (at
+   your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+*/
+
+#ifndef OPKG_PROFILE_H
+#define OPKG_PROFILE_H
+
+#include <stdio.h>
+
+typedef enum {
+	OPKG_PROFILE_CONF_LOAD,
+	OPKG_PROFILE_FEED_PARSE,
+	OPKG_PROFILE_STATUS_PARSE,
+	OPKG_PROFILE_PREINSTALL_CHECK,
+	OPKG_PROFILE_RESOLVE,
+	OPKG_PROFILE_DOWNLOAD,
+	OPKG_PROFILE_CHECKSUM,
+	OPKG_PROFILE_EXTRACT,
+	OPKG_PROFILE_SCRIPTS,
+	OPKG_PROFILE_STATUS_WRITE,
+	OPKG_PROFILE_PHASES
+} opkg_profile_phase_t;
+
+typedef struct opkg_profile opkg_profile_t;
+struct opkg_profile {
+	struct {
+		unsigned long count;		/* times entered */
+		unsigned long long usec;	/* wall clock time spent */
+	} phase[OPKG_PROFILE_PHASES];
+
+	unsigned long forks;
+	unsigned long files_created;
+	unsigned long long bytes_decompressed;
+};
+
+/*
+ * Nested begin/end pairs for the same phase (e.g. from recursion) are
+ * only timed once, at the outermost level.
+ */
+void opkg_profile_begin(opkg_profile_phase_t phase);
+void opkg_profile_end(opkg_profile_phase_t phase);
+
+void opkg_profile_count_fork(void);
+void opkg_profile_count_file_created(void);
+void opkg_profile_add_decompressed(unsigned long long bytes);
+
+const char *opkg_profile_phase_name(opkg_profile_phase_t phase);
+void opkg_profile_get(opkg_profile_t *profile);
+void opkg_profile_reset(void);
+void opkg_profile_print(FILE *fp);
+
+#endif
@@ -17,38 +17,62 @@
 
 #include <stdio.h>
 #include <glob.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <unistd.h>
 
 #include "opkg_message.h"
 #include "opkg_remove.h"
 #include "opkg_cmd.h"
+#include "pkg_hash.h"
 #include "file_util.h"
+#include "stat_cache.h"
 #include "sprintf_alloc.h"
 #include "libbb/libbb.h"
 
+/* Packages being removed together, by name. */
+struct remove_plan {
+     hash_table_t names;
+     pkg_vec_t *pkgs;	/* everything ever added, in order */
+};
+
+static int
+plan_has(struct remove_plan *plan, const char *name)
+{
+     return plan && hash_table_get(&plan->names, name) != NULL;
+}
+
 /*
- * Returns number of the number of packages depending on the packages provided by this package.
- * Every package implicitly provides itself.
+ * Count the installed packages depending on what pkg provides, leaving out
+ * those in plan. Every package implicitly provides itself.
  */
-int
-pkg_has_installed_dependents(pkg_t *pkg, abstract_pkg_t *** pdependents)
+static int
+installed_dependents(pkg_t *pkg, struct remove_plan *plan,
+		abstract_pkg_t ***pdependents)
 {
      int nprovides = pkg->provides_count;
      abstract_pkg_t **provides = pkg->provides;
      unsigned int n_installed_dependents = 0;
      int i;
-     for (i = 0; i < nprovides; i++) {
-	  abstract_pkg_t *providee = provides[i];
-	  abstract_pkg_t **dependers = providee->depended_upon_by;
-	  abstract_pkg_t *dep_ab_pkg;
-	  if (dependers == NULL)
-	       continue;
-	  while ((dep_ab_pkg = *dependers++) != NULL) {
-	       if (dep_ab_pkg->state_status == SS_INSTALLED || dep_ab_pkg->state_status == SS_UNPACKED){
-		    n_installed_dependents++;
-               }
-	  }
+     for (i = 0; i < nprovides; i++)
+	  n_installed_dependents += provides[i]->installed_dependents;
 
+     /* Only those in the plan need telling apart. */
+     if (plan && n_installed_dependents) {
+	  n_installed_dependents = 0;
+	  for (i = 0; i < nprovides; i++) {
+	       abstract_pkg_t *providee = provides[i];
+	       abstract_pkg_t **dependers = providee->depended_upon_by;
+	       abstract_pkg_t *dep_ab_pkg;
+	       if (dependers == NULL)
+		    continue;
+	       while ((dep_ab_pkg = *dependers++) != NULL) {
+		    if ((dep_ab_pkg->state_status == SS_INSTALLED || dep_ab_pkg->state_status == SS_UNPACKED)
+				    && !plan_has(plan, dep_ab_pkg->name)) {
+			 n_installed_dependents++;
+		    }
+	       }
+	  }
      }
      /* if caller requested the set of installed dependents */
      if (pdependents) {
@@ -63,7 +87,8 @@ pkg_has_installed_dependents(pkg_t *pkg, abstract_pkg_t *** pdependents)
 	       if (dependers == NULL)
 		    continue;
 	       while ((dep_ab_pkg = *dependers++) != NULL) {
-		    if (dep_ab_pkg->state_status == SS_INSTALLED && !(dep_ab_pkg->state_flag & SF_MARKED)) {
+		    if (dep_ab_pkg->state_status == SS_INSTALLED && !(dep_ab_pkg->state_flag & SF_MARKED)
+				    && !plan_has(plan, dep_ab_pkg->name)) {
 			 dependents[p++] = dep_ab_pkg;
 			 dep_ab_pkg->state_flag |= SF_MARKED;
 		    }
@@ -79,69 +104,14 @@ pkg_has_installed_dependents(pkg_t *pkg, abstract_pkg_t *** pdependents)
      return n_installed_dependents;
 }
 
-static int
-opkg_remove_dependent_pkgs(pkg_t *pkg, abstract_pkg_t **dependents)
+/*
+ * Returns number of the number of packages depending on the packages provided by this package.
+ * Every package implicitly provides itself.
+ */
+int
+pkg_has_installed_dependents(pkg_t *pkg, abstract_pkg_t *** pdependents)
 {
-    int i;
-    int a;
-    int count;
-    pkg_vec_t *dependent_pkgs;
-    abstract_pkg_t * ab_pkg;
-
-    if((ab_pkg = pkg->parent) == NULL){
-	opkg_msg(ERROR, "Internal error: pkg %s isn't in hash table\n",
-		pkg->name);
-	return 0;
-    }
-
-    if (dependents == NULL)
-	    return 0;
-
-    // here i am using the dependencies_checked
-    if (ab_pkg->dependencies_checked == 2) // variable to make out whether this package
-	return 0;			   // has already been encountered in the process
-	                                   // of marking packages for removal - Karthik
-    ab_pkg->dependencies_checked = 2;
-
-    i = 0;
-    count = 1;
-    dependent_pkgs = pkg_vec_alloc();
-
-    while (dependents [i] != NULL) {
-        abstract_pkg_t *dep_ab_pkg = dependents[i];
-
-	if (dep_ab_pkg->dependencies_checked == 2){
-	    i++;
-	    continue;
-        }
-        if (dep_ab_pkg->state_status == SS_INSTALLED) {
-            for (a = 0; a < dep_ab_pkg->pkgs->len; a++) {
-                pkg_t *dep_pkg = dep_ab_pkg->pkgs->pkgs[a];
-                if (dep_pkg->state_status == SS_INSTALLED) {
-                    pkg_vec_insert(dependent_pkgs, dep_pkg);
-                    count++;
-                }
-            }
-        }
-	i++;
-	/* 1 - to keep track of visited ab_pkgs when checking for possiblility of a broken removal of pkgs.
-	 * 2 - to keep track of pkgs whose deps have been checked alrdy  - Karthik */
-    }
-
-    if (count == 1) {
-        pkg_vec_free(dependent_pkgs);
-	return 0;
-    }
-
-
-    int err=0;
-    for (i = 0; i < dependent_pkgs->len; i++) {
-        err = opkg_remove_pkg(dependent_pkgs->pkgs[i],0);
-        if (err)
-            break;
-    }
-    pkg_vec_free(dependent_pkgs);
-    return err;
+     return installed_dependents(pkg, NULL, pdependents);
 }
 
 static void
@@ -160,72 +130,11 @@ print_dependents_warning(pkg_t *pkg, abstract_pkg_t **dependents)
     opkg_msg(ERROR, "with --force-removal-of-dependent-packages.\n");
 }
 
-/*
- * Find and remove packages that were autoinstalled and are orphaned
- * by the removal of pkg.
- */
 static int
-remove_autoinstalled(pkg_t *pkg)
+plan_add(struct remove_plan *plan, pkg_t *pkg, int from_upgrade)
 {
-	int i, j;
-	int err = 0;
-	int n_deps;
-	pkg_t *p;
-	struct compound_depend *cdep;
-	abstract_pkg_t **dependents;
-
-	int count = pkg->pre_depends_count +
-				pkg->depends_count +
-				pkg->recommends_count +
-				pkg->suggests_count;
-
-	for (i=0; i<count; i++) {
-		cdep = &pkg->depends[i];
-		if (cdep->type != PREDEPEND
-		    && cdep->type != DEPEND
-		    && cdep->type != RECOMMEND)
-			continue;
-		for (j=0; j<cdep->possibility_count; j++) {
-			p = pkg_hash_fetch_installed_by_name(
-					cdep->possibilities[j]->pkg->name);
-
-			/* If the package is not installed, this could have
-			 * been a circular dependency and the package has
-			 * already been removed.
-			 */
-			if (!p)
-				return -1;
-
-			if (!p->auto_installed)
-				continue;
-
-			n_deps = pkg_has_installed_dependents(p, &dependents);
-			if (n_deps == 0) {
-				 opkg_msg(NOTICE, "%s was autoinstalled and is "
-					       "now orphaned, removing.\n",
-					       p->name);
-				if (opkg_remove_pkg(p, 0) != 0) {
-					err = -1;
-				}
-			} else
-				opkg_msg(INFO, "%s was autoinstalled and is "
-						"still required by %d "
-						"installed packages.\n",
-						p->name, n_deps);
-
-			if (dependents)
-				free(dependents);
-		}
-	}
-
-	return err;
-}
-
-int
-opkg_remove_pkg(pkg_t *pkg, int from_upgrade)
-{
-     int err;
-     abstract_pkg_t *parent_pkg = NULL;
+     if (pkg->parent == NULL || plan_has(plan, pkg->name))
+	  return 0;
 
 /*
  * If called from an upgrade and not from a normal remove,
@@ -247,42 +156,167 @@ opkg_remove_pkg(pkg_t *pkg, int from_upgrade)
 	  }
      }
 
-     if ((parent_pkg = pkg->parent) == NULL)
-	  return 0;
+     hash_table_insert(&plan->names, pkg->name, pkg);
+     pkg_vec_insert(plan->pkgs, pkg);
 
-     /* only attempt to remove dependent installed packages if
-      * force_depends is not specified or the package is being
-      * replaced.
-      */
-     if (!conf->force_depends
-	 && !(pkg->state_flag & SF_REPLACE)) {
-	  abstract_pkg_t **dependents;
-	  int has_installed_dependents =
-	       pkg_has_installed_dependents(pkg, &dependents);
-
-	  if (has_installed_dependents) {
-	       /*
-		* if this package is depended upon by others, then either we should
-		* not remove it or we should remove it and all of its dependents
-		*/
-
-	       if (!conf->force_removal_of_dependent_packages) {
+     return 0;
+}
+
+/* pkg stays installed after all. */
+static void
+plan_drop(struct remove_plan *plan, pkg_t *pkg)
+{
+     hash_table_remove(&plan->names, pkg->name);
+}
+
+/* Whether pkg may only go if its installed dependents go too. */
+static int
+plan_checks_dependents(pkg_t *pkg)
+{
+     return !conf->force_depends && !(pkg->state_flag & SF_REPLACE);
+}
+
+/* Add the installed dependents of everything in the plan, transitively. */
+static int
+plan_add_dependents(struct remove_plan *plan, int from_upgrade)
+{
+     abstract_pkg_t **dependents, *dep_ab_pkg;
+     pkg_t *pkg, *dep_pkg;
+     int i, j, a, err = 0;
+
+     for (i = 0; i < plan->pkgs->len; i++) {
+	  pkg = plan->pkgs->pkgs[i];
+	  if (!plan_checks_dependents(pkg))
+	       continue;
+
+	  installed_dependents(pkg, plan, &dependents);
+	  for (j = 0; (dep_ab_pkg = dependents[j]) != NULL; j++) {
+	       for (a = 0; a < dep_ab_pkg->pkgs->len; a++) {
+		    dep_pkg = dep_ab_pkg->pkgs->pkgs[a];
+		    if (dep_pkg->state_status == SS_INSTALLED
+				    && plan_add(plan, dep_pkg, from_upgrade))
+			 err = -1;
+	       }
+	  }
+	  free(dependents);
+     }
+
+     return err;
+}
+
+/* Drop what installed packages outside the plan still depend on, until
+ * nothing changes, as each dropped package stays installed in turn. */
+static int
+plan_drop_needed(struct remove_plan *plan)
+{
+     abstract_pkg_t **dependents;
+     pkg_t *pkg;
+     int i, dropped, err = 0;
+
+     do {
+	  dropped = 0;
+	  for (i = 0; i < plan->pkgs->len; i++) {
+	       pkg = plan->pkgs->pkgs[i];
+	       if (!plan_has(plan, pkg->name) || !plan_checks_dependents(pkg))
+		    continue;
+
+	       if (installed_dependents(pkg, plan, &dependents)) {
 		    print_dependents_warning(pkg, dependents);
-		    free(dependents);
-		    return -1;
+		    plan_drop(plan, pkg);
+		    dropped = 1;
+		    err = -1;
+	       }
+	       free(dependents);
+	  }
+     } while (dropped);
+
+     return err;
+}
+
+/*
+ * Add the autoinstalled packages that the plan leaves without installed
+ * dependents, then those that these leave orphaned.
+ */
+static int
+plan_add_orphans(struct remove_plan *plan, int from_upgrade)
+{
+     struct compound_depend *cdep;
+     pkg_t *pkg, *p;
+     int i, j, k, count, n_deps, err = 0;
+
+     for (i = 0; i < plan->pkgs->len; i++) {
+	  pkg = plan->pkgs->pkgs[i];
+	  if (!plan_has(plan, pkg->name))
+	       continue;
+
+	  count = pkg->pre_depends_count +
+				pkg->depends_count +
+				pkg->recommends_count +
+				pkg->suggests_count;
+
+	  for (j = 0; j < count; j++) {
+	       cdep = &pkg->depends[j];
+	       if (cdep->type != PREDEPEND
+		   && cdep->type != DEPEND
+		   && cdep->type != RECOMMEND)
+		    continue;
+	       for (k = 0; k < cdep->possibility_count; k++) {
+		    p = pkg_hash_fetch_installed_by_name(
+				    cdep->possibilities[k]->pkg->name);
+		    if (!p || !p->auto_installed || plan_has(plan, p->name))
+			 continue;
+
+		    n_deps = installed_dependents(p, plan, NULL);
+		    if (n_deps == 0) {
+			 opkg_msg(NOTICE, "%s was autoinstalled and is "
+				       "now orphaned, removing.\n",
+				       p->name);
+			 if (plan_add(plan, p, from_upgrade))
+			      err = -1;
+		    } else
+			 opkg_msg(INFO, "%s was autoinstalled and is "
+					 "still required by %d "
+					 "installed packages.\n",
+					 p->name, n_deps);
 	       }
+	  }
+     }
 
-	       /* remove packages depending on this package - Karthik */
-	       err = opkg_remove_dependent_pkgs(pkg, dependents);
-	       if (err) {
-	         free(dependents);
-                 return err;
-               }
+     return err;
+}
+
+/* Append pkg to order after its dependents in the plan. */
+static void
+plan_order(struct remove_plan *plan, pkg_t *pkg, hash_table_t *visited,
+		pkg_vec_t *order)
+{
+     abstract_pkg_t **dependers, *dep_ab_pkg;
+     pkg_t *dep_pkg;
+     int i;
+
+     if (hash_table_get(visited, pkg->name))
+	  return;
+     hash_table_insert(visited, pkg->name, pkg);
+
+     for (i = 0; i < pkg->provides_count; i++) {
+	  dependers = pkg->provides[i]->depended_upon_by;
+	  if (dependers == NULL)
+	       continue;
+	  while ((dep_ab_pkg = *dependers++) != NULL) {
+	       dep_pkg = hash_table_get(&plan->names, dep_ab_pkg->name);
+	       if (dep_pkg)
+		    plan_order(plan, dep_pkg, visited, order);
 	  }
-          if (dependents)
-              free(dependents);
      }
 
+     pkg_vec_insert(order, pkg);
+}
+
+static int
+remove_one(pkg_t *pkg, int from_upgrade)
+{
+     int err;
+
      if (from_upgrade == 0) {
          opkg_msg(NOTICE, "Removing package %s from %s...\n",
 			 pkg->name, pkg->dest->name);
@@ -314,28 +348,155 @@ opkg_remove_pkg(pkg_t *pkg, int from_upgrade)
 
      remove_maintainer_scripts(pkg);
      pkg->state_status = SS_NOT_INSTALLED;
+     abstract_pkg_set_state_status(pkg->parent, SS_NOT_INSTALLED);
 
-     if (parent_pkg)
-	  parent_pkg->state_status = SS_NOT_INSTALLED;
+     return err;
+}
 
-     /* remove autoinstalled packages that are orphaned by the removal of this one */
+/*
+ * Remove pkgs together. What has to go with them, their installed
+ * dependents with --force-removal-of-dependent-packages and their orphaned
+ * autoinstalled dependencies with --autoremove, is worked out once for the
+ * whole set, which is then removed dependents first.
+ */
+int
+opkg_remove_pkgs(pkg_vec_t *pkgs, int from_upgrade)
+{
+     struct remove_plan plan;
+     hash_table_t visited;
+     abstract_pkg_t **dependents;
+     pkg_vec_t *order;
+     pkg_t *pkg;
+     int i, err = 0;
+
+     plan.names.entries = NULL;
+     hash_table_init("remove-plan", &plan.names, 64);
+     plan.pkgs = pkg_vec_alloc();
+
+     for (i = 0; i < pkgs->len; i++) {
+	  pkg = pkgs->pkgs[i];
+	  if (plan_add(&plan, pkg, from_upgrade))
+	       err = -1;
+     }
+
+     if (conf->force_removal_of_dependent_packages) {
+	  if (plan_add_dependents(&plan, from_upgrade))
+	       err = -1;
+     }
+     if (plan_drop_needed(&plan))
+	  err = -1;
      if (conf->autoremove) {
-         if (remove_autoinstalled(pkg) != 0) {
-             err = -1;
-         }
+	  if (plan_add_orphans(&plan, from_upgrade))
+	       err = -1;
      }
+
+     visited.entries = NULL;
+     hash_table_init("remove-order", &visited, 64);
+     order = pkg_vec_alloc();
+     for (i = 0; i < plan.pkgs->len; i++) {
+	  pkg = plan.pkgs->pkgs[i];
+	  if (plan_has(&plan, pkg->name))
+	       plan_order(&plan, pkg, &visited, order);
+     }
+
+     for (i = 0; i < order->len; i++) {
+	  pkg = order->pkgs[i];
+
+	  /* A dependent whose prerm failed is still there. */
+	  if (plan_checks_dependents(pkg)) {
+	       if (installed_dependents(pkg, &plan, &dependents)) {
+		    print_dependents_warning(pkg, dependents);
+		    free(dependents);
+		    plan_drop(&plan, pkg);
+		    err = -1;
+		    continue;
+	       }
+	       free(dependents);
+	  }
+
+	  if (remove_one(pkg, from_upgrade)) {
+	       if (pkg->state_status != SS_NOT_INSTALLED)
+		    plan_drop(&plan, pkg);
+	       err = -1;
+	  }
+     }
+
+     pkg_vec_free(order);
+     hash_table_deinit(&visited);
+     pkg_vec_free(plan.pkgs);
+     hash_table_deinit(&plan.names);
+
      return err;
 }
 
+int
+opkg_remove_pkg(pkg_t *pkg, int from_upgrade)
+{
+     pkg_vec_t *pkgs;
+     int err;
+
+     pkgs = pkg_vec_alloc();
+     pkg_vec_insert(pkgs, pkg);
+     err = opkg_remove_pkgs(pkgs, from_upgrade);
+     pkg_vec_free(pkgs);
+
+     return err;
+}
+
+/* The directory the previous name was removed from, kept open since
+ * sorted names come in runs sharing one. */
+struct remove_dir {
+     char path[PATH_MAX];
+     int fd;
+};
+
+static int
+remove_at(struct remove_dir *dir, const char *file_name, int flags)
+{
+     char buf[PATH_MAX], *base;
+     size_t len = strlen(file_name);
+
+     if (len >= sizeof(buf))
+	  goto fallback;
+     memcpy(buf, file_name, len + 1);
+     while (len > 1 && buf[len - 1] == '/')
+	  buf[--len] = '\0';
+     base = strrchr(buf, '/');
+     if (base == NULL || base == buf)
+	  goto fallback;
+     *base++ = '\0';
+
+     if (dir->fd == -1 || strcmp(dir->path, buf)) {
+	  if (dir->fd != -1)
+	       close(dir->fd);
+	  strcpy(dir->path, buf);
+	  dir->fd = open(buf, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	  if (dir->fd == -1)
+	       goto fallback;
+     }
+
+     return unlinkat(dir->fd, base, flags);
+
+fallback:
+     return (flags & AT_REMOVEDIR) ? rmdir(file_name) : unlink(file_name);
+}
+
+static int
+file_name_cmp(const void *a, const void *b)
+{
+     return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
 void
 remove_data_files_and_list(pkg_t *pkg)
 {
-     str_list_t installed_dirs;
      str_list_t *installed_files;
      str_list_elt_t *iter;
+     struct remove_dir dir;
+     char **files = NULL;
+     size_t n_files = 0, n_dirs = 0, size = 0, i;
      char *file_name;
      conffile_t *conffile;
-     int removed_a_dir;
      pkg_t *owner;
      int rootdirlen = 0;
 
@@ -346,8 +507,6 @@ remove_data_files_and_list(pkg_t *pkg)
 	     return;
      }
 
-     str_list_init(&installed_dirs);
-
      /* don't include trailing slash */
      if (conf->offline_root)
           rootdirlen = strlen(conf->offline_root);
@@ -360,8 +519,26 @@ remove_data_files_and_list(pkg_t *pkg)
 		  /* File may have been claimed by another package. */
 		  continue;
 
-	  if (file_is_dir(file_name)) {
-	       str_list_append(&installed_dirs, file_name);
+	  if (n_files == size) {
+	       size = size ? size * 2 : 256;
+	       files = xrealloc(files, size * sizeof(*files));
+	  }
+	  files[n_files++] = file_name;
+     }
+
+     /* Sorted, the files of a directory are next to each other, and a
+	directory comes before everything below it. */
+     if (n_files)
+	  qsort(files, n_files, sizeof(*files), file_name_cmp);
+     stat_cache_prefetch(installed_files);
+     dir.fd = -1;
+
+     for (i = 0; i < n_files; i++) {
+	  file_name = files[i];
+
+	  /* Directories are gathered, in order, at the front. */
+	  if (stat_cache_type(file_name) == STAT_CACHE_DIR) {
+	       files[n_dirs++] = file_name;
 	       continue;
 	  }
 
@@ -376,7 +553,7 @@ remove_data_files_and_list(pkg_t *pkg)
 
 	  if (!conf->noaction) {
 	  	opkg_msg(INFO, "Deleting %s.\n", file_name);
-	       unlink(file_name);
+	       remove_at(&dir, file_name, 0);
 	  } else
 	  	opkg_msg(INFO, "Not deleting %s. (noaction)\n",
 				file_name);
@@ -384,44 +561,21 @@ remove_data_files_and_list(pkg_t *pkg)
 	  file_hash_remove(file_name);
      }
 
-     /* Remove empty directories */
+     /* Remove empty directories, deepest first so one pass will do */
      if (!conf->noaction) {
-	  do {
-	       removed_a_dir = 0;
-	       for (iter = str_list_first(&installed_dirs); iter; iter = str_list_next(&installed_dirs, iter)) {
-		    file_name = (char *)iter->data;
-
-		    if (rmdir(file_name) == 0) {
-			 opkg_msg(INFO, "Deleting %s.\n", file_name);
-			 removed_a_dir = 1;
-			 str_list_remove(&installed_dirs, &iter);
-		    }
-	       }
-	  } while (removed_a_dir);
+	  for (i = n_dirs; i-- > 0; ) {
+	       if (remove_at(&dir, files[i], AT_REMOVEDIR) == 0)
+		    opkg_msg(INFO, "Deleting %s.\n", files[i]);
+	  }
      }
 
+     if (dir.fd != -1)
+	  close(dir.fd);
+     free(files);
+
      pkg_free_installed_files(pkg);
      pkg_remove_installed_files_list(pkg);
-
-     /* Don't print warning for dirs that are provided by other packages */
-     for (iter = str_list_first(&installed_dirs); iter; iter = str_list_next(&installed_dirs, iter)) {
-	  file_name = (char *)iter->data;
-
-	  owner = file_hash_get_file_owner(file_name);
-	  if (owner) {
-	       free(iter->data);
-	       iter->data = NULL;
-	       str_list_remove(&installed_dirs, &iter);
-	  }
-     }
-
-     /* cleanup */
-     while (!void_list_empty(&installed_dirs)) {
-        iter = str_list_pop(&installed_dirs);
-        free(iter->data);
-        free(iter);
-     }
-     str_list_deinit(&installed_dirs);
+     stat_cache_flush();
 }
 
 void
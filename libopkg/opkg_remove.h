@@ -22,6 +22,7 @@
 #include "opkg_conf.h"
 
 int opkg_remove_pkg(pkg_t *pkg,int message);
+int opkg_remove_pkgs(pkg_vec_t *pkgs, int from_upgrade);
 int pkg_has_installed_dependents(pkg_t *pkg, abstract_pkg_t *** pdependents);
 void remove_data_files_and_list(pkg_t *pkg);
 void remove_maintainer_scripts(pkg_t *pkg);
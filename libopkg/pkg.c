@@ -27,6 +27,8 @@
 
 #include "pkg_parse.h"
 #include "pkg_extract.h"
+#include "pkg_contents.h"
+#include "stat_cache.h"
 #include "opkg_message.h"
 #include "opkg_utils.h"
 
@@ -35,6 +37,7 @@
 #include "file_util.h"
 #include "xsystem.h"
 #include "opkg_conf.h"
+#include "opkg_profile.h"
 
 typedef struct enum_map enum_map_t;
 struct enum_map
@@ -112,6 +115,8 @@ pkg_init(pkg_t *pkg)
      pkg->provides = NULL;
      pkg->filename = NULL;
      pkg->local_filename = NULL;
+     pkg->local_verified = 0;
+     pkg->local_digest = NULL;
      pkg->tmp_unpack_dir = NULL;
      pkg->md5sum = NULL;
 #if defined HAVE_SHA256
@@ -124,6 +129,7 @@ pkg_init(pkg_t *pkg)
      conffile_list_init(&pkg->conffiles);
      pkg->installed_files = NULL;
      pkg->installed_files_ref_cnt = 0;
+     pkg->data_members = NULL;
      pkg->essential = 0;
      pkg->provided_by_hand = 0;
 }
@@ -153,6 +159,31 @@ compound_depend_deinit(compound_depend_t *depends)
     free (depends->possibilities);
 }
 
+int
+pkg_digest_types(pkg_t *pkg)
+{
+	int types = 0;
+
+	if (pkg->md5sum)
+		types |= FILE_DIGEST_MD5;
+#if defined HAVE_SHA256
+	if (pkg->sha256sum)
+		types |= FILE_DIGEST_SHA256;
+#endif
+
+	return types;
+}
+
+void
+pkg_free_local_digest(pkg_t *pkg)
+{
+	if (pkg->local_digest) {
+		file_digest_deinit(pkg->local_digest);
+		free(pkg->local_digest);
+	}
+	pkg->local_digest = NULL;
+}
+
 void
 pkg_deinit(pkg_t *pkg)
 {
@@ -232,6 +263,8 @@ pkg_deinit(pkg_t *pkg)
 	if (pkg->local_filename)
 		free(pkg->local_filename);
 	pkg->local_filename = NULL;
+	pkg->local_verified = 0;
+	pkg_free_local_digest(pkg);
 
      /* CLEANUP: It'd be nice to pullin the cleanup function from
 	opkg_install.c here. See comment in
@@ -265,6 +298,7 @@ pkg_deinit(pkg_t *pkg)
 	assertion here instead? */
 	pkg->installed_files_ref_cnt = 1;
 	pkg_free_installed_files(pkg);
+	pkg_free_data_members(pkg);
 	pkg->essential = 0;
 
 	if (pkg->tags)
@@ -442,6 +476,34 @@ abstract_pkg_init(abstract_pkg_t *ab_pkg)
      ab_pkg->state_status = SS_NOT_INSTALLED;
 }
 
+static int
+state_status_is_installed(pkg_state_status_t state_status)
+{
+     return state_status == SS_INSTALLED || state_status == SS_UNPACKED;
+}
+
+/* Set the state of ab_pkg, and count it as an installed dependent of what
+ * it depends on while it is installed or unpacked. */
+void
+abstract_pkg_set_state_status(abstract_pkg_t *ab_pkg,
+		pkg_state_status_t state_status)
+{
+     int was_installed = state_status_is_installed(ab_pkg->state_status);
+     int is_installed = state_status_is_installed(state_status);
+     unsigned int i;
+
+     ab_pkg->state_status = state_status;
+     if (was_installed == is_installed)
+	  return;
+
+     for (i = 0; i < ab_pkg->depends_on_len; i++) {
+	  if (is_installed)
+	       ab_pkg->depends_on[i]->installed_dependents++;
+	  else
+	       ab_pkg->depends_on[i]->installed_dependents--;
+     }
+}
+
 abstract_pkg_t *
 abstract_pkg_new(void)
 {
@@ -509,41 +571,6 @@ pkg_state_want_from_str(char *str)
      return SW_UNKNOWN;
 }
 
-static char *
-pkg_state_flag_to_str(pkg_state_flag_t sf)
-{
-	int i;
-	unsigned int len;
-	char *str;
-
-	/* clear the temporary flags before converting to string */
-	sf &= SF_NONVOLATILE_FLAGS;
-
-	if (sf == 0)
-		return xstrdup("ok");
-
-	len = 0;
-	for (i=0; i < ARRAY_SIZE(pkg_state_flag_map); i++) {
-		if (sf & pkg_state_flag_map[i].value)
-			len += strlen(pkg_state_flag_map[i].str) + 1;
-	}
-
-	str = xmalloc(len+1);
-	str[0] = '\0';
-
-	for (i=0; i < ARRAY_SIZE(pkg_state_flag_map); i++) {
-		if (sf & pkg_state_flag_map[i].value) {
-			strncat(str, pkg_state_flag_map[i].str, len);
-			strncat(str, ",", len);
-		}
-	}
-
-	len = strlen(str);
-	str[len-1] = '\0'; /* squash last comma */
-
-	return str;
-}
-
 pkg_state_flag_t
 pkg_state_flag_from_str(const char *str)
 {
@@ -602,296 +629,550 @@ pkg_state_status_from_str(const char *str)
      return SS_NOT_INSTALLED;
 }
 
-void
-pkg_formatted_field(FILE *fp, pkg_t *pkg, const char *field)
+/*
+ * Stanzas are rendered into a single growable buffer which is reused across
+ * packages, so that writing out the status file or `opkg info` for a whole
+ * feed costs one fwrite per package rather than a handful of small
+ * allocations and stdio calls per field.
+ */
+typedef struct stanza_buf stanza_buf_t;
+struct stanza_buf
+{
+     char *data;
+     size_t len;
+     size_t size;
+};
+
+static stanza_buf_t stanza;
+
+static void
+stanza_reserve(stanza_buf_t *sb, size_t n)
+{
+     if (sb->len + n <= sb->size)
+	  return;
+
+     if (sb->size == 0)
+	  sb->size = 1024;
+     while (sb->len + n > sb->size)
+	  sb->size *= 2;
+
+     sb->data = xrealloc(sb->data, sb->size);
+}
+
+static void
+stanza_putn(stanza_buf_t *sb, const char *s, size_t n)
+{
+     stanza_reserve(sb, n);
+     memcpy(sb->data + sb->len, s, n);
+     sb->len += n;
+}
+
+static void
+stanza_puts(stanza_buf_t *sb, const char *s)
+{
+     stanza_putn(sb, s, strlen(s));
+}
+
+static void
+stanza_putc(stanza_buf_t *sb, char c)
+{
+     stanza_reserve(sb, 1);
+     sb->data[sb->len++] = c;
+}
+
+static void
+stanza_putul(stanza_buf_t *sb, unsigned long n)
+{
+     char tmp[3 * sizeof(n)];
+     char *p = tmp + sizeof(tmp);
+
+     do {
+	  *--p = '0' + n % 10;
+	  n /= 10;
+     } while (n);
+
+     stanza_putn(sb, p, tmp + sizeof(tmp) - p);
+}
+
+static void
+stanza_putl(stanza_buf_t *sb, long n)
+{
+     if (n < 0) {
+	  stanza_putc(sb, '-');
+	  stanza_putul(sb, -(unsigned long)n);
+     } else
+	  stanza_putul(sb, n);
+}
+
+/* "Name: value\n", for the common single string fields. */
+static void
+stanza_put_field(stanza_buf_t *sb, const char *name, const char *value)
+{
+     stanza_puts(sb, name);
+     stanza_putn(sb, ": ", 2);
+     stanza_puts(sb, value);
+     stanza_putc(sb, '\n');
+}
+
+static void
+stanza_put_depend(stanza_buf_t *sb, compound_depend_t *cdep)
+{
+     int i;
+     depend_t *dep;
+
+     for (i = 0; i < cdep->possibility_count; i++) {
+	  dep = cdep->possibilities[i];
+	  if (i != 0)
+	       stanza_putn(sb, " | ", 3);
+	  stanza_puts(sb, dep->pkg->name);
+	  if (dep->version) {
+	       stanza_putn(sb, " (", 2);
+	       stanza_puts(sb, constraint_to_str(dep->constraint));
+	       stanza_puts(sb, dep->version);
+	       stanza_putc(sb, ')');
+	  }
+     }
+}
+
+static void
+stanza_put_depends(stanza_buf_t *sb, pkg_t *pkg, const char *name,
+		enum depend_type type, int count)
 {
      int i, j;
-     char *str;
      int depends_count = pkg->pre_depends_count +
 			 pkg->depends_count +
 			 pkg->recommends_count +
 			 pkg->suggests_count;
 
-     if (strlen(field) < PKG_MINIMUM_FIELD_NAME_LEN) {
-	  goto UNKNOWN_FMT_FIELD;
+     if (!count)
+	  return;
+
+     stanza_puts(sb, name);
+     stanza_putc(sb, ':');
+     for (j = 0, i = 0; i < depends_count; i++) {
+	  if (pkg->depends[i].type != type)
+	       continue;
+	  stanza_puts(sb, j == 0 ? " " : ", ");
+	  stanza_put_depend(sb, &pkg->depends[i]);
+	  j++;
      }
+     stanza_putc(sb, '\n');
+}
 
-     switch (field[0])
-     {
-     case 'a':
-     case 'A':
-	  if (strcasecmp(field, "Architecture") == 0) {
-	       if (pkg->architecture) {
-                   fprintf(fp, "Architecture: %s\n", pkg->architecture);
-	       }
-	  } else if (strcasecmp(field, "Auto-Installed") == 0) {
-		if (pkg->auto_installed)
-		    fprintf(fp, "Auto-Installed: yes\n");
-	  } else {
-	       goto UNKNOWN_FMT_FIELD;
-	  }
-	  break;
-     case 'c':
-     case 'C':
-	  if (strcasecmp(field, "Conffiles") == 0) {
-	       conffile_list_elt_t *iter;
-
-	       if (nv_pair_list_empty(&pkg->conffiles))
-		    return;
-
-               fprintf(fp, "Conffiles:\n");
-	       for (iter = nv_pair_list_first(&pkg->conffiles); iter; iter = nv_pair_list_next(&pkg->conffiles, iter)) {
-		    if (((conffile_t *)iter->data)->name && ((conffile_t *)iter->data)->value) {
-                         fprintf(fp, " %s %s\n",
-                                 ((conffile_t *)iter->data)->name,
-                                 ((conffile_t *)iter->data)->value);
-		    }
-	       }
-	  } else if (strcasecmp(field, "Conflicts") == 0) {
-	       struct depend *cdep;
-	       if (pkg->conflicts_count) {
-                    fprintf(fp, "Conflicts:");
-		    for(i = 0; i < pkg->conflicts_count; i++) {
-			cdep = pkg->conflicts[i].possibilities[0];
-                        fprintf(fp, "%s %s", i == 0 ? "" : ",",
-				cdep->pkg->name);
-			if (cdep->version) {
-				fprintf(fp, " (%s%s)",
-					constraint_to_str(cdep->constraint),
-					cdep->version);
-			}
-                    }
-                    fprintf(fp, "\n");
-	       }
-	  } else {
-	       goto UNKNOWN_FMT_FIELD;
-	  }
-	  break;
-     case 'd':
-     case 'D':
-	  if (strcasecmp(field, "Depends") == 0) {
-	       if (pkg->depends_count) {
-                    fprintf(fp, "Depends:");
-		    for (j=0, i=0; i<depends_count; i++) {
-			if (pkg->depends[i].type != DEPEND)
-				continue;
-			str = pkg_depend_str(pkg, i);
-			fprintf(fp, "%s %s", j == 0 ? "" : ",", str);
-			free(str);
-			j++;
-                    }
-		    fprintf(fp, "\n");
-	       }
-	  } else if (strcasecmp(field, "Description") == 0) {
-	       if (pkg->description) {
-                   fprintf(fp, "Description: %s\n", pkg->description);
-	       }
-	  } else {
-	       goto UNKNOWN_FMT_FIELD;
-	  }
-          break;
-     case 'e':
-     case 'E':
-	  if (pkg->essential) {
-              fprintf(fp, "Essential: yes\n");
-	  }
-	  break;
-     case 'f':
-     case 'F':
-	  if (pkg->filename) {
-              fprintf(fp, "Filename: %s\n", pkg->filename);
-	  }
-	  break;
-     case 'i':
-     case 'I':
-	  if (strcasecmp(field, "Installed-Size") == 0) {
-               fprintf(fp, "Installed-Size: %ld\n", pkg->installed_size);
-	  } else if (strcasecmp(field, "Installed-Time") == 0 && pkg->installed_time) {
-               fprintf(fp, "Installed-Time: %lu\n", pkg->installed_time);
-	  }
-	  break;
-     case 'm':
-     case 'M':
-	  if (strcasecmp(field, "Maintainer") == 0) {
-	       if (pkg->maintainer) {
-                   fprintf(fp, "Maintainer: %s\n", pkg->maintainer);
-	       }
-	  } else if (strcasecmp(field, "MD5sum") == 0) {
-	       if (pkg->md5sum) {
-                   fprintf(fp, "MD5Sum: %s\n", pkg->md5sum);
-	       }
-	  } else {
-	       goto UNKNOWN_FMT_FIELD;
-	  }
-	  break;
-     case 'p':
-     case 'P':
-	  if (strcasecmp(field, "Package") == 0) {
-               fprintf(fp, "Package: %s\n", pkg->name);
-	  } else if (strcasecmp(field, "Priority") == 0) {
-               fprintf(fp, "Priority: %s\n", pkg->priority);
-	  } else if (strcasecmp(field, "Provides") == 0) {
-	       if (pkg->provides_count) {
-                  fprintf(fp, "Provides:");
-		  for(i = 1; i < pkg->provides_count; i++) {
-                      fprintf(fp, "%s %s", i == 1 ? "" : ",",
-				      pkg->provides[i]->name);
-                  }
-                  fprintf(fp, "\n");
-               }
-	  } else {
-	       goto UNKNOWN_FMT_FIELD;
+typedef void (*field_writer_t)(stanza_buf_t *sb, pkg_t *pkg);
+
+static void
+put_architecture(stanza_buf_t *sb, pkg_t *pkg)
+{
+     if (pkg->architecture)
+	  stanza_put_field(sb, "Architecture", pkg->architecture);
+}
+
+static void
+put_auto_installed(stanza_buf_t *sb, pkg_t *pkg)
+{
+     if (pkg->auto_installed)
+	  stanza_puts(sb, "Auto-Installed: yes\n");
+}
+
+static void
+put_conffiles(stanza_buf_t *sb, pkg_t *pkg)
+{
+     conffile_list_elt_t *iter;
+     conffile_t *cf;
+
+     if (nv_pair_list_empty(&pkg->conffiles))
+	  return;
+
+     stanza_puts(sb, "Conffiles:\n");
+     for (iter = nv_pair_list_first(&pkg->conffiles); iter;
+		     iter = nv_pair_list_next(&pkg->conffiles, iter)) {
+	  cf = (conffile_t *)iter->data;
+	  if (cf->name && cf->value) {
+	       stanza_putc(sb, ' ');
+	       stanza_puts(sb, cf->name);
+	       stanza_putc(sb, ' ');
+	       stanza_puts(sb, cf->value);
+	       stanza_putc(sb, '\n');
 	  }
-	  break;
-     case 'r':
-     case 'R':
-	  if (strcasecmp (field, "Replaces") == 0) {
-	       if (pkg->replaces_count) {
-                    fprintf(fp, "Replaces:");
-		    for (i = 0; i < pkg->replaces_count; i++) {
-                        fprintf(fp, "%s %s", i == 0 ? "" : ",",
-					pkg->replaces[i]->name);
-                    }
-                    fprintf(fp, "\n");
-	       }
-	  } else if (strcasecmp (field, "Recommends") == 0) {
-	       if (pkg->recommends_count) {
-                    fprintf(fp, "Recommends:");
-		    for (j=0, i=0; i<depends_count; i++) {
-			if (pkg->depends[i].type != RECOMMEND)
-				continue;
-			str = pkg_depend_str(pkg, i);
-			fprintf(fp, "%s %s", j == 0 ? "" : ",", str);
-			free(str);
-			j++;
-                    }
-                    fprintf(fp, "\n");
-	       }
-	  } else {
-	       goto UNKNOWN_FMT_FIELD;
+     }
+}
+
+static void
+put_conflicts(stanza_buf_t *sb, pkg_t *pkg)
+{
+     int i;
+     depend_t *cdep;
+
+     if (!pkg->conflicts_count)
+	  return;
+
+     stanza_puts(sb, "Conflicts:");
+     for (i = 0; i < pkg->conflicts_count; i++) {
+	  cdep = pkg->conflicts[i].possibilities[0];
+	  stanza_puts(sb, i == 0 ? " " : ", ");
+	  stanza_puts(sb, cdep->pkg->name);
+	  if (cdep->version) {
+	       stanza_putn(sb, " (", 2);
+	       stanza_puts(sb, constraint_to_str(cdep->constraint));
+	       stanza_puts(sb, cdep->version);
+	       stanza_putc(sb, ')');
 	  }
-	  break;
-     case 's':
-     case 'S':
-	  if (strcasecmp(field, "Section") == 0) {
-	       if (pkg->section) {
-                   fprintf(fp, "Section: %s\n", pkg->section);
-	       }
+     }
+     stanza_putc(sb, '\n');
+}
+
+static void
+put_depends(stanza_buf_t *sb, pkg_t *pkg)
+{
+     stanza_put_depends(sb, pkg, "Depends", DEPEND, pkg->depends_count);
+}
+
+static void
+put_description(stanza_buf_t *sb, pkg_t *pkg)
+{
+     if (pkg->description)
+	  stanza_put_field(sb, "Description", pkg->description);
+}
+
+static void
+put_essential(stanza_buf_t *sb, pkg_t *pkg)
+{
+     if (pkg->essential)
+	  stanza_puts(sb, "Essential: yes\n");
+}
+
+static void
+put_filename(stanza_buf_t *sb, pkg_t *pkg)
+{
+     if (pkg->filename)
+	  stanza_put_field(sb, "Filename", pkg->filename);
+}
+
+static void
+put_installed_size(stanza_buf_t *sb, pkg_t *pkg)
+{
+     stanza_puts(sb, "Installed-Size: ");
+     stanza_putl(sb, pkg->installed_size);
+     stanza_putc(sb, '\n');
+}
+
+static void
+put_installed_time(stanza_buf_t *sb, pkg_t *pkg)
+{
+     if (pkg->installed_time) {
+	  stanza_puts(sb, "Installed-Time: ");
+	  stanza_putul(sb, pkg->installed_time);
+	  stanza_putc(sb, '\n');
+     }
+}
+
+static void
+put_maintainer(stanza_buf_t *sb, pkg_t *pkg)
+{
+     if (pkg->maintainer)
+	  stanza_put_field(sb, "Maintainer", pkg->maintainer);
+}
+
+static void
+put_md5sum(stanza_buf_t *sb, pkg_t *pkg)
+{
+     if (pkg->md5sum)
+	  stanza_put_field(sb, "MD5Sum", pkg->md5sum);
+}
+
+static void
+put_package(stanza_buf_t *sb, pkg_t *pkg)
+{
+     stanza_put_field(sb, "Package", pkg->name);
+}
+
+static void
+put_priority(stanza_buf_t *sb, pkg_t *pkg)
+{
+     if (pkg->priority)
+	  stanza_put_field(sb, "Priority", pkg->priority);
+}
+
+static void
+put_provides(stanza_buf_t *sb, pkg_t *pkg)
+{
+     int i;
+
+     if (!pkg->provides_count)
+	  return;
+
+     /* provides[0] is the package itself */
+     stanza_puts(sb, "Provides:");
+     for (i = 1; i < pkg->provides_count; i++) {
+	  stanza_puts(sb, i == 1 ? " " : ", ");
+	  stanza_puts(sb, pkg->provides[i]->name);
+     }
+     stanza_putc(sb, '\n');
+}
+
+static void
+put_recommends(stanza_buf_t *sb, pkg_t *pkg)
+{
+     stanza_put_depends(sb, pkg, "Recommends", RECOMMEND,
+		     pkg->recommends_count);
+}
+
+static void
+put_replaces(stanza_buf_t *sb, pkg_t *pkg)
+{
+     int i;
+
+     if (!pkg->replaces_count)
+	  return;
+
+     stanza_puts(sb, "Replaces:");
+     for (i = 0; i < pkg->replaces_count; i++) {
+	  stanza_puts(sb, i == 0 ? " " : ", ");
+	  stanza_puts(sb, pkg->replaces[i]->name);
+     }
+     stanza_putc(sb, '\n');
+}
+
+static void
+put_section(stanza_buf_t *sb, pkg_t *pkg)
+{
+     if (pkg->section)
+	  stanza_put_field(sb, "Section", pkg->section);
+}
+
 #if defined HAVE_SHA256
-	  } else if (strcasecmp(field, "SHA256sum") == 0) {
-	       if (pkg->sha256sum) {
-                   fprintf(fp, "SHA256sum: %s\n", pkg->sha256sum);
-	       }
+static void
+put_sha256sum(stanza_buf_t *sb, pkg_t *pkg)
+{
+     if (pkg->sha256sum)
+	  stanza_put_field(sb, "SHA256sum", pkg->sha256sum);
+}
 #endif
-	  } else if (strcasecmp(field, "Size") == 0) {
-	       if (pkg->size) {
-                   fprintf(fp, "Size: %ld\n", pkg->size);
-	       }
-	  } else if (strcasecmp(field, "Source") == 0) {
-	       if (pkg->source) {
-                   fprintf(fp, "Source: %s\n", pkg->source);
-               }
-	  } else if (strcasecmp(field, "Status") == 0) {
-               char *pflag = pkg_state_flag_to_str(pkg->state_flag);
-               fprintf(fp, "Status: %s %s %s\n",
-               	               pkg_state_want_to_str(pkg->state_want),
-			       pflag,
-                               pkg_state_status_to_str(pkg->state_status));
-               free(pflag);
-	  } else if (strcasecmp(field, "Suggests") == 0) {
-	       if (pkg->suggests_count) {
-                    fprintf(fp, "Suggests:");
-		    for (j=0, i=0; i<depends_count; i++) {
-			if (pkg->depends[i].type != SUGGEST)
-				continue;
-			str = pkg_depend_str(pkg, i);
-			fprintf(fp, "%s %s", j == 0 ? "" : ",", str);
-			free(str);
-			j++;
-                    }
-                    fprintf(fp, "\n");
-	       }
-	  } else {
-	       goto UNKNOWN_FMT_FIELD;
-	  }
-	  break;
-     case 't':
-     case 'T':
-	  if (strcasecmp(field, "Tags") == 0) {
-	       if (pkg->tags) {
-                   fprintf(fp, "Tags: %s\n", pkg->tags);
-	       }
+
+static void
+put_size(stanza_buf_t *sb, pkg_t *pkg)
+{
+     if (pkg->size) {
+	  stanza_puts(sb, "Size: ");
+	  stanza_putl(sb, pkg->size);
+	  stanza_putc(sb, '\n');
+     }
+}
+
+static void
+put_source(stanza_buf_t *sb, pkg_t *pkg)
+{
+     if (pkg->source)
+	  stanza_put_field(sb, "Source", pkg->source);
+}
+
+static void
+put_status(stanza_buf_t *sb, pkg_t *pkg)
+{
+     int i, first = 1;
+     /* clear the temporary flags before converting to string */
+     pkg_state_flag_t sf = pkg->state_flag & SF_NONVOLATILE_FLAGS;
+
+     stanza_puts(sb, "Status: ");
+     stanza_puts(sb, pkg_state_want_to_str(pkg->state_want));
+     stanza_putc(sb, ' ');
+     if (sf == 0)
+	  stanza_puts(sb, "ok");
+     for (i = 0; i < ARRAY_SIZE(pkg_state_flag_map); i++) {
+	  if (sf & pkg_state_flag_map[i].value) {
+	       if (!first)
+		    stanza_putc(sb, ',');
+	       stanza_puts(sb, pkg_state_flag_map[i].str);
+	       first = 0;
 	  }
-	  break;
-     case 'v':
-     case 'V':
-	  {
-	       char *version = pkg_version_str_alloc(pkg);
-	       if (version == NULL)
-	            return;
-               fprintf(fp, "Version: %s\n", version);
-	       free(version);
-          }
-	  break;
-     default:
-	  goto UNKNOWN_FMT_FIELD;
      }
+     stanza_putc(sb, ' ');
+     stanza_puts(sb, pkg_state_status_to_str(pkg->state_status));
+     stanza_putc(sb, '\n');
+}
 
-     return;
+static void
+put_suggests(stanza_buf_t *sb, pkg_t *pkg)
+{
+     stanza_put_depends(sb, pkg, "Suggests", SUGGEST, pkg->suggests_count);
+}
+
+static void
+put_tags(stanza_buf_t *sb, pkg_t *pkg)
+{
+     if (pkg->tags)
+	  stanza_put_field(sb, "Tags", pkg->tags);
+}
+
+static void
+put_version(stanza_buf_t *sb, pkg_t *pkg)
+{
+     if (pkg->version == NULL)
+	  return;
+
+     stanza_puts(sb, "Version: ");
+     if (pkg->epoch) {
+	  stanza_putl(sb, pkg->epoch);
+	  stanza_putc(sb, ':');
+     }
+     stanza_puts(sb, pkg->version);
+     if (pkg->revision) {
+	  stanza_putc(sb, '-');
+	  stanza_puts(sb, pkg->revision);
+     }
+     stanza_putc(sb, '\n');
+}
+
+static const struct {
+     const char *name;
+     field_writer_t put;
+} field_writers[] = {
+     { "Architecture", put_architecture },
+     { "Auto-Installed", put_auto_installed },
+     { "Conffiles", put_conffiles },
+     { "Conflicts", put_conflicts },
+     { "Depends", put_depends },
+     { "Description", put_description },
+     { "Essential", put_essential },
+     { "Filename", put_filename },
+     { "Installed-Size", put_installed_size },
+     { "Installed-Time", put_installed_time },
+     { "Maintainer", put_maintainer },
+     { "MD5sum", put_md5sum },
+     { "Package", put_package },
+     { "Priority", put_priority },
+     { "Provides", put_provides },
+     { "Recommends", put_recommends },
+     { "Replaces", put_replaces },
+     { "Section", put_section },
+#if defined HAVE_SHA256
+     { "SHA256sum", put_sha256sum },
+#endif
+     { "Size", put_size },
+     { "Source", put_source },
+     { "Status", put_status },
+     { "Suggests", put_suggests },
+     { "Tags", put_tags },
+     { "Version", put_version },
+};
+
+static const field_writer_t info_fields[] = {
+     put_package,
+     put_version,
+     put_depends,
+     put_recommends,
+     put_suggests,
+     put_provides,
+     put_replaces,
+     put_conflicts,
+     put_status,
+     put_section,
+     put_essential,
+     put_architecture,
+     put_maintainer,
+     put_md5sum,
+     put_size,
+     put_filename,
+     put_conffiles,
+     put_source,
+     put_description,
+     put_installed_time,
+     put_tags,
+};
+
+static const field_writer_t status_fields[] = {
+     put_package,
+     put_version,
+     put_depends,
+     put_recommends,
+     put_suggests,
+     put_provides,
+     put_replaces,
+     put_conflicts,
+     put_status,
+     put_essential,
+     put_architecture,
+     put_conffiles,
+     put_installed_time,
+     put_auto_installed,
+};
+
+static void
+stanza_flush(stanza_buf_t *sb, FILE *fp)
+{
+     if (sb->len)
+	  fwrite(sb->data, 1, sb->len, fp);
+     sb->len = 0;
+}
+
+void
+pkg_formatted_field(FILE *fp, pkg_t *pkg, const char *field)
+{
+     int i;
+
+     for (i = 0; i < ARRAY_SIZE(field_writers); i++) {
+	  if (strcasecmp(field, field_writers[i].name) == 0) {
+	       field_writers[i].put(&stanza, pkg);
+	       stanza_flush(&stanza, fp);
+	       return;
+	  }
+     }
 
-UNKNOWN_FMT_FIELD:
      opkg_msg(ERROR, "Internal error: field=%s\n", field);
 }
 
 void
 pkg_formatted_info(FILE *fp, pkg_t *pkg)
 {
-	pkg_formatted_field(fp, pkg, "Package");
-	pkg_formatted_field(fp, pkg, "Version");
-	pkg_formatted_field(fp, pkg, "Depends");
-	pkg_formatted_field(fp, pkg, "Recommends");
-	pkg_formatted_field(fp, pkg, "Suggests");
-	pkg_formatted_field(fp, pkg, "Provides");
-	pkg_formatted_field(fp, pkg, "Replaces");
-	pkg_formatted_field(fp, pkg, "Conflicts");
-	pkg_formatted_field(fp, pkg, "Status");
-	pkg_formatted_field(fp, pkg, "Section");
-	pkg_formatted_field(fp, pkg, "Essential");
-	pkg_formatted_field(fp, pkg, "Architecture");
-	pkg_formatted_field(fp, pkg, "Maintainer");
-	pkg_formatted_field(fp, pkg, "MD5sum");
-	pkg_formatted_field(fp, pkg, "Size");
-	pkg_formatted_field(fp, pkg, "Filename");
-	pkg_formatted_field(fp, pkg, "Conffiles");
-	pkg_formatted_field(fp, pkg, "Source");
-	pkg_formatted_field(fp, pkg, "Description");
-	pkg_formatted_field(fp, pkg, "Installed-Time");
-	pkg_formatted_field(fp, pkg, "Tags");
-	fputs("\n", fp);
+     int i;
+
+     for (i = 0; i < ARRAY_SIZE(info_fields); i++)
+	  info_fields[i](&stanza, pkg);
+     stanza_putc(&stanza, '\n');
+     stanza_flush(&stanza, fp);
 }
 
 void
 pkg_print_status(pkg_t * pkg, FILE * file)
 {
+     int i;
+
      if (pkg == NULL) {
 	  return;
      }
 
-     pkg_formatted_field(file, pkg, "Package");
-     pkg_formatted_field(file, pkg, "Version");
-     pkg_formatted_field(file, pkg, "Depends");
-     pkg_formatted_field(file, pkg, "Recommends");
-     pkg_formatted_field(file, pkg, "Suggests");
-     pkg_formatted_field(file, pkg, "Provides");
-     pkg_formatted_field(file, pkg, "Replaces");
-     pkg_formatted_field(file, pkg, "Conflicts");
-     pkg_formatted_field(file, pkg, "Status");
-     pkg_formatted_field(file, pkg, "Essential");
-     pkg_formatted_field(file, pkg, "Architecture");
-     pkg_formatted_field(file, pkg, "Conffiles");
-     pkg_formatted_field(file, pkg, "Installed-Time");
-     pkg_formatted_field(file, pkg, "Auto-Installed");
-     fputs("\n", file);
+     for (i = 0; i < ARRAY_SIZE(status_fields); i++)
+	  status_fields[i](&stanza, pkg);
+     stanza_putc(&stanza, '\n');
+     stanza_flush(&stanza, file);
+}
+
+/*
+ * Remember the state which pkg_print_status() just wrote out (or which was
+ * just read in), so that only packages whose state has changed since need
+ * to be appended to the status journal.
+ */
+void
+pkg_mark_state_recorded(pkg_t *pkg)
+{
+     pkg->recorded.valid = 1;
+     pkg->recorded.want = pkg->state_want;
+     pkg->recorded.flag = pkg->state_flag & SF_NONVOLATILE_FLAGS;
+     pkg->recorded.status = pkg->state_status;
+     pkg->recorded.installed_time = pkg->installed_time;
+     pkg->recorded.auto_installed = pkg->auto_installed;
+}
+
+int
+pkg_state_is_recorded(const pkg_t *pkg)
+{
+     return pkg->recorded.valid
+	  && pkg->recorded.want == pkg->state_want
+	  && pkg->recorded.flag == (pkg->state_flag & SF_NONVOLATILE_FLAGS)
+	  && pkg->recorded.status == pkg->state_status
+	  && pkg->recorded.installed_time == pkg->installed_time
+	  && pkg->recorded.auto_installed == pkg->auto_installed;
 }
 
 /*
@@ -1063,7 +1344,7 @@ pkg_version_str_alloc(pkg_t *pkg)
 str_list_t *
 pkg_get_installed_files(pkg_t *pkg)
 {
-     int err, fd;
+     int err;
      char *list_file_name = NULL;
      FILE *list_file = NULL;
      char *line;
@@ -1089,55 +1370,57 @@ pkg_get_installed_files(pkg_t *pkg)
 	     list_from_package = 0;
 
      if (list_from_package) {
+	  file_header_t **m;
+	  char *file_name;
+
 	  if (pkg->local_filename == NULL) {
+	       /* Not downloaded yet, the feed's manifest may know. */
+	       pkg_contents_get_files(pkg, pkg->dest ? pkg->dest->root_dir
+			       : conf->default_dest->root_dir,
+			       pkg->installed_files);
 	       return pkg->installed_files;
 	  }
-	  /* XXX: CLEANUP: Maybe rewrite this to avoid using a temporary
-	     file. In other words, change deb_extract so that it can
-	     simply return the file list as a char *[] rather than
-	     insisting on writing it to a FILE * as it does now. */
-	  sprintf_alloc(&list_file_name, "%s/%s.list.XXXXXX",
-					  conf->tmp_dir, pkg->name);
-	  fd = mkstemp(list_file_name);
-	  if (fd == -1) {
-	       opkg_perror(ERROR, "Failed to make temp file %s.",
-			       list_file_name);
-	       free(list_file_name);
-	       return pkg->installed_files;
-	  }
-	  list_file = fdopen(fd, "r+");
-	  if (list_file == NULL) {
-	       opkg_perror(ERROR, "Failed to fdopen temp file %s.",
-			       list_file_name);
-	       close(fd);
-	       unlink(list_file_name);
-	       free(list_file_name);
-	       return pkg->installed_files;
-	  }
-	  err = pkg_extract_data_file_names_to_stream(pkg, list_file);
-	  if (err) {
-	       opkg_msg(ERROR, "Error extracting file list from %s.\n",
-			       pkg->local_filename);
-	       fclose(list_file);
-	       unlink(list_file_name);
-	       free(list_file_name);
-	       str_list_deinit(pkg->installed_files);
-	       pkg->installed_files = NULL;
-	       return NULL;
+	  if (pkg->data_members == NULL) {
+	       opkg_profile_begin(OPKG_PROFILE_EXTRACT);
+	       pkg->data_members = deb_extract_members(pkg->local_filename,
+			       extract_quiet | extract_data_tar_gz, &err);
+	       opkg_profile_end(OPKG_PROFILE_EXTRACT);
+	       if (pkg->data_members == NULL) {
+		    opkg_msg(ERROR, "Error extracting file list from %s.\n",
+				    pkg->local_filename);
+		    str_list_deinit(pkg->installed_files);
+		    pkg->installed_files = NULL;
+		    return NULL;
+	       }
 	  }
-	  rewind(list_file);
-     } else {
-	  sprintf_alloc(&list_file_name, "%s/%s.list",
-			pkg->dest->info_dir, pkg->name);
-	  list_file = fopen(list_file_name, "r");
-	  if (list_file == NULL) {
-	       opkg_perror(ERROR, "Failed to open %s",
-		       list_file_name);
-	       free(list_file_name);
-	       return pkg->installed_files;
+
+	  for (m = pkg->data_members; *m; m++) {
+	       file_name = (*m)->name;
+	       if (*file_name == '.') {
+		    file_name++;
+	       }
+	       if (*file_name == '/') {
+		    file_name++;
+	       }
+	       sprintf_alloc(&installed_file_name, "%s%s",
+			       pkg->dest->root_dir, file_name);
+	       str_list_append(pkg->installed_files, installed_file_name);
+	       free(installed_file_name);
 	  }
+
+	  return pkg->installed_files;
+     }
+
+     sprintf_alloc(&list_file_name, "%s/%s.list",
+		   pkg->dest->info_dir, pkg->name);
+     list_file = fopen(list_file_name, "r");
+     if (list_file == NULL) {
+	  opkg_perror(ERROR, "Failed to open %s",
+		  list_file_name);
 	  free(list_file_name);
+	  return pkg->installed_files;
      }
+     free(list_file_name);
 
      if (conf->offline_root)
           rootdirlen = strlen(conf->offline_root);
@@ -1151,24 +1434,13 @@ pkg_get_installed_files(pkg_t *pkg)
 	  }
 	  file_name = line;
 
-	  if (list_from_package) {
-	       if (*file_name == '.') {
-		    file_name++;
-	       }
-	       if (*file_name == '/') {
-		    file_name++;
-	       }
+	  if (conf->offline_root &&
+		  strncmp(conf->offline_root, file_name, rootdirlen)) {
 	       sprintf_alloc(&installed_file_name, "%s%s",
-			       pkg->dest->root_dir, file_name);
+			       conf->offline_root, file_name);
 	  } else {
-	       if (conf->offline_root &&
-	               strncmp(conf->offline_root, file_name, rootdirlen)) {
-	            sprintf_alloc(&installed_file_name, "%s%s",
-				    conf->offline_root, file_name);
-	       } else {
-	            // already contains root_dir as header -> ABSOLUTE
-	            sprintf_alloc(&installed_file_name, "%s", file_name);
-	       }
+	       // already contains root_dir as header -> ABSOLUTE
+	       sprintf_alloc(&installed_file_name, "%s", file_name);
 	  }
 	  str_list_append(pkg->installed_files, installed_file_name);
           free(installed_file_name);
@@ -1177,11 +1449,6 @@ pkg_get_installed_files(pkg_t *pkg)
 
      fclose(list_file);
 
-     if (list_from_package) {
-	  unlink(list_file_name);
-	  free(list_file_name);
-     }
-
      return pkg->installed_files;
 }
 
@@ -1205,6 +1472,14 @@ pkg_free_installed_files(pkg_t *pkg)
      pkg->installed_files = NULL;
 }
 
+/* Once pkg is unpacked its file list comes from the database. */
+void
+pkg_free_data_members(pkg_t *pkg)
+{
+     free_member_list(pkg->data_members);
+     pkg->data_members = NULL;
+}
+
 void
 pkg_remove_installed_files_list(pkg_t *pkg)
 {
@@ -1288,10 +1563,15 @@ pkg_run_script(pkg_t *pkg, const char *script, const char *args)
      free(path);
      {
 	  const char *argv[] = {"sh", "-c", cmd, NULL};
+	  opkg_profile_begin(OPKG_PROFILE_SCRIPTS);
 	  err = xsystem(argv);
+	  opkg_profile_end(OPKG_PROFILE_SCRIPTS);
      }
      free(cmd);
 
+     /* Scripts may change anything under the root. */
+     stat_cache_flush();
+
      if (err) {
           if (!conf->offline_root)
 	       opkg_msg(ERROR, "package \"%s\" %s script returned status %d.\n", 
@@ -1330,6 +1610,8 @@ pkg_info_preinstall_check(void)
      int i;
      pkg_vec_t *installed_pkgs = pkg_vec_alloc();
 
+     opkg_profile_begin(OPKG_PROFILE_PREINSTALL_CHECK);
+
      /* update the file owner data structure */
      opkg_msg(INFO, "Updating file owner list.\n");
      pkg_hash_fetch_all_installed(installed_pkgs);
@@ -1351,6 +1633,8 @@ pkg_info_preinstall_check(void)
 	  pkg_free_installed_files(pkg);
      }
      pkg_vec_free(installed_pkgs);
+
+     opkg_profile_end(OPKG_PROFILE_PREINSTALL_CHECK);
 }
 
 struct pkg_write_filelist_data {
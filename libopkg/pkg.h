@@ -31,6 +31,7 @@
 #include "conffile_list.h"
 
 struct opkg_conf;
+struct file_headers_s;
 
 
 #define ARRAY_SIZE(array) sizeof(array) / sizeof((array)[0])
@@ -88,9 +89,22 @@ struct abstract_pkg{
 
     /* XXX: This should be abstract_pkg_vec_t for consistency. */
     struct abstract_pkg ** depended_upon_by;
+    unsigned int depended_upon_by_len;		/* excluding the NULL */
+    unsigned int depended_upon_by_capacity;
+    /* entries of depended_upon_by installed or unpacked, kept up to date
+     * by abstract_pkg_set_state_status() */
+    unsigned int installed_dependents;
+
+    /* the reverse edges: every abstract_pkg this one is depended_upon_by */
+    struct abstract_pkg ** depends_on;
+    unsigned int depends_on_len;
+    unsigned int depends_on_capacity;
 
     abstract_pkg_vec_t * provided_by;
     abstract_pkg_vec_t * replaced_by;
+
+    /* set once this abstract package is in the status set, see pkg_hash.c */
+    int status_tracked;
 };
 
 #include "pkg_depends.h"
@@ -159,6 +173,8 @@ struct pkg
 
      char *filename;
      char *local_filename;
+     int local_verified;	/* local_filename known to match the feed checksum */
+     struct file_digest *local_digest;	/* of local_filename, taken as it was written */
      char *tmp_unpack_dir;
      char *md5sum;
 #if defined HAVE_SHA256
@@ -177,6 +193,9 @@ struct pkg
 	installed_files list was being freed from an inner loop while
 	still being used within an outer loop. */
      int installed_files_ref_cnt;
+     /* Headers of the data members of local_filename, read once for all
+	the file list users of an install. */
+     struct file_headers_s **data_members;
      int essential;
      int arch_priority;
 /* Adding this flag, to "force" opkg to choose a "provided_by_hand" package, if there are multiple choice */
@@ -185,12 +204,27 @@ struct pkg
      /* this flag specifies whether the package was installed to satisfy another
       * package's dependancies */
      int auto_installed;
+
+     /* state as last written to the status database, see opkg_conf.c */
+     struct {
+	  int valid;
+	  pkg_state_want_t want;
+	  pkg_state_flag_t flag;
+	  pkg_state_status_t status;
+	  time_t installed_time;
+	  int auto_installed;
+     } recorded;
 };
 
 pkg_t *pkg_new(void);
 void pkg_deinit(pkg_t *pkg);
 int pkg_init_from_file(pkg_t *pkg, const char *filename);
+/* The file_digest_t types needed to check pkg against its feed entry. */
+int pkg_digest_types(pkg_t *pkg);
+void pkg_free_local_digest(pkg_t *pkg);
 abstract_pkg_t *abstract_pkg_new(void);
+void abstract_pkg_set_state_status(abstract_pkg_t *ab_pkg,
+		pkg_state_status_t state_status);
 
 /*
  * merges fields from newpkg into oldpkg.
@@ -210,8 +244,11 @@ void pkg_formatted_field(FILE *fp, pkg_t *pkg, const char *field);
 void set_flags_from_control(pkg_t *pkg);
 
 void pkg_print_status(pkg_t * pkg, FILE * file);
+void pkg_mark_state_recorded(pkg_t *pkg);
+int pkg_state_is_recorded(const pkg_t *pkg);
 str_list_t *pkg_get_installed_files(pkg_t *pkg);
 void pkg_free_installed_files(pkg_t *pkg);
+void pkg_free_data_members(pkg_t *pkg);
 void pkg_remove_installed_files_list(pkg_t *pkg);
 conffile_t *pkg_get_conffile(pkg_t *pkg, const char *file_name);
 int pkg_run_script(pkg_t *pkg, const char *script, const char *args);
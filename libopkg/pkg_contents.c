@@ -0,0 +1,466 @@
+/* pkg_contents.c - the opkg package management system
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2, or (at
+   your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   Feed file manifests.
+
+   A feed may publish Contents.gz next to its Packages file, in the format
+   Debian uses: one line per file, the path, then a comma separated list
+   of [section/]package, which may be followed by =version. opkg update
+   turns it into <lists_dir>/<src>.contents, one "package version path"
+   line per file sorted by package and version, with "-" for entries that
+   give no version. It is mapped and binary searched when the files of a
+   package are wanted before it has been downloaded.
+
+   An entry without a version is only taken to be about a package when
+   the feed offers no other version of it.
+*/
+
+#include "config.h"
+
+#include <stdio.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "pkg_contents.h"
+#include "opkg_conf.h"
+#include "opkg_download.h"
+#include "opkg_message.h"
+#include "hash_table.h"
+#include "file_util.h"
+#include "sprintf_alloc.h"
+#include "libbb/libbb.h"
+
+#define CONTENTS_SUFFIX ".contents"
+#define CONTENTS_ANY_VERSION "-"
+
+struct contents_entry {
+	const char *pkg;
+	const char *version;
+	const char *path;
+};
+
+struct contents_map {
+	const char *data;
+	size_t len;
+};
+
+static hash_table_t contents_maps;
+static int contents_maps_init;
+
+static char *
+contents_file_name_alloc(const char *lists_dir, const char *src_name)
+{
+	char *file_name;
+
+	sprintf_alloc(&file_name, "%s/%s%s", lists_dir, src_name,
+			CONTENTS_SUFFIX);
+
+	return file_name;
+}
+
+static int
+entry_cmp(const void *a, const void *b)
+{
+	const struct contents_entry *ea = a, *eb = b;
+	int r;
+
+	r = strcmp(ea->pkg, eb->pkg);
+	if (r)
+		return r;
+	r = strcmp(ea->version, eb->version);
+	if (r)
+		return r;
+	return strcmp(ea->path, eb->path);
+}
+
+/* Write the Contents lines in buf to out as sorted "package version path"
+ * lines. */
+static void
+contents_index(char *buf, size_t len, FILE *out)
+{
+	struct contents_entry *entries = NULL;
+	size_t n = 0, size = 0, i;
+	char *line, *next, *end, *loc, *path, *pkg, *version, *p;
+
+	for (line = buf; line < buf + len; line = next) {
+		end = memchr(line, '\n', buf + len - line);
+		if (end == NULL)
+			end = buf + len;
+		next = end + 1;
+		*end = '\0';
+
+		/* The location list is the last field, paths may have spaces. */
+		while (end > line && isspace((unsigned char)end[-1]))
+			*--end = '\0';
+		loc = end;
+		while (loc > line && !isspace((unsigned char)loc[-1]))
+			loc--;
+		if (loc == line)
+			continue;
+		for (p = loc; p > line && isspace((unsigned char)p[-1]); p--)
+			;
+		*p = '\0';
+
+		path = line;
+		if (path[0] == '.' && path[1] == '/')
+			path += 2;
+		while (*path == '/')
+			path++;
+		if (*path == '\0' || !strcmp(path, "FILE"))
+			continue;
+
+		for (pkg = loc; pkg; pkg = p) {
+			p = strchr(pkg, ',');
+			if (p)
+				*p++ = '\0';
+			version = strchr(pkg, '=');
+			if (version)
+				*version++ = '\0';
+			if (version == NULL || *version == '\0')
+				version = CONTENTS_ANY_VERSION;
+			if (strrchr(pkg, '/'))
+				pkg = strrchr(pkg, '/') + 1;
+			if (*pkg == '\0')
+				continue;
+
+			if (n == size) {
+				size = size ? size * 2 : 1024;
+				entries = xrealloc(entries, size * sizeof(*entries));
+			}
+			entries[n].pkg = pkg;
+			entries[n].version = version;
+			entries[n].path = path;
+			n++;
+		}
+	}
+
+	qsort(entries, n, sizeof(*entries), entry_cmp);
+	for (i = 0; i < n; i++)
+		fprintf(out, "%s %s %s\n", entries[i].pkg, entries[i].version,
+				entries[i].path);
+
+	free(entries);
+}
+
+/* The manifest must carry a detached signature, as the package list does. */
+static int
+contents_verify(const char *url, char *gz_file_name)
+{
+#if defined(HAVE_GPGME) || defined(HAVE_OPENSSL)
+	char *sig_url, *sig_file_name;
+	int err;
+
+	sprintf_alloc(&sig_url, "%s.sig", url);
+	sprintf_alloc(&sig_file_name, "%s.sig", gz_file_name);
+
+	err = opkg_download(sig_url, sig_file_name, NULL, NULL, 1);
+	if (err == 0)
+		err = opkg_verify_file(gz_file_name, sig_file_name);
+
+	unlink(sig_file_name);
+	free(sig_file_name);
+	free(sig_url);
+
+	return err;
+#else
+	return -1;
+#endif
+}
+
+int
+pkg_contents_update(pkg_src_t *src, const char *lists_dir,
+		const char *tmp_dir)
+{
+	char *url, *gz_file_name, *file_name;
+	char *buf = NULL, *index = NULL;
+	size_t len = 0, index_len = 0;
+	FILE *in = NULL, *mem = NULL;
+	int err;
+
+	if (src->extra_data)	/* debian style? */
+		sprintf_alloc(&url, "%s/%s/Contents.gz", src->value,
+				src->extra_data);
+	else
+		sprintf_alloc(&url, "%s/Contents.gz", src->value);
+	sprintf_alloc(&gz_file_name, "%s/%s%s.gz", tmp_dir, src->name,
+			CONTENTS_SUFFIX);
+	file_name = contents_file_name_alloc(lists_dir, src->name);
+
+	if (opkg_download(url, gz_file_name, NULL, NULL, 1)) {
+		/* Feeds need not have one, but a stale one must not be used. */
+		opkg_msg(DEBUG, "No file manifest for %s.\n", src->name);
+		unlink(file_name);
+		err = 0;
+		goto cleanup;
+	}
+
+	if (conf->check_signature && contents_verify(url, gz_file_name)) {
+		opkg_msg(NOTICE, "Signature check failed for the file manifest "
+				"of %s, not using it.\n", src->name);
+		unlink(file_name);
+		err = 0;
+		goto cleanup;
+	}
+
+	err = -1;
+	in = fopen(gz_file_name, "r");
+	if (in == NULL) {
+		opkg_perror(ERROR, "Failed to open %s", gz_file_name);
+		goto cleanup;
+	}
+	mem = open_memstream(&buf, &len);
+	if (mem == NULL) {
+		opkg_perror(ERROR, "Failed to inflate %s", url);
+		goto cleanup;
+	}
+	if (unzip(in, mem) != 0) {
+		opkg_msg(ERROR, "Failed to inflate %s.\n", url);
+		goto cleanup;
+	}
+	fclose(mem);
+
+	mem = open_memstream(&index, &index_len);
+	if (mem == NULL) {
+		opkg_perror(ERROR, "Failed to index %s", url);
+		goto cleanup;
+	}
+	contents_index(buf, len, mem);
+	fclose(mem);
+	mem = NULL;
+
+	err = file_write_atomic(file_name, index, index_len);
+	if (err == 0)
+		opkg_msg(NOTICE, "Updated file manifest in %s.\n", file_name);
+
+cleanup:
+	if (err)
+		unlink(file_name);
+	if (mem)
+		fclose(mem);
+	if (in)
+		fclose(in);
+	unlink(gz_file_name);
+	free(index);
+	free(buf);
+	free(file_name);
+	free(gz_file_name);
+	free(url);
+
+	return err;
+}
+
+void
+pkg_contents_remove(pkg_src_t *src, const char *lists_dir)
+{
+	char *file_name;
+
+	file_name = contents_file_name_alloc(lists_dir, src->name);
+	unlink(file_name);
+	free(file_name);
+}
+
+static struct contents_map *
+contents_map_get(pkg_src_t *src)
+{
+	struct contents_map *map;
+	struct stat st;
+	char *file_name;
+	void *data;
+	int fd;
+
+	if (!contents_maps_init) {
+		hash_table_init("contents", &contents_maps, 16);
+		contents_maps_init = 1;
+	}
+
+	map = hash_table_get(&contents_maps, src->name);
+	if (map)
+		return map->data ? map : NULL;
+
+	/* Remember missing manifests too. */
+	map = xcalloc(1, sizeof(*map));
+	hash_table_insert(&contents_maps, src->name, map);
+
+	file_name = contents_file_name_alloc(conf->restrict_to_default_dest
+			? conf->default_dest->lists_dir : conf->lists_dir,
+			src->name);
+	fd = open(file_name, O_RDONLY);
+	free(file_name);
+	if (fd == -1)
+		return NULL;
+
+	if (fstat(fd, &st) == 0 && st.st_size > 0) {
+		data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data != MAP_FAILED) {
+			map->data = data;
+			map->len = st.st_size;
+		}
+	}
+	close(fd);
+
+	return map->data ? map : NULL;
+}
+
+/* Compare the field at p with name. */
+static int
+field_cmp(const char *p, const char *end, const char *name)
+{
+	unsigned char a, b;
+
+	for (;; p++, name++) {
+		a = (p < end && *p != ' ' && *p != '\n') ? *p : '\0';
+		b = *name;
+		if (a != b || a == '\0')
+			return a - b;
+	}
+}
+
+/* Compare the package and version fields of the line at p with name and
+ * version. */
+static int
+key_cmp(const char *p, const char *end, const char *name, const char *version)
+{
+	int r;
+
+	r = field_cmp(p, end, name);
+	if (r)
+		return r;
+
+	p += strlen(name);
+	if (p < end && *p == ' ')
+		p++;
+
+	return field_cmp(p, end, version);
+}
+
+/* First line for version of package name, or NULL. */
+static const char *
+contents_find(struct contents_map *map, const char *name, const char *version)
+{
+	const char *data = map->data, *end = data + map->len;
+	const char *line, *eol;
+	size_t lo = 0, hi = map->len;
+
+	/* lo and hi are always at the start of a line. */
+	while (lo < hi) {
+		line = data + lo + (hi - lo) / 2;
+		while (line > data + lo && line[-1] != '\n')
+			line--;
+		if (key_cmp(line, end, name, version) < 0) {
+			eol = memchr(line, '\n', end - line);
+			lo = eol ? eol - data + 1 : map->len;
+		} else {
+			hi = line - data;
+		}
+	}
+
+	if (lo < map->len && key_cmp(data + lo, end, name, version) == 0)
+		return data + lo;
+
+	return NULL;
+}
+
+static int
+feed_has_other_versions(pkg_t *pkg)
+{
+	pkg_vec_t *vec = pkg->parent ? pkg->parent->pkgs : NULL;
+	unsigned int i;
+
+	for (i = 0; vec && i < vec->len; i++) {
+		pkg_t *other = vec->pkgs[i];
+
+		if (other != pkg && other->src == pkg->src
+				&& pkg_compare_versions(other, pkg))
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * First manifest line about pkg, and in *version the version field of
+ * the lines about it. Entries for another version of pkg on the same feed
+ * are not about it, nor are unversioned ones when there are such.
+ */
+static const char *
+contents_lookup(pkg_t *pkg, struct contents_map **map, char **version)
+{
+	const char *line;
+
+	*map = pkg->src ? contents_map_get(pkg->src) : NULL;
+	if (*map == NULL)
+		return NULL;
+
+	*version = pkg_version_str_alloc(pkg);
+	line = contents_find(*map, pkg->name, *version);
+	if (line == NULL && !feed_has_other_versions(pkg)) {
+		free(*version);
+		*version = xstrdup(CONTENTS_ANY_VERSION);
+		line = contents_find(*map, pkg->name, *version);
+	}
+
+	if (line == NULL) {
+		free(*version);
+		*version = NULL;
+	}
+
+	return line;
+}
+
+int
+pkg_contents_has(pkg_t *pkg)
+{
+	struct contents_map *map;
+	char *version;
+
+	if (contents_lookup(pkg, &map, &version) == NULL)
+		return 0;
+
+	free(version);
+	return 1;
+}
+
+int
+pkg_contents_get_files(pkg_t *pkg, const char *root_dir, str_list_t *files)
+{
+	struct contents_map *map;
+	const char *line, *eol, *end, *path;
+	char *version, *file_name;
+	size_t key_len;
+
+	line = contents_lookup(pkg, &map, &version);
+	if (line == NULL)
+		return -1;
+
+	key_len = strlen(pkg->name) + 1 + strlen(version) + 1;
+	end = map->data + map->len;
+	while (line < end && key_cmp(line, end, pkg->name, version) == 0) {
+		eol = memchr(line, '\n', end - line);
+		if (eol == NULL)
+			eol = end;
+		path = line + key_len;
+		if (path < eol) {
+			sprintf_alloc(&file_name, "%s%.*s", root_dir,
+					(int)(eol - path), path);
+			str_list_append(files, file_name);
+			free(file_name);
+		}
+		line = eol + 1;
+	}
+
+	free(version);
+
+	return 0;
+}
@@ -0,0 +1,43 @@
+/* pkg_contents.h - the opkg package management system
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2, or (at
+   your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+*/
+
+#ifndef PKG_CONTENTS_H
+#define PKG_CONTENTS_H
+
+#include "pkg.h"
+#include "pkg_src.h"
+#include "str_list.h"
+
+/*
+ * Fetch the optional Contents.gz manifest of src into lists_dir, using
+ * tmp_dir for the download. A feed without one just has no manifest, nor
+ * has one whose signature does not check out with check_signature. Call
+ * it only once the package list of src has passed its own check.
+ */
+int pkg_contents_update(pkg_src_t *src, const char *lists_dir,
+		const char *tmp_dir);
+
+/* Drop the manifest of src, for a package list that failed to update. */
+void pkg_contents_remove(pkg_src_t *src, const char *lists_dir);
+
+/* Whether the manifest of pkg's feed lists this version of pkg. */
+int pkg_contents_has(pkg_t *pkg);
+
+/*
+ * Append the files the manifest lists for this version of pkg, under
+ * root_dir, to files. Returns -1 if there is no manifest entry for it.
+ */
+int pkg_contents_get_files(pkg_t *pkg, const char *root_dir,
+		str_list_t *files);
+
+#endif
@@ -24,6 +24,7 @@
 #include "opkg_message.h"
 #include "pkg_parse.h"
 #include "hash_table.h"
+#include "opkg_profile.h"
 #include "libbb/libbb.h"
 
 static int parseDepends(compound_depend_t *compound_depend, char * depend_str);
@@ -50,8 +51,8 @@ static int pkg_constraint_satisfied(pkg_t *pkg, void *cdata)
 }
 
 /* returns ndependencies or negative error value */
-int
-pkg_hash_fetch_unsatisfied_dependencies(pkg_t * pkg, pkg_vec_t *unsatisfied,
+static int
+fetch_unsatisfied_dependencies(pkg_t * pkg, pkg_vec_t *unsatisfied,
 		char *** unresolved)
 {
      pkg_t * satisfier_entry_pkg;
@@ -258,6 +259,19 @@ pkg_hash_fetch_unsatisfied_dependencies(pkg_t * pkg, pkg_vec_t *unsatisfied,
      return unsatisfied->len;
 }
 
+int
+pkg_hash_fetch_unsatisfied_dependencies(pkg_t * pkg, pkg_vec_t *unsatisfied,
+		char *** unresolved)
+{
+     int ret;
+
+     opkg_profile_begin(OPKG_PROFILE_RESOLVE);
+     ret = fetch_unsatisfied_dependencies(pkg, unsatisfied, unresolved);
+     opkg_profile_end(OPKG_PROFILE_RESOLVE);
+
+     return ret;
+}
+
 
 pkg_vec_t *
 pkg_hash_fetch_satisfied_dependencies(pkg_t * pkg)
@@ -532,15 +546,7 @@ int pkg_dependence_satisfied(depend_t *depend)
 
 int is_pkg_in_pkg_vec(pkg_vec_t * vec, pkg_t * pkg)
 {
-    int i;
-    pkg_t ** pkgs = vec->pkgs;
-
-    for(i = 0; i < vec->len; i++)
-	if((strcmp(pkg->name, (*(pkgs + i))->name) == 0)
-	   && (pkg_compare_versions(pkg, *(pkgs + i)) == 0)
-	   && (strcmp(pkg->architecture, (*(pkgs + i))->architecture) == 0))
-	    return 1;
-    return 0;
+    return pkg_vec_contains_equal(vec, pkg);
 }
 
 /**
@@ -889,13 +895,49 @@ pkg_depend_str(pkg_t *pkg, int idx)
 	return str;
 }
 
+/*
+ * Append ab_pkg to the NULL terminated array of abstract packages at
+ * *array, growing it geometrically rather than by one entry per edge.
+ */
+static void
+abstract_pkg_array_insert(abstract_pkg_t ***array, unsigned int *len,
+		unsigned int *capacity, abstract_pkg_t *ab_pkg)
+{
+	if (*len + 1 >= *capacity) {
+		if (*capacity < 4)
+			*capacity = 4;
+		while (*len + 1 >= *capacity)
+			*capacity *= 2;
+
+		*array = xrealloc(*array, *capacity * sizeof(abstract_pkg_t *));
+	}
+
+	(*array)[*len] = ab_pkg;
+	(*array)[*len + 1] = NULL;
+	(*len)++;
+}
+
+/* Record that ab_pkg depends on ab_depend, in both directions. */
+static void
+depended_upon_by_insert(abstract_pkg_t *ab_depend, abstract_pkg_t *ab_pkg)
+{
+	abstract_pkg_array_insert(&ab_depend->depended_upon_by,
+			&ab_depend->depended_upon_by_len,
+			&ab_depend->depended_upon_by_capacity, ab_pkg);
+	abstract_pkg_array_insert(&ab_pkg->depends_on,
+			&ab_pkg->depends_on_len,
+			&ab_pkg->depends_on_capacity, ab_depend);
+
+	if (ab_pkg->state_status == SS_INSTALLED
+			|| ab_pkg->state_status == SS_UNPACKED)
+		ab_depend->installed_dependents++;
+}
+
 void buildDependedUponBy(pkg_t * pkg, abstract_pkg_t * ab_pkg)
 {
 	compound_depend_t * depends;
-	int count, othercount;
+	int count;
 	int i, j;
-	abstract_pkg_t * ab_depend;
-	abstract_pkg_t ** temp;
 
 	count = pkg->pre_depends_count +
 			pkg->depends_count +
@@ -908,29 +950,9 @@ void buildDependedUponBy(pkg_t * pkg, abstract_pkg_t * ab_pkg)
 		    && depends->type != DEPEND
 		    && depends->type != RECOMMEND)
 			continue;
-		for (j = 0; j < depends->possibility_count; j++) {
-			ab_depend = depends->possibilities[j]->pkg;
-			if (!ab_depend->depended_upon_by) {
-				ab_depend->depended_upon_by =
-					xcalloc(1, sizeof(abstract_pkg_t *));
-			}
-
-			temp = ab_depend->depended_upon_by;
-			othercount = 1;
-			while (*temp) {
-			    temp++;
-			    othercount++;
-			}
-			*temp = ab_pkg;
-
-			ab_depend->depended_upon_by =
-				xrealloc(ab_depend->depended_upon_by,
-				(othercount + 1) * sizeof(abstract_pkg_t *));
-
-			/* the array may have been moved by realloc */
-			temp = ab_depend->depended_upon_by + othercount;
-			*temp = NULL;
-		}
+		for (j = 0; j < depends->possibility_count; j++)
+			depended_upon_by_insert(depends->possibilities[j]->pkg,
+					ab_pkg);
 	}
 }
 
@@ -55,6 +55,9 @@ int pkg_dest_init(pkg_dest_t *dest, const char *name, const char *root_dir,const
     sprintf_alloc(&dest->status_file_name, "%s/%s",
 		  dest->opkg_dir, OPKG_STATUS_FILE_SUFFIX);
 
+    sprintf_alloc(&dest->status_journal_name, "%s/%s",
+		  dest->opkg_dir, OPKG_STATUS_JOURNAL_SUFFIX);
+
     return 0;
 }
 
@@ -78,5 +81,27 @@ void pkg_dest_deinit(pkg_dest_t *dest)
     free(dest->status_file_name);
     dest->status_file_name = NULL;
 
+    free(dest->status_journal_name);
+    dest->status_journal_name = NULL;
+
     dest->root_dir = NULL;
 }
+
+/*
+ * The first record of a status journal names the status file it extends.
+ * Compaction renames a new status file into place before it unlinks the
+ * journal, a journal whose header does not match is left over from the
+ * old one and must not be replayed.
+ */
+char *pkg_dest_journal_header(const struct stat *status_st)
+{
+    char *header;
+
+    sprintf_alloc(&header, "Status-File: %llu %llu %lld %lld\n\n",
+		  (unsigned long long)status_st->st_dev,
+		  (unsigned long long)status_st->st_ino,
+		  (long long)status_st->st_size,
+		  (long long)status_st->st_mtime);
+
+    return header;
+}
@@ -19,6 +19,7 @@
 #define PKG_DEST_H
 
 #include <stdio.h>
+#include <sys/stat.h>
 
 typedef struct pkg_dest pkg_dest_t;
 struct pkg_dest
@@ -29,11 +30,12 @@ struct pkg_dest
     char *lists_dir;
     char *info_dir;
     char *status_file_name;
-    FILE *status_fp;
+    char *status_journal_name;
 };
 
 int pkg_dest_init(pkg_dest_t *dest, const char *name, const char *root_dir,const char *lists_dir);
 void pkg_dest_deinit(pkg_dest_t *dest);
+char *pkg_dest_journal_header(const struct stat *status_st);
 
 #endif
 
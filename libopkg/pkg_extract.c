@@ -18,6 +18,8 @@
 #include <stdio.h>
 
 #include "pkg_extract.h"
+#include "opkg_conf.h"
+#include "opkg_profile.h"
 #include "libbb/libbb.h"
 #include "file_util.h"
 #include "sprintf_alloc.h"
@@ -26,10 +28,12 @@ int
 pkg_extract_control_file_to_stream(pkg_t *pkg, FILE *stream)
 {
 	int err;
+	opkg_profile_begin(OPKG_PROFILE_EXTRACT);
 	deb_extract(pkg->local_filename, stream,
 			extract_control_tar_gz
 			| extract_to_stream,
 			NULL, "control", &err);
+	opkg_profile_end(OPKG_PROFILE_EXTRACT);
 	return err;
 }
 
@@ -42,11 +46,13 @@ pkg_extract_control_files_to_dir_with_prefix(pkg_t *pkg, const char *dir,
 
 	sprintf_alloc(&dir_with_prefix, "%s/%s", dir, prefix);
 
+	opkg_profile_begin(OPKG_PROFILE_EXTRACT);
 	deb_extract(pkg->local_filename, stderr,
 			extract_control_tar_gz
 			| extract_all_to_fs| extract_preserve_date
 			| extract_unconditional,
 			dir_with_prefix, NULL, &err);
+	opkg_profile_end(OPKG_PROFILE_EXTRACT);
 
 	free(dir_with_prefix);
 	return err;
@@ -64,11 +70,15 @@ pkg_extract_data_files_to_dir(pkg_t *pkg, const char *dir)
 {
 	int err;
 
+	opkg_profile_begin(OPKG_PROFILE_EXTRACT);
+	unarchive_set_root(conf->offline_root);
 	deb_extract(pkg->local_filename, stderr,
 		extract_data_tar_gz
 		| extract_all_to_fs| extract_preserve_date
-		| extract_unconditional,
+		| extract_unconditional | extract_staged
+		| (conf->offline_root ? 0 : extract_sync),
 		dir, NULL, &err);
+	opkg_profile_end(OPKG_PROFILE_EXTRACT);
 
 	return err;
 }
@@ -91,9 +101,11 @@ pkg_extract_data_file_names_to_stream(pkg_t *pkg, FILE *stream)
        right here, by writing to a tmpfile, then munging things as we
        wrote to the actual stream. */
 
+	opkg_profile_begin(OPKG_PROFILE_EXTRACT);
 	deb_extract(pkg->local_filename, stream,
 		extract_quiet | extract_data_tar_gz | extract_list,
 		NULL, NULL, &err);
+	opkg_profile_end(OPKG_PROFILE_EXTRACT);
 
 	return err;
 }
@@ -16,6 +16,9 @@
 */
 
 #include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 #include "hash_table.h"
 #include "release.h"
@@ -28,13 +31,22 @@
 #include "opkg_utils.h"
 #include "sprintf_alloc.h"
 #include "file_util.h"
+#include "opkg_profile.h"
 #include "libbb/libbb.h"
 
+/*
+ * Abstract packages which have a version that is, or may need to be,
+ * recorded in a status file. This saves walking every feed package
+ * whenever the status files are written.
+ */
+static abstract_pkg_vec_t *status_set;
+
 void
 pkg_hash_init(void)
 {
 	hash_table_init("pkg-hash", &conf->pkg_hash,
 			OPKG_CONF_DEFAULT_HASH_LEN);
+	status_set = abstract_pkg_vec_alloc();
 }
 
 static void
@@ -60,6 +72,7 @@ free_pkgs(const char *key, void *entry, void *data)
 	abstract_pkg_vec_free (ab_pkg->replaced_by);
 	pkg_vec_free (ab_pkg->pkgs);
 	free (ab_pkg->depended_upon_by);
+	free (ab_pkg->depends_on);
 	free (ab_pkg->name);
 	free (ab_pkg);
 }
@@ -69,6 +82,21 @@ pkg_hash_deinit(void)
 {
 	hash_table_foreach(&conf->pkg_hash, free_pkgs, NULL);
 	hash_table_deinit(&conf->pkg_hash);
+	abstract_pkg_vec_free(status_set);
+	status_set = NULL;
+}
+
+/* Exchange the package database in use with the one kept in db. */
+void
+pkg_hash_swap(pkg_hash_db_t *db)
+{
+	hash_table_t pkg_hash = conf->pkg_hash;
+	abstract_pkg_vec_t *set = status_set;
+
+	conf->pkg_hash = db->pkg_hash;
+	status_set = db->status_set;
+	db->pkg_hash = pkg_hash;
+	db->status_set = set;
 }
 
 int
@@ -97,22 +125,15 @@ dist_hash_add_from_file(const char *lists_dir, pkg_src_t *dist)
 }
 
 
-int
-pkg_hash_add_from_file(const char *file_name,
-			pkg_src_t *src, pkg_dest_t *dest, int is_status_file)
+static int
+add_from_stream(FILE *fp, pkg_src_t *src, pkg_dest_t *dest,
+		int is_status_file)
 {
 	pkg_t *pkg;
-	FILE *fp;
 	char *buf;
 	const size_t len = 4096;
 	int ret = 0;
 
-	fp = fopen(file_name, "r");
-	if (fp == NULL) {
-		opkg_perror(ERROR, "Failed to open %s", file_name);
-		return -1;
-	}
-
 	buf = xmalloc(len);
 
 	do {
@@ -148,9 +169,30 @@ pkg_hash_add_from_file(const char *file_name,
 
 		hash_insert_pkg(pkg, is_status_file);
 
+		if (is_status_file)
+			pkg_mark_state_recorded(pkg);
+
 	} while (!feof(fp));
 
 	free(buf);
+
+	return ret;
+}
+
+int
+pkg_hash_add_from_file(const char *file_name,
+			pkg_src_t *src, pkg_dest_t *dest, int is_status_file)
+{
+	FILE *fp;
+	int ret;
+
+	fp = fopen(file_name, "r");
+	if (fp == NULL) {
+		opkg_perror(ERROR, "Failed to open %s", file_name);
+		return -1;
+	}
+
+	ret = add_from_stream(fp, src, dest, is_status_file);
 	fclose(fp);
 
 	return ret;
@@ -159,8 +201,8 @@ pkg_hash_add_from_file(const char *file_name,
 /*
  * Load in feed files from the cached "src" and/or "src/gz" locations.
  */
-int
-pkg_hash_load_feeds(void)
+static int
+load_feeds(void)
 {
 	pkg_src_list_elt_t *iter;
 	pkg_src_t *src, *subdist;
@@ -225,10 +267,165 @@ pkg_hash_load_feeds(void)
 }
 
 /*
- * Load in status files from the configured "dest"s.
+ * Read the status journal of dest whole. Every record ends with a blank
+ * line, *end is set past the last one. Anything after it is being appended
+ * right now or was torn by a crash; only the holder of the exclusive lock
+ * may tell which, and drops it. Returns NULL if there is no journal.
  */
+static char *
+status_journal_read(pkg_dest_t *dest, size_t *end)
+{
+	const char *file_name = dest->status_journal_name;
+	FILE *fp;
+	char *buf;
+	size_t len;
+
+	*end = 0;
+
+	fp = fopen(file_name, "r");
+	if (fp == NULL) {
+		if (errno != ENOENT)
+			opkg_perror(ERROR, "Failed to open %s", file_name);
+		return NULL;
+	}
+
+	buf = xmalloc(BUFSIZ);
+	len = 0;
+	while (1) {
+		size_t n = fread(buf + len, 1, BUFSIZ, fp);
+		len += n;
+		if (n < BUFSIZ)
+			break;
+		buf = xrealloc(buf, len + BUFSIZ);
+	}
+	fclose(fp);
+
+	for (*end = len; *end >= 2; (*end)--) {
+		if (buf[*end - 1] == '\n' && buf[*end - 2] == '\n')
+			break;
+	}
+	if (*end < 2)
+		*end = 0;
+
+	if (*end != len && !conf->lock_shared && !conf->noaction) {
+		opkg_msg(INFO, "Dropping incomplete record from %s.\n",
+				file_name);
+		if (truncate(file_name, *end) == -1)
+			opkg_perror(ERROR, "Failed to truncate %s", file_name);
+	}
+
+	return buf;
+}
+
+static int
+same_file(const struct stat *a, const struct stat *b)
+{
+	return a->st_dev == b->st_dev && a->st_ino == b->st_ino;
+}
+
+/*
+ * Load the status file of dest and replay its journal over it.
+ *
+ * A writer compacts the journal by renaming a new status file into place
+ * and then unlinking the journal. A query that could not take the lock
+ * may run meanwhile, so the journal is read while the status file that
+ * was opened is still the current one, and both are read again otherwise.
+ * That alone does not keep the old journal from being read after the new
+ * status file, so only a journal whose header names the status file that
+ * was opened is replayed, see pkg_dest_journal_header().
+ */
+static int
+load_dest_status(pkg_dest_t *dest)
+{
+	struct stat before, after;
+	FILE *fp, *journal;
+	char *buf, *header;
+	size_t end, header_len = 0;
+	int ret = 0;
+
+	while (1) {
+		fp = fopen(dest->status_file_name, "r");
+		if (fp == NULL && errno != ENOENT) {
+			opkg_perror(ERROR, "Failed to open %s",
+					dest->status_file_name);
+			return -1;
+		}
+		if (fp && fstat(fileno(fp), &before) == -1) {
+			opkg_perror(ERROR, "Failed to stat %s",
+					dest->status_file_name);
+			fclose(fp);
+			return -1;
+		}
+
+		buf = status_journal_read(dest, &end);
+
+		if (stat(dest->status_file_name, &after) == -1) {
+			if (fp == NULL && errno == ENOENT)
+				break;
+		} else if (fp && same_file(&before, &after)) {
+			break;
+		}
+
+		opkg_msg(DEBUG, "%s was replaced while reading, "
+				"reading it again.\n", dest->status_file_name);
+		if (fp)
+			fclose(fp);
+		free(buf);
+	}
+
+	if (fp) {
+		header = pkg_dest_journal_header(&before);
+		header_len = strlen(header);
+		if (end && (end < header_len
+				|| memcmp(buf, header, header_len) != 0)) {
+			opkg_msg(DEBUG, "Ignoring %s, it does not extend %s.\n",
+					dest->status_journal_name,
+					dest->status_file_name);
+			end = 0;
+		}
+		free(header);
+
+		ret = add_from_stream(fp, NULL, dest, 1);
+		fclose(fp);
+	} else {
+		end = 0;
+	}
+
+	if (ret == 0 && end > header_len) {
+		journal = fmemopen(buf + header_len, end - header_len, "r");
+		if (journal == NULL) {
+			opkg_perror(ERROR, "Failed to read %s",
+					dest->status_journal_name);
+			ret = -1;
+		} else {
+			ret = add_from_stream(journal, NULL, dest, 1);
+			fclose(journal);
+		}
+	}
+
+	free(buf);
+
+	return ret;
+}
+
 int
-pkg_hash_load_status_files(void)
+pkg_hash_load_feeds(void)
+{
+	int ret;
+
+	opkg_profile_begin(OPKG_PROFILE_FEED_PARSE);
+	ret = load_feeds();
+	opkg_profile_end(OPKG_PROFILE_FEED_PARSE);
+
+	return ret;
+}
+
+/*
+ * Load in status files from the configured "dest"s, replaying any
+ * status journal over them.
+ */
+static int
+load_status_files(void)
 {
 	pkg_dest_list_elt_t *iter;
 	pkg_dest_t *dest;
@@ -240,23 +437,33 @@ pkg_hash_load_status_files(void)
 
 		dest = (pkg_dest_t *)iter->data;
 
-		if (file_exists(dest->status_file_name)) {
-			if (pkg_hash_add_from_file(dest->status_file_name, NULL, dest, 1))
-				return -1;
-		}
+		if (load_dest_status(dest))
+			return -1;
 	}
 
 	return 0;
 }
 
+int
+pkg_hash_load_status_files(void)
+{
+	int ret;
+
+	opkg_profile_begin(OPKG_PROFILE_STATUS_PARSE);
+	ret = load_status_files();
+	opkg_profile_end(OPKG_PROFILE_STATUS_PARSE);
+
+	return ret;
+}
+
 static abstract_pkg_t *
 abstract_pkg_fetch_by_name(const char * pkg_name)
 {
 	return (abstract_pkg_t *)hash_table_get(&conf->pkg_hash, pkg_name);
 }
 
-pkg_t *
-pkg_hash_fetch_best_installation_candidate(abstract_pkg_t *apkg,
+static pkg_t *
+fetch_best_installation_candidate(abstract_pkg_t *apkg,
 		int (*constraint_fcn)(pkg_t *pkg, void *cdata),
 		void *cdata, int quiet)
 {
@@ -474,6 +681,21 @@ pkg_hash_fetch_best_installation_candidate(abstract_pkg_t *apkg,
      return NULL;
 }
 
+pkg_t *
+pkg_hash_fetch_best_installation_candidate(abstract_pkg_t *apkg,
+		int (*constraint_fcn)(pkg_t *pkg, void *cdata),
+		void *cdata, int quiet)
+{
+	pkg_t *pkg;
+
+	opkg_profile_begin(OPKG_PROFILE_RESOLVE);
+	pkg = fetch_best_installation_candidate(apkg, constraint_fcn, cdata,
+			quiet);
+	opkg_profile_end(OPKG_PROFILE_RESOLVE);
+
+	return pkg;
+}
+
 static int
 pkg_name_constraint_fcn(pkg_t *pkg, void *cdata)
 {
@@ -604,9 +826,25 @@ pkg_hash_fetch_available_helper(const char *pkg_name, void *entry, void *data)
 	}
 }
 
+static void
+pkg_hash_count_available_helper(const char *pkg_name, void *entry, void *data)
+{
+	abstract_pkg_t *ab_pkg = (abstract_pkg_t *)entry;
+	unsigned int *count = (unsigned int *)data;
+
+	if (ab_pkg->pkgs)
+		*count += ab_pkg->pkgs->len;
+}
+
 void
 pkg_hash_fetch_available(pkg_vec_t *all)
 {
+	unsigned int count = 0;
+
+	hash_table_foreach(&conf->pkg_hash, pkg_hash_count_available_helper,
+			&count);
+	pkg_vec_reserve(all, all->len + count);
+
 	hash_table_foreach(&conf->pkg_hash, pkg_hash_fetch_available_helper,
 			all);
 }
@@ -633,6 +871,9 @@ pkg_hash_fetch_all_installed_helper(const char *pkg_name, void *entry, void *dat
 void
 pkg_hash_fetch_all_installed(pkg_vec_t *all)
 {
+	/* everything installed is in the status set, so this is an upper
+	 * bound for the number of abstract packages we will visit */
+	pkg_vec_reserve(all, all->len + status_set->len);
 	hash_table_foreach(&conf->pkg_hash, pkg_hash_fetch_all_installed_helper,
 			all);
 }
@@ -674,11 +915,9 @@ hash_insert_pkg(pkg_t *pkg, int set_status)
 	if (!ab_pkg->pkgs)
 		ab_pkg->pkgs = pkg_vec_alloc();
 
-	if (pkg->state_status == SS_INSTALLED) {
-		ab_pkg->state_status = SS_INSTALLED;
-	} else if (pkg->state_status == SS_UNPACKED) {
-		ab_pkg->state_status = SS_UNPACKED;
-	}
+	if (pkg->state_status == SS_INSTALLED
+			|| pkg->state_status == SS_UNPACKED)
+		abstract_pkg_set_state_status(ab_pkg, pkg->state_status);
 
 	buildDepends(pkg);
 
@@ -695,6 +934,54 @@ hash_insert_pkg(pkg_t *pkg, int set_status)
 
 	pkg_vec_insert_merge(ab_pkg->pkgs, pkg, set_status);
 	pkg->parent = ab_pkg;
+
+	if (set_status || pkg->state_want != SW_UNKNOWN
+			|| pkg->state_status != SS_NOT_INSTALLED)
+		pkg_hash_status_set_add(pkg);
+}
+
+/*
+ * Must be called whenever a package which did not come from a status file
+ * gets a state worth recording, e.g. when it is selected for installation.
+ */
+void
+pkg_hash_status_set_add(pkg_t *pkg)
+{
+	abstract_pkg_t *ab_pkg = pkg->parent;
+
+	if (ab_pkg == NULL)
+		ab_pkg = ensure_abstract_pkg_by_name(pkg->name);
+
+	if (ab_pkg->status_tracked)
+		return;
+
+	ab_pkg->status_tracked = 1;
+	abstract_pkg_vec_insert(status_set, ab_pkg);
+}
+
+/*
+ * All versions of the packages in the status set, in the order in which
+ * they were first added.
+ */
+void
+pkg_hash_fetch_status_set(pkg_vec_t *pkgs)
+{
+	int i, j;
+	unsigned int count = pkgs->len;
+	pkg_vec_t *vec;
+
+	for (i = 0; i < status_set->len; i++)
+		if (status_set->pkgs[i]->pkgs)
+			count += status_set->pkgs[i]->pkgs->len;
+	pkg_vec_reserve(pkgs, count);
+
+	for (i = 0; i < status_set->len; i++) {
+		vec = status_set->pkgs[i]->pkgs;
+		if (!vec)
+			continue;
+		for (j = 0; j < vec->len; j++)
+			pkg_vec_insert(pkgs, vec->pkgs[j]);
+	}
 }
 
 static const char *
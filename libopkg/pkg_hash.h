@@ -24,8 +24,15 @@
 #include "hash_table.h"
 
 
+/* A whole package database, for keeping more than one in memory. */
+typedef struct pkg_hash_db {
+	hash_table_t pkg_hash;
+	abstract_pkg_vec_t *status_set;
+} pkg_hash_db_t;
+
 void pkg_hash_init(void);
 void pkg_hash_deinit(void);
+void pkg_hash_swap(pkg_hash_db_t *db);
 
 void pkg_hash_fetch_available(pkg_vec_t *available);
 
@@ -37,6 +44,9 @@ int pkg_hash_load_status_files(void);
 
 void hash_insert_pkg(pkg_t *pkg, int set_status);
 
+void pkg_hash_status_set_add(pkg_t *pkg);
+void pkg_hash_fetch_status_set(pkg_vec_t *pkgs);
+
 abstract_pkg_t * ensure_abstract_pkg_by_name(const char * pkg_name);
 void pkg_hash_fetch_all_installed(pkg_vec_t *installed);
 pkg_t * pkg_hash_fetch_by_name_version(const char *pkg_name,
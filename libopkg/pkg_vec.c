@@ -22,15 +22,110 @@
 #include "opkg_message.h"
 #include "libbb/libbb.h"
 
+/* Vectors shorter than this are searched linearly. */
+#define PKG_VEC_INDEX_MIN 16
+
+static unsigned int
+name_hash(const char *name)
+{
+    unsigned int h = 5381;
+
+    while (*name)
+	h = (h << 5) + h + (unsigned char)*name++;
+
+    return h;
+}
+
+static void
+vec_index_free(struct pkg_vec_index *index)
+{
+    free(index->slots);
+    index->slots = NULL;
+    index->size = 0;
+}
+
+static void
+vec_index_add(struct pkg_vec_index *index, const char *name, unsigned int pos)
+{
+    unsigned int mask = index->size - 1;
+    unsigned int i = name_hash(name) & mask;
+
+    while (index->slots[i])
+	i = (i + 1) & mask;
+    index->slots[i] = pos + 1;
+}
+
+/*
+ * (Re)build the index for the len entries of items, whose names are found
+ * through name_of. Keeps the table at most half full.
+ */
+static void
+vec_index_build(struct pkg_vec_index *index, void **items, unsigned int len,
+		const char *(*name_of)(const void *))
+{
+    unsigned int i, size = 64;
+
+    while (size < len * 2)
+	size *= 2;
+
+    free(index->slots);
+    index->slots = xcalloc(size, sizeof(unsigned int));
+    index->size = size;
+
+    for (i = 0; i < len; i++)
+	vec_index_add(index, name_of(items[i]), i);
+}
+
+/* Keep the index in step after items[len - 1] was appended. */
+static void
+vec_index_append(struct pkg_vec_index *index, void **items, unsigned int len,
+		const char *(*name_of)(const void *))
+{
+    if (len < PKG_VEC_INDEX_MIN)
+	return;
+
+    if (index->size == 0 || len * 2 > index->size)
+	vec_index_build(index, items, len, name_of);
+    else
+	vec_index_add(index, name_of(items[len - 1]), len - 1);
+}
+
+static const char *
+pkg_name_of(const void *p)
+{
+    return ((const pkg_t *)p)->name;
+}
+
+static const char *
+abstract_pkg_name_of(const void *p)
+{
+    return ((const abstract_pkg_t *)p)->name;
+}
+
 pkg_vec_t * pkg_vec_alloc(void)
 {
     pkg_vec_t * vec = xcalloc(1, sizeof(pkg_vec_t));
     vec->pkgs = NULL;
     vec->len = 0;
+    vec->capacity = 0;
 
     return vec;
 }
 
+/*
+ * Capacity needed to hold n elements, growing geometrically so that
+ * a run of inserts costs amortised O(1) each.
+ */
+static unsigned int vec_grow_capacity(unsigned int capacity, unsigned int n)
+{
+    if (capacity < 4)
+	capacity = 4;
+    while (capacity < n)
+	capacity *= 2;
+
+    return capacity;
+}
+
 void pkg_vec_free(pkg_vec_t *vec)
 {
     if (!vec)
@@ -39,6 +134,7 @@ void pkg_vec_free(pkg_vec_t *vec)
     if (vec->pkgs)
       free(vec->pkgs);
 
+    vec_index_free(&vec->index);
     free(vec);
 }
 
@@ -90,31 +186,85 @@ void pkg_vec_insert_merge(pkg_vec_t *vec, pkg_t *pkg, int set_status)
           pkg_merge(pkg, vec->pkgs[i]);
      }
 
-     /* overwrite the old one */
+     /* overwrite the old one, the name is the same so the index holds */
      pkg_deinit(vec->pkgs[i]);
      free(vec->pkgs[i]);
      vec->pkgs[i] = pkg;
 }
 
+/*
+ * Make room for at least n packages in total, so that callers which know
+ * the final size up front avoid growing the vector step by step.
+ */
+void pkg_vec_reserve(pkg_vec_t *vec, unsigned int n)
+{
+    if (n <= vec->capacity)
+	return;
+
+    vec->capacity = n;
+    vec->pkgs = xrealloc(vec->pkgs, vec->capacity * sizeof(pkg_t *));
+}
+
 void pkg_vec_insert(pkg_vec_t *vec, const pkg_t *pkg)
 {
-    vec->pkgs = xrealloc(vec->pkgs, (vec->len + 1) * sizeof(pkg_t *));
+    if (vec->len == vec->capacity)
+	pkg_vec_reserve(vec, vec_grow_capacity(vec->capacity, vec->len + 1));
     vec->pkgs[vec->len] = (pkg_t *)pkg;
     vec->len++;
+    vec_index_append(&vec->index, (void **)vec->pkgs, vec->len, pkg_name_of);
 }
 
-int pkg_vec_contains(pkg_vec_t *vec, pkg_t *apkg)
+static int pkg_equal(const pkg_t *a, const pkg_t *b)
 {
-     int i;
-     for (i = 0; i < vec->len; i++)
-	  if (vec->pkgs[i] == apkg)
+     return strcmp(a->name, b->name) == 0
+	  && pkg_compare_versions(a, b) == 0
+	  && strcmp(a->architecture, b->architecture) == 0;
+}
+
+/*
+ * Look for apkg itself, or with equal set for any package with the same
+ * name, version and architecture.
+ */
+static int pkg_vec_lookup(pkg_vec_t *vec, pkg_t *apkg, int equal)
+{
+     unsigned int i, mask, slot;
+
+     if (vec->len < PKG_VEC_INDEX_MIN) {
+	  for (i = 0; i < vec->len; i++)
+	       if (vec->pkgs[i] == apkg
+			       || (equal && pkg_equal(apkg, vec->pkgs[i])))
+		    return 1;
+	  return 0;
+     }
+
+     if (vec->index.size == 0)
+	  vec_index_build(&vec->index, (void **)vec->pkgs, vec->len,
+			  pkg_name_of);
+
+     mask = vec->index.size - 1;
+     for (i = name_hash(apkg->name) & mask; (slot = vec->index.slots[i]);
+		     i = (i + 1) & mask) {
+	  pkg_t *pkg = vec->pkgs[slot - 1];
+	  if (pkg == apkg || (equal && pkg_equal(apkg, pkg)))
 	       return 1;
+     }
      return 0;
 }
 
+int pkg_vec_contains(pkg_vec_t *vec, pkg_t *apkg)
+{
+     return pkg_vec_lookup(vec, apkg, 0);
+}
+
+int pkg_vec_contains_equal(pkg_vec_t *vec, pkg_t *pkg)
+{
+     return pkg_vec_lookup(vec, pkg, 1);
+}
+
 void pkg_vec_sort(pkg_vec_t *vec, compare_fcn_t compar)
 {
      qsort(vec->pkgs, vec->len, sizeof(pkg_t *), compar);
+     vec_index_free(&vec->index);
 }
 
 int pkg_vec_clear_marks(pkg_vec_t *vec)
@@ -151,6 +301,7 @@ abstract_pkg_vec_t * abstract_pkg_vec_alloc(void)
     vec = xcalloc(1, sizeof(abstract_pkg_vec_t));
     vec->pkgs = NULL;
     vec->len = 0;
+    vec->capacity = 0;
 
     return vec;
 }
@@ -160,6 +311,7 @@ void abstract_pkg_vec_free(abstract_pkg_vec_t *vec)
     if (!vec)
       return;
     free(vec->pkgs);
+    vec_index_free(&vec->index);
     free(vec);
 }
 
@@ -168,9 +320,22 @@ void abstract_pkg_vec_free(abstract_pkg_vec_t *vec)
  */
 void abstract_pkg_vec_insert(abstract_pkg_vec_t *vec, abstract_pkg_t *pkg)
 {
-    vec->pkgs = xrealloc(vec->pkgs, (vec->len + 1) * sizeof(abstract_pkg_t *));
+    if (vec->len == vec->capacity)
+	abstract_pkg_vec_reserve(vec,
+			vec_grow_capacity(vec->capacity, vec->len + 1));
     vec->pkgs[vec->len] = pkg;
     vec->len++;
+    vec_index_append(&vec->index, (void **)vec->pkgs, vec->len,
+		    abstract_pkg_name_of);
+}
+
+void abstract_pkg_vec_reserve(abstract_pkg_vec_t *vec, unsigned int n)
+{
+    if (n <= vec->capacity)
+	return;
+
+    vec->capacity = n;
+    vec->pkgs = xrealloc(vec->pkgs, vec->capacity * sizeof(abstract_pkg_t *));
 }
 
 abstract_pkg_t * abstract_pkg_vec_get(abstract_pkg_vec_t *vec, int i)
@@ -183,9 +348,23 @@ abstract_pkg_t * abstract_pkg_vec_get(abstract_pkg_vec_t *vec, int i)
 
 int abstract_pkg_vec_contains(abstract_pkg_vec_t *vec, abstract_pkg_t *apkg)
 {
-     int i;
-     for (i = 0; i < vec->len; i++)
-	  if (vec->pkgs[i] == apkg)
+     unsigned int i, mask, slot;
+
+     if (vec->len < PKG_VEC_INDEX_MIN) {
+	  for (i = 0; i < vec->len; i++)
+	       if (vec->pkgs[i] == apkg)
+		    return 1;
+	  return 0;
+     }
+
+     if (vec->index.size == 0)
+	  vec_index_build(&vec->index, (void **)vec->pkgs, vec->len,
+			  abstract_pkg_name_of);
+
+     mask = vec->index.size - 1;
+     for (i = name_hash(apkg->name) & mask; (slot = vec->index.slots[i]);
+		     i = (i + 1) & mask)
+	  if (vec->pkgs[slot - 1] == apkg)
 	       return 1;
      return 0;
 }
@@ -193,6 +372,7 @@ int abstract_pkg_vec_contains(abstract_pkg_vec_t *vec, abstract_pkg_t *apkg)
 void abstract_pkg_vec_sort(pkg_vec_t *vec, compare_fcn_t compar)
 {
      qsort(vec->pkgs, vec->len, sizeof(pkg_t *), compar);
+     vec_index_free(&vec->index);
 }
 
 int pkg_compare_names(const void *p1, const void *p2)
@@ -25,16 +25,31 @@ typedef struct abstract_pkg_vec abstract_pkg_vec_t;
 
 #include "opkg_conf.h"
 
+/*
+ * Open addressing table of (position + 1) in pkgs, keyed by package name.
+ * It is only built once a vector grows past a handful of entries, so that
+ * membership tests on large vectors don't need a linear scan.
+ */
+struct pkg_vec_index
+{
+    unsigned int *slots;
+    unsigned int size;		/* a power of two, or 0 if not built */
+};
+
 struct pkg_vec
 {
     pkg_t **pkgs;
     unsigned int len;
+    unsigned int capacity;
+    struct pkg_vec_index index;
 };
 
 struct abstract_pkg_vec
 {
     abstract_pkg_t **pkgs;
     unsigned int len;
+    unsigned int capacity;
+    struct pkg_vec_index index;
 };
 
 
@@ -43,7 +58,9 @@ void pkg_vec_free(pkg_vec_t *vec);
 
 void pkg_vec_insert_merge(pkg_vec_t *vec, pkg_t *pkg, int set_status);
 void pkg_vec_insert(pkg_vec_t *vec, const pkg_t *pkg);
+void pkg_vec_reserve(pkg_vec_t *vec, unsigned int n);
 int pkg_vec_contains(pkg_vec_t *vec, pkg_t *apkg);
+int pkg_vec_contains_equal(pkg_vec_t *vec, pkg_t *pkg);
 
 typedef int (*compare_fcn_t)(const void *, const void *);
 void pkg_vec_sort(pkg_vec_t *vec, compare_fcn_t compar);
@@ -54,6 +71,7 @@ int pkg_vec_mark_if_matches(pkg_vec_t *vec, const char *pattern);
 abstract_pkg_vec_t * abstract_pkg_vec_alloc(void);
 void abstract_pkg_vec_free(abstract_pkg_vec_t *vec);
 void abstract_pkg_vec_insert(abstract_pkg_vec_t *vec, abstract_pkg_t *pkg);
+void abstract_pkg_vec_reserve(abstract_pkg_vec_t *vec, unsigned int n);
 abstract_pkg_t * abstract_pkg_vec_get(abstract_pkg_vec_t *vec, int i);
 int abstract_pkg_vec_contains(abstract_pkg_vec_t *vec, abstract_pkg_t *apkg);
 void abstract_pkg_vec_sort(pkg_vec_t *vec, compare_fcn_t compar);
@@ -168,6 +168,22 @@ release_comps(release_t *release, unsigned int *count)
      return (const char **)comps;
 }
 
+/* The file_digest_t types that release has checksums for. */
+static int
+release_digest_types(release_t *release)
+{
+     int types = 0;
+
+     if (release->md5sums)
+	  types |= FILE_DIGEST_MD5;
+#ifdef HAVE_SHA256
+     if (release->sha256sums)
+	  types |= FILE_DIGEST_SHA256;
+#endif
+
+     return types;
+}
+
 int
 release_download(release_t *release, pkg_src_t *dist, char *lists_dir, char *tmpdir)
 {
@@ -188,6 +204,7 @@ release_download(release_t *release, pkg_src_t *dist, char *lists_dir, char *tmp
 	       char *url;
 	       char *tmp_file_name, *list_file_name;
 	       char *subpath = NULL;
+	       file_digest_t digest;
 
 	       nv_pair_t *nv = (nv_pair_t *)l->data;
 
@@ -199,9 +216,12 @@ release_download(release_t *release, pkg_src_t *dist, char *lists_dir, char *tmp
 
 	       if (dist->gzip) {
 	       sprintf_alloc(&url, "%s-%s/Packages.gz", prefix, nv->name);
-	       err = opkg_download(url, tmp_file_name, NULL, NULL, 1);
+	       file_digest_init(&digest, release_digest_types(release));
+	       err = opkg_download_digest(url, tmp_file_name, &digest,
+			       NULL, NULL, 1);
 	       if (!err) {
-		    err = release_verify_file(release, tmp_file_name, subpath);
+		    err = release_verify_file(release, tmp_file_name, subpath,
+				    &digest);
 		    if (err) {
 			 unlink (tmp_file_name);
 			 unlink (list_file_name);
@@ -225,17 +245,22 @@ release_download(release_t *release, pkg_src_t *dist, char *lists_dir, char *tmp
 		    unlink (tmp_file_name);
 	       }
 	       free(url);
+	       file_digest_deinit(&digest);
 	       }
 
 	       if (err) {
 		    sprintf_alloc(&url, "%s-%s/Packages", prefix, nv->name);
-		    err = opkg_download(url, list_file_name, NULL, NULL, 1);
+		    file_digest_init(&digest, release_digest_types(release));
+		    err = opkg_download_digest(url, list_file_name, &digest,
+				    NULL, NULL, 1);
 		    if (!err) {
-			 err = release_verify_file(release, tmp_file_name, subpath);
+			 err = release_verify_file(release, list_file_name,
+					 subpath, &digest);
 			 if (err)
 			      unlink (list_file_name);
 		    }
 		    free(url);
+		    file_digest_deinit(&digest);
 	       }
 
 	       free(tmp_file_name);
@@ -299,8 +324,10 @@ release_get_sha256(release_t *release, const char *pathname)
 }
 #endif
 
+/* digest, if not NULL, holds the checksums of file_name taken on download. */
 int
-release_verify_file(release_t *release, const char* file_name, const char *pathname)
+release_verify_file(release_t *release, const char* file_name,
+		const char *pathname, const file_digest_t *digest)
 {
      struct stat f_info;
      char *f_md5 = NULL;
@@ -316,16 +343,30 @@ release_verify_file(release_t *release, const char* file_name, const char *pathn
 	  ret = 1;
      } else {
 
-     f_md5 = file_md5sum_alloc(file_name);
+     file_digest_t file_digest;
+     const file_digest_t *d = digest;
+
+     if (d == NULL) {
+	  file_digest_init(&file_digest, release_digest_types(release));
+	  if (file_digest_update_file(&file_digest, file_name) == 0)
+	       d = &file_digest;
+     }
+
+     if (d) {
+	  f_md5 = file_digest_md5_alloc(d);
 #ifdef HAVE_SHA256
-     f_sha256 = file_sha256sum_alloc(file_name);
+	  f_sha256 = file_digest_sha256_alloc(d);
 #endif
+     }
+
+     if (digest == NULL)
+	  file_digest_deinit(&file_digest);
 
-     if (md5 && strcmp(md5, f_md5)) {
+     if (md5 && (f_md5 == NULL || strcmp(md5, f_md5))) {
 	  opkg_msg(ERROR, "MD5 verification failed for %s - %s.\n", release->name, pathname);
 	  ret = 1;
 #ifdef HAVE_SHA256
-     } else if (sha256 && strcmp(sha256, f_sha256)) {
+     } else if (sha256 && (f_sha256 == NULL || strcmp(sha256, f_sha256))) {
 	  opkg_msg(ERROR, "SHA256 verification failed for %s - %s.\n", release->name, pathname);
 	  ret = 1;
 #endif
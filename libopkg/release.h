@@ -19,6 +19,7 @@
 #include <stdio.h>
 #include "pkg.h"
 #include "cksum_list.h"
+#include "file_util.h"
 
 struct release
 {
@@ -48,6 +49,6 @@ int release_download(release_t *release, pkg_src_t *dist, char *lists_dir, char
 
 const char **release_comps(release_t *release, unsigned int *count);
 
-int release_verify_file(release_t *release, const char *filename, const char *pathname);
+int release_verify_file(release_t *release, const char *filename, const char *pathname, const file_digest_t *digest);
 
 #endif
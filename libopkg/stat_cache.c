@@ -0,0 +1,304 @@
+/* stat_cache.c - the opkg package management system
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2, or (at
+   your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   Existence and type of the files of a transaction.
+
+   The clash checks ask, for every file of a package, whether it exists
+   and whether it is a directory. Files are grouped by directory, and a
+   directory holding many of them is read once with readdir(), whose
+   d_type answers for all its entries; others are stat'ed one at a time.
+   Answers are kept until a change to the file is reported, or until a
+   maintainer script, which may do anything, has run.
+*/
+
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "stat_cache.h"
+#include "hash_table.h"
+#include "libbb/libbb.h"
+
+/* Fewer lookups than this in a directory are cheaper as stat() calls. */
+#define STAT_CACHE_SCAN_MIN 8
+#define STAT_CACHE_DIR_BUCKETS 256
+#define STAT_CACHE_NAME_BUCKETS 16
+
+/* Changed since it was looked at. */
+#define STAT_CACHE_UNKNOWN 3
+
+static int type_values[] = {
+	STAT_CACHE_MISSING, STAT_CACHE_DIR, STAT_CACHE_OTHER, STAT_CACHE_UNKNOWN
+};
+
+struct stat_dir {
+	hash_table_t names;
+	int complete;		/* every entry is in names */
+	unsigned int pending;	/* lookups to come, see stat_cache_prefetch */
+};
+
+static hash_table_t dirs;
+static int dirs_loaded;
+
+static struct stat_dir *
+dir_get(const char *dir_name)
+{
+	struct stat_dir *dir;
+
+	if (!dirs_loaded) {
+		hash_table_init("stat-cache", &dirs, STAT_CACHE_DIR_BUCKETS);
+		dirs_loaded = 1;
+	}
+
+	dir = hash_table_get(&dirs, dir_name);
+	if (dir == NULL) {
+		dir = xcalloc(1, sizeof(*dir));
+		hash_table_init("stat-cache-dir", &dir->names,
+				STAT_CACHE_NAME_BUCKETS);
+		hash_table_insert(&dirs, dir_name, dir);
+	}
+
+	return dir;
+}
+
+static void
+dir_free(struct stat_dir *dir)
+{
+	hash_table_deinit(&dir->names);
+	free(dir);
+}
+
+/* Copy file_name to buf without trailing slashes. */
+static int
+normalize(const char *file_name, char *buf)
+{
+	size_t len = strlen(file_name);
+
+	if (len >= PATH_MAX)
+		return -1;
+
+	memcpy(buf, file_name, len + 1);
+	while (len > 1 && buf[len - 1] == '/')
+		buf[--len] = '\0';
+
+	return 0;
+}
+
+/* Split file_name into buf, its directory, and base. The root directory
+ * is "". */
+static int
+split(const char *file_name, char *buf, const char **base)
+{
+	char *slash;
+
+	if (normalize(file_name, buf) == -1)
+		return -1;
+
+	slash = strrchr(buf, '/');
+	if (slash == NULL || slash[1] == '\0')
+		return -1;
+
+	*slash = '\0';
+	*base = slash + 1;
+
+	return 0;
+}
+
+static enum stat_cache_type
+mode_type(mode_t mode)
+{
+	return S_ISDIR(mode) ? STAT_CACHE_DIR : STAT_CACHE_OTHER;
+}
+
+static enum stat_cache_type
+uncached_type(const char *file_name)
+{
+	struct stat st;
+
+	if (stat(file_name, &st) == -1)
+		return STAT_CACHE_MISSING;
+
+	return mode_type(st.st_mode);
+}
+
+static enum stat_cache_type
+dirent_type(DIR *d, struct dirent *de)
+{
+	struct stat st;
+
+	switch (de->d_type) {
+	case DT_DIR:
+		return STAT_CACHE_DIR;
+	case DT_LNK:
+	case DT_UNKNOWN:
+		/* Symlinks are followed, as by stat(). */
+		if (fstatat(dirfd(d), de->d_name, &st, 0) == -1)
+			return STAT_CACHE_MISSING;
+		return mode_type(st.st_mode);
+	default:
+		return STAT_CACHE_OTHER;
+	}
+}
+
+static void
+dir_scan(const char *dir_name, struct stat_dir *dir)
+{
+	struct dirent *de;
+	char **names = NULL;
+	int *types = NULL;
+	size_t n = 0, size = 0, i;
+	DIR *d;
+
+	d = opendir(*dir_name ? dir_name : "/");
+	if (d == NULL) {
+		/* Then none of its entries exist. */
+		if (errno == ENOENT || errno == ENOTDIR) {
+			hash_table_deinit(&dir->names);
+			hash_table_init("stat-cache-dir", &dir->names,
+					STAT_CACHE_NAME_BUCKETS);
+			dir->complete = 1;
+		}
+		return;
+	}
+
+	while ((de = readdir(d)) != NULL) {
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+			continue;
+		if (n == size) {
+			size = size ? size * 2 : 64;
+			names = xrealloc(names, size * sizeof(*names));
+			types = xrealloc(types, size * sizeof(*types));
+		}
+		names[n] = xstrdup(de->d_name);
+		types[n] = dirent_type(d, de);
+		n++;
+	}
+	closedir(d);
+
+	hash_table_deinit(&dir->names);
+	hash_table_init("stat-cache-dir", &dir->names,
+			n + STAT_CACHE_NAME_BUCKETS);
+	for (i = 0; i < n; i++) {
+		hash_table_insert(&dir->names, names[i],
+				&type_values[types[i]]);
+		free(names[i]);
+	}
+	dir->complete = 1;
+
+	free(names);
+	free(types);
+}
+
+static void
+scan_pending(const char *dir_name, void *entry, void *data)
+{
+	struct stat_dir *dir = entry;
+
+	if (dir->pending >= STAT_CACHE_SCAN_MIN)
+		dir_scan(dir_name, dir);
+	dir->pending = 0;
+}
+
+void
+stat_cache_prefetch(str_list_t *files)
+{
+	str_list_elt_t *iter;
+	struct stat_dir *dir;
+	char buf[PATH_MAX];
+	const char *base;
+
+	for (iter = str_list_first(files); iter;
+			iter = str_list_next(files, iter)) {
+		if (split(iter->data, buf, &base) == -1)
+			continue;
+		dir = dir_get(buf);
+		if (!dir->complete && !hash_table_get(&dir->names, base))
+			dir->pending++;
+	}
+
+	if (dirs_loaded)
+		hash_table_foreach(&dirs, scan_pending, NULL);
+}
+
+enum stat_cache_type
+stat_cache_type(const char *file_name)
+{
+	enum stat_cache_type type;
+	struct stat_dir *dir;
+	char buf[PATH_MAX];
+	const char *base;
+	int *cached;
+
+	if (split(file_name, buf, &base) == -1)
+		return uncached_type(file_name);
+
+	dir = dir_get(buf);
+	cached = hash_table_get(&dir->names, base);
+	if (cached && *cached != STAT_CACHE_UNKNOWN)
+		return *cached;
+	if (cached == NULL && dir->complete)
+		return STAT_CACHE_MISSING;
+
+	type = uncached_type(file_name);
+	hash_table_insert(&dir->names, base, &type_values[type]);
+
+	return type;
+}
+
+void
+stat_cache_forget(const char *file_name)
+{
+	struct stat_dir *dir;
+	char buf[PATH_MAX];
+	char *slash;
+
+	if (!dirs_loaded || normalize(file_name, buf) == -1)
+		return;
+
+	/* Whatever was read of it as a directory is gone. */
+	dir = hash_table_get(&dirs, buf);
+	if (dir) {
+		hash_table_remove(&dirs, buf);
+		dir_free(dir);
+	}
+
+	/* Its parents may have been created along with it. */
+	while ((slash = strrchr(buf, '/')) != NULL) {
+		*slash = '\0';
+		dir = hash_table_get(&dirs, buf);
+		if (dir)
+			hash_table_insert(&dir->names, slash + 1,
+					&type_values[STAT_CACHE_UNKNOWN]);
+	}
+}
+
+static void
+free_dir(const char *dir_name, void *entry, void *data)
+{
+	dir_free(entry);
+}
+
+void
+stat_cache_flush(void)
+{
+	if (!dirs_loaded)
+		return;
+
+	hash_table_foreach(&dirs, free_dir, NULL);
+	hash_table_deinit(&dirs);
+	dirs_loaded = 0;
+}
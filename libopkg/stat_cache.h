@@ -0,0 +1,37 @@
+/* stat_cache.h - the opkg package management system
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2, or (at
+   your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+*/
+
+#ifndef STAT_CACHE_H
+#define STAT_CACHE_H
+
+#include "str_list.h"
+
+enum stat_cache_type {
+	STAT_CACHE_MISSING,
+	STAT_CACHE_DIR,
+	STAT_CACHE_OTHER
+};
+
+/* Read the directories holding many of files in one sweep each. */
+void stat_cache_prefetch(str_list_t *files);
+
+/* What file_name is, following symlinks as stat() does. */
+enum stat_cache_type stat_cache_type(const char *file_name);
+
+/* file_name, or one of its parents, was created, removed or replaced. */
+void stat_cache_forget(const char *file_name);
+
+/* Drop everything, e.g. after running a maintainer script. */
+void stat_cache_flush(void);
+
+#endif
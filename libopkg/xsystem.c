@@ -20,6 +20,7 @@
 #include <unistd.h>
 
 #include "xsystem.h"
+#include "opkg_profile.h"
 #include "libbb/libbb.h"
 
 /* Like system(3), but with error messages printed if the fork fails
@@ -36,6 +37,7 @@ xsystem(const char *argv[])
 	int status;
 	pid_t pid;
 
+	opkg_profile_count_fork();
 	pid = vfork();
 
 	switch (pid) {
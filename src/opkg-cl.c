@@ -29,6 +29,11 @@
 #include "file_util.h"
 #include "opkg_message.h"
 #include "opkg_download.h"
+#include "opkg_cache.h"
+#include "conffile.h"
+#include "stat_cache.h"
+#include "opkg_profile.h"
+#include "opkg_daemon.h"
 #include "../libbb/libbb.h"
 
 enum {
@@ -50,6 +55,8 @@ enum {
 	ARGS_OPT_NODEPS,
 	ARGS_OPT_AUTOREMOVE,
 	ARGS_OPT_CACHE,
+	ARGS_OPT_PROFILE,
+	ARGS_OPT_DAEMON,
 };
 
 static struct option long_options[] = {
@@ -58,6 +65,7 @@ static struct option long_options[] = {
 	{"cache", 1, 0, ARGS_OPT_CACHE},
 	{"conf-file", 1, 0, 'f'},
 	{"conf", 1, 0, 'f'},
+	{"daemon", 2, 0, ARGS_OPT_DAEMON},
 	{"dest", 1, 0, 'd'},
         {"force-maintainer", 0, 0, ARGS_OPT_FORCE_MAINTAINER},
         {"force_maintainer", 0, 0, ARGS_OPT_FORCE_MAINTAINER},
@@ -91,6 +99,7 @@ static struct option long_options[] = {
 	{"nodeps", 0, 0, ARGS_OPT_NODEPS},
 	{"offline", 1, 0, 'o'},
 	{"offline-root", 1, 0, 'o'},
+	{"profile", 0, 0, ARGS_OPT_PROFILE},
 	{"add-arch", 1, 0, ARGS_OPT_ADD_ARCH},
 	{"add-dest", 1, 0, ARGS_OPT_ADD_DEST},
 	{"test", 0, 0, ARGS_OPT_NOACTION},
@@ -101,6 +110,12 @@ static struct option long_options[] = {
 	{0, 0, 0, 0}
 };
 
+static int use_daemon;
+static char *daemon_socket;
+/* opkgd is told the verbosity, query_all, offline root and configuration
+ * file. Any other option makes the query run here. */
+static int local_opts;
+
 static int
 args_parse(int argc, char *argv[])
 {
@@ -202,6 +217,14 @@ args_parse(int argc, char *argv[])
         case ARGS_OPT_DOWNLOAD_ONLY:
 			conf->download_only = 1;
 			break;
+		case ARGS_OPT_PROFILE:
+			conf->profile = 1;
+			break;
+		case ARGS_OPT_DAEMON:
+			use_daemon = 1;
+			if (optarg != NULL)
+				daemon_socket = xstrdup(optarg);
+			break;
 		case ':':
 			parse_err = -1;
 			break;
@@ -211,6 +234,10 @@ args_parse(int argc, char *argv[])
 		default:
 			printf("Confusion: getopt_long returned %d\n", c);
 		}
+
+		if (c != 'A' && c != 'V' && c != 'f' && c != 'o'
+				&& c != ARGS_OPT_DAEMON)
+			local_opts = 1;
 	}
 
 	if (parse_err)
@@ -277,6 +304,8 @@ usage()
 	printf("\t--offline-root <dir>	offline installation of packages.\n");
 	printf("\t--add-arch <arch>:<prio>	Register architecture with given priority\n");
 	printf("\t--add-dest <name>:<path>	Register destination with given path\n");
+	printf("\t--daemon[=<socket>]	Ask opkgd to answer query commands\n");
+	printf("\t--profile		Print time spent per phase to stderr on exit\n");
 	printf("\t--select-higher-version\t 	Use the higher version package rather\n");
 	printf("\t				than the higher arch priority one if more\n");
 	printf("\t				than one candidate is found.\n");
@@ -340,18 +369,7 @@ main(int argc, char *argv[])
 	    !strcmp(cmd_name,"print_installation_architecture") )
 		nocheckfordirorfile = 1;
 
-	if (!strcmp(cmd_name,"flag") ||
-	    !strcmp(cmd_name,"configure") ||
-	    !strcmp(cmd_name,"remove") ||
-	    !strcmp(cmd_name,"files") ||
-	    !strcmp(cmd_name,"search") ||
-	    !strcmp(cmd_name,"compare_versions") ||
-	    !strcmp(cmd_name,"compare-versions") ||
-	    !strcmp(cmd_name,"list_installed") ||
-	    !strcmp(cmd_name,"list-installed") ||
-	    !strcmp(cmd_name,"list_changed_conffiles") ||
-	    !strcmp(cmd_name,"list-changed-conffiles") ||
-	    !strcmp(cmd_name,"status") )
+	if (!opkg_cmd_reads_feeds(cmd_name))
 		noreadfeedsfile = 1;
 
 	cmd = opkg_cmd_find(cmd_name);
@@ -361,7 +379,25 @@ main(int argc, char *argv[])
 		usage();
 	}
 
+	if (cmd->requires_args && opts == argc) {
+		fprintf(stderr,
+			 "%s: the ``%s'' command requires at least one argument\n",
+			 argv[0], cmd_name);
+		usage();
+	}
+
+	if (use_daemon && cmd->query && !local_opts) {
+		if (daemon_socket == NULL)
+			daemon_socket = opkg_daemon_socket_alloc();
+		err = opkg_daemon_forward(daemon_socket, argc - opts + 1,
+				(const char **) (argv + opts - 1));
+		free(daemon_socket);
+		if (err != -1)
+			goto err0;
+	}
+
 	conf->pfm = cmd->pfm;
+	conf->lock_shared = cmd->query;
 
 	if (opkg_conf_load())
 		goto err0;
@@ -376,19 +412,23 @@ main(int argc, char *argv[])
 			goto err1;
 	}
 
-	if (cmd->requires_args && opts == argc) {
-		fprintf(stderr,
-			 "%s: the ``%s'' command requires at least one argument\n",
-			 argv[0], cmd_name);
-		usage();
-	}
+	/* Queries work on the in-memory copy from here on. */
+	if (conf->lock_shared)
+		opkg_conf_unlock();
 
 	err = opkg_cmd_exec(cmd, argc - opts, (const char **) (argv + opts));
 
+	opkg_cache_flush();
+	conffile_cache_flush();
+	stat_cache_flush();
+
 #ifdef HAVE_CURL
 	opkg_curl_cleanup();
 #endif
 err1:
+	if (conf->profile)
+		opkg_profile_print(stderr);
+
 	opkg_conf_deinit();
 
 err0:
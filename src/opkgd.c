@@ -0,0 +1,137 @@
+/* opkgd.c - the opkg package management system
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2, or (at
+   your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   opkg query daemon using libopkg, see opkg_daemon.c
+*/
+
+#include "config.h"
+
+#include <stdio.h>
+#include <getopt.h>
+
+#include "opkg_conf.h"
+#include "opkg_daemon.h"
+#include "opkg_message.h"
+#include "../libbb/libbb.h"
+
+static struct option long_options[] = {
+	{"conf-file", 1, 0, 'f'},
+	{"conf", 1, 0, 'f'},
+	{"offline", 1, 0, 'o'},
+	{"offline-root", 1, 0, 'o'},
+	{"socket", 1, 0, 's'},
+	{"tmp-dir", 1, 0, 't'},
+	{"tmp_dir", 1, 0, 't'},
+	{"verbosity", 2, 0, 'V'},
+	{"version", 0, 0, 'v'},
+	{0, 0, 0, 0}
+};
+
+static char *socket_path;
+
+static void
+usage()
+{
+	printf("usage: opkgd [options...]\n");
+	printf("Keeps the package database in memory and answers opkg query\n");
+	printf("commands forwarded by 'opkg --daemon'.\n");
+
+	printf("\nOptions:\n");
+	printf("\t-f <conf_file>		Use <conf_file> as the opkg configuration file\n");
+	printf("\t--conf <conf_file>\n");
+	printf("\t-o <dir>		Use <dir> as the root directory for\n");
+	printf("\t--offline-root <dir>	offline installation of packages.\n");
+	printf("\t-s <socket>		Listen on <socket> rather than opkgd.sock\n");
+	printf("\t--socket <socket>	in the opkg state directory.\n");
+	printf("\t-t			Specify tmp-dir.\n");
+	printf("\t--tmp-dir		Specify tmp-dir.\n");
+	printf("\t-V[<level>]		Set verbosity level to <level>.\n");
+
+	exit(1);
+}
+
+static int
+args_parse(int argc, char *argv[])
+{
+	int c;
+	int option_index = 0;
+
+	while (1) {
+		c = getopt_long_only(argc, argv, "f:o:s:t:vV::",
+				long_options, &option_index);
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case 'f':
+			conf->conf_file = xstrdup(optarg);
+			break;
+		case 'o':
+			conf->offline_root = xstrdup(optarg);
+			break;
+		case 's':
+			socket_path = xstrdup(optarg);
+			break;
+		case 't':
+			conf->tmp_dir = xstrdup(optarg);
+			break;
+		case 'v':
+			printf("opkgd version %s\n", VERSION);
+			exit(0);
+		case 'V':
+			conf->verbosity = INFO;
+			if (optarg != NULL)
+				conf->verbosity = atoi(optarg);
+			break;
+		default:
+			return -1;
+		}
+	}
+
+	return optind;
+}
+
+int
+main(int argc, char *argv[])
+{
+	int opts, err = -1;
+
+	if (opkg_conf_init())
+		goto err0;
+
+	conf->verbosity = NOTICE;
+
+	opts = args_parse(argc, argv);
+	if (opts != argc)
+		usage();
+
+	/* Keep every field, each request masks them for its own command. */
+	conf->pfm = 0;
+	conf->lock_shared = 1;
+
+	if (opkg_conf_load())
+		goto err0;
+
+	if (socket_path == NULL)
+		socket_path = opkg_daemon_socket_alloc();
+
+	err = opkg_daemon_serve(socket_path);
+
+	free(socket_path);
+	opkg_conf_deinit();
+
+err0:
+	print_error_list();
+	free_error_list();
+
+	return err;
+}
@@ -0,0 +1,523 @@
+/* opkg_bench.c - timing harness for the libopkg hot paths
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2, or (at
+   your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+*/
+
+/*
+ * Generates a synthetic feed and installed rootfs under a scratch
+ * directory, then times the libopkg entry points which dominate large
+ * installs, reporting wall time, allocation count and peak RSS for each.
+ *
+ *   opkg_bench [-n packages] [-f fanout] [-p provides_every]
+ *              [-i installed] [-l files_per_pkg] [-x files_in_ipk]
+ *              [-d workdir] [-k]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <libgen.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+
+#include "opkg_conf.h"
+#include "opkg_message.h"
+#include "pkg.h"
+#include "pkg_hash.h"
+#include "pkg_extract.h"
+#include "pkg_depends.h"
+#include "file_util.h"
+#include "sprintf_alloc.h"
+#include "xsystem.h"
+#include "libbb/libbb.h"
+
+/*
+ * Count allocations by interposing on the glibc allocator. Elsewhere the
+ * allocation column is simply reported as zero. uClibc defines __GLIBC__
+ * too, but has no __libc_malloc.
+ */
+static unsigned long n_allocs;
+
+#if defined __GLIBC__ && !defined __UCLIBC__
+extern void *__libc_malloc(size_t);
+extern void *__libc_calloc(size_t, size_t);
+extern void *__libc_realloc(void *, size_t);
+
+void *
+malloc(size_t size)
+{
+	n_allocs++;
+	return __libc_malloc(size);
+}
+
+void *
+calloc(size_t nmemb, size_t size)
+{
+	n_allocs++;
+	return __libc_calloc(nmemb, size);
+}
+
+void *
+realloc(void *ptr, size_t size)
+{
+	n_allocs++;
+	return __libc_realloc(ptr, size);
+}
+#endif
+
+struct bench_opts {
+	int packages;
+	int fanout;
+	int provides_every;
+	int installed;
+	int files_per_pkg;
+	int files_in_ipk;
+	const char *workdir;
+	int keep;
+};
+
+struct phase {
+	struct timespec start;
+	unsigned long allocs;
+};
+
+static void
+phase_begin(struct phase *p)
+{
+	p->allocs = n_allocs;
+	clock_gettime(CLOCK_MONOTONIC, &p->start);
+}
+
+static void
+phase_end(struct phase *p, const char *name)
+{
+	struct timespec end;
+	struct rusage ru;
+	double ms;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	getrusage(RUSAGE_SELF, &ru);
+
+	ms = (end.tv_sec - p->start.tv_sec) * 1000.0
+		+ (end.tv_nsec - p->start.tv_nsec) / 1000000.0;
+
+	printf("%-40s %10.2f ms %12lu allocs %10ld kB peak RSS\n",
+			name, ms, n_allocs - p->allocs, ru.ru_maxrss);
+	fflush(stdout);
+}
+
+/* Cheap deterministic generator, so runs are comparable. */
+static unsigned int bench_seed = 12345;
+
+static unsigned int
+bench_rand(void)
+{
+	bench_seed = bench_seed * 1103515245 + 12345;
+	return (bench_seed >> 16) & 0x7fff;
+}
+
+static void
+write_stanza_common(FILE *fp, int i)
+{
+	fprintf(fp, "Package: bench-%d\n", i);
+	fprintf(fp, "Version: 1.%d-r0\n", i % 10);
+}
+
+/*
+ * Dependencies only point at higher numbered packages so that the graph
+ * is acyclic; every fourth one goes through a virtual package if there are
+ * any.
+ */
+static void
+write_depends(FILE *fp, const struct bench_opts *o, int i)
+{
+	int k, target, remaining = o->packages - i - 1;
+
+	if (remaining <= 0 || o->fanout == 0)
+		return;
+
+	fprintf(fp, "Depends:");
+	for (k = 0; k < o->fanout; k++) {
+		target = i + 1 + bench_rand() % remaining;
+		if (o->provides_every && (k % 4) == 3
+				&& target / o->provides_every > 0)
+			fprintf(fp, "%s virtual-%d", k ? "," : "",
+					target / o->provides_every);
+		else
+			fprintf(fp, "%s bench-%d (>= 1.0)", k ? "," : "",
+					target);
+	}
+	fprintf(fp, "\n");
+}
+
+static int
+generate_feed(const struct bench_opts *o, const char *file_name)
+{
+	FILE *fp;
+	int i;
+
+	fp = fopen(file_name, "w");
+	if (fp == NULL) {
+		perror(file_name);
+		return -1;
+	}
+
+	for (i = 0; i < o->packages; i++) {
+		write_stanza_common(fp, i);
+		write_depends(fp, o, i);
+		if (o->provides_every && i % o->provides_every == 0)
+			fprintf(fp, "Provides: virtual-%d\n",
+					i / o->provides_every);
+		fprintf(fp, "Section: bench\n"
+				"Architecture: all\n"
+				"Maintainer: Bench <bench@example.org>\n"
+				"MD5Sum: 0123456789abcdef0123456789abcdef\n"
+				"Size: %d\n"
+				"Filename: bench-%d_1.%d-r0_all.ipk\n"
+				"Source: bench-%d.bb\n"
+				"Description: synthetic benchmark package %d\n\n",
+				1000 + i, i, i % 10, i, i);
+	}
+
+	fclose(fp);
+	return 0;
+}
+
+/* The first o->installed packages of the feed, with their file lists. */
+static int
+generate_rootfs(const struct bench_opts *o, pkg_dest_t *dest)
+{
+	FILE *fp, *list;
+	char *list_name;
+	int i, k;
+
+	if (file_mkdir_hier(dest->info_dir, 0755))
+		return -1;
+
+	fp = fopen(dest->status_file_name, "w");
+	if (fp == NULL) {
+		perror(dest->status_file_name);
+		return -1;
+	}
+
+	for (i = 0; i < o->installed && i < o->packages; i++) {
+		write_stanza_common(fp, i);
+		fprintf(fp, "Status: install ok installed\n"
+				"Architecture: all\n"
+				"Conffiles:\n /etc/bench-%d.conf "
+				"0123456789abcdef0123456789abcdef\n"
+				"Installed-Time: %d\n%s\n",
+				i, 1300000000 + i,
+				i % 3 ? "Auto-Installed: yes\n" : "");
+
+		sprintf_alloc(&list_name, "%s/bench-%d.list",
+				dest->info_dir, i);
+		list = fopen(list_name, "w");
+		if (list == NULL) {
+			perror(list_name);
+			free(list_name);
+			fclose(fp);
+			return -1;
+		}
+		fprintf(list, "/etc/bench-%d.conf\n", i);
+		for (k = 0; k < o->files_per_pkg; k++)
+			fprintf(list, "/usr/share/bench-%d/file-%d\n", i, k);
+		fclose(list);
+		free(list_name);
+	}
+
+	fclose(fp);
+	return 0;
+}
+
+/* Build a package with o->files_in_ipk data files using the host tools. */
+static char *
+generate_ipk(const struct bench_opts *o)
+{
+	char *dir, *path, *cmd, *ipk;
+	FILE *fp;
+	int k;
+
+	sprintf_alloc(&dir, "%s/ipk", o->workdir);
+	sprintf_alloc(&path, "%s/data/usr/share/bench-ipk", dir);
+	if (file_mkdir_hier(path, 0755)) {
+		free(path);
+		free(dir);
+		return NULL;
+	}
+	free(path);
+
+	for (k = 0; k < o->files_in_ipk; k++) {
+		sprintf_alloc(&path, "%s/data/usr/share/bench-ipk/file-%d",
+				dir, k);
+		fp = fopen(path, "w");
+		if (fp) {
+			fprintf(fp, "synthetic file %d\n", k);
+			fclose(fp);
+		}
+		free(path);
+	}
+
+	sprintf_alloc(&path, "%s/control", dir);
+	fp = fopen(path, "w");
+	if (fp) {
+		fprintf(fp, "Package: bench-ipk\nVersion: 1.0\n"
+				"Architecture: all\n");
+		fclose(fp);
+	}
+	free(path);
+
+	sprintf_alloc(&ipk, "%s/bench-ipk_1.0_all.ipk", dir);
+	sprintf_alloc(&cmd, "cd %s && rm -f %s "
+			"&& tar -C data -czf data.tar.gz . "
+			"&& tar -czf control.tar.gz ./control "
+			"&& ar q %s control.tar.gz data.tar.gz 2>/dev/null",
+			dir, ipk, ipk);
+	if (system(cmd) != 0) {
+		fprintf(stderr, "Failed to build %s.\n", ipk);
+		free(ipk);
+		ipk = NULL;
+	}
+	free(cmd);
+	free(dir);
+
+	return ipk;
+}
+
+static int
+write_conf(const struct bench_opts *o, char **offline_root)
+{
+	char *etc, *conf_name, *lock_dir;
+	FILE *fp;
+	int err;
+
+	sprintf_alloc(offline_root, "%s/root", o->workdir);
+
+	/* opkg_conf_load() takes its lock inside the offline root */
+	sprintf_alloc(&lock_dir, "%s/%s", *offline_root, OPKGLOCKFILE);
+	err = file_mkdir_hier(dirname(lock_dir), 0755);
+	free(lock_dir);
+	if (err)
+		return -1;
+
+	sprintf_alloc(&etc, "%s/etc/opkg", *offline_root);
+	if (file_mkdir_hier(etc, 0755)) {
+		free(etc);
+		return -1;
+	}
+
+	sprintf_alloc(&conf_name, "%s/opkg.conf", etc);
+	fp = fopen(conf_name, "w");
+	if (fp == NULL) {
+		perror(conf_name);
+		free(conf_name);
+		free(etc);
+		return -1;
+	}
+	fprintf(fp, "src bench file://%s/feed\n"
+			"dest root /\n"
+			"arch all 1\n", o->workdir);
+	fclose(fp);
+
+	free(conf_name);
+	free(etc);
+	return 0;
+}
+
+static void
+usage(const char *argv0)
+{
+	fprintf(stderr, "usage: %s [-n packages] [-f fanout] "
+			"[-p provides_every] [-i installed] [-l files_per_pkg]\n"
+			"\t[-x files_in_ipk] [-d workdir] [-k]\n", argv0);
+	exit(1);
+}
+
+static int
+run(const struct bench_opts *o)
+{
+	struct phase p;
+	pkg_vec_t *available, *deps;
+	char *feed, *extract_dir, **unresolved, **u;
+	pkg_t *pkg;
+	file_digest_t digest;
+	FILE *null;
+	int i;
+
+	sprintf_alloc(&feed, "%s/bench", conf->lists_dir);
+	if (file_mkdir_hier(conf->lists_dir, 0755)
+			|| generate_feed(o, feed)
+			|| generate_rootfs(o, conf->default_dest)) {
+		free(feed);
+		return -1;
+	}
+	free(feed);
+
+	printf("%d packages, fanout %d, provides every %d, "
+			"%d installed with %d files each\n",
+			o->packages, o->fanout, o->provides_every,
+			o->installed, o->files_per_pkg);
+
+	phase_begin(&p);
+	pkg_hash_load_feeds();
+	phase_end(&p, "pkg_hash_load_feeds");
+
+	phase_begin(&p);
+	pkg_hash_load_status_files();
+	phase_end(&p, "pkg_hash_load_status_files");
+
+	phase_begin(&p);
+	pkg_info_preinstall_check();
+	phase_end(&p, "pkg_info_preinstall_check");
+
+	available = pkg_vec_alloc();
+	pkg_hash_fetch_available(available);
+
+	phase_begin(&p);
+	for (i = 0; i < available->len; i++) {
+		deps = pkg_vec_alloc();
+		unresolved = NULL;
+		pkg_hash_fetch_unsatisfied_dependencies(available->pkgs[i],
+				deps, &unresolved);
+		if (unresolved) {
+			for (u = unresolved; *u; u++)
+				free(*u);
+			free(unresolved);
+		}
+		pkg_vec_free(deps);
+	}
+	phase_end(&p, "pkg_hash_fetch_unsatisfied_dependencies");
+
+	/* make every installed package look changed */
+	for (i = 0; i < available->len; i++) {
+		pkg = available->pkgs[i];
+		if (pkg->state_status == SS_INSTALLED) {
+			pkg->installed_time++;
+			pkg_hash_status_set_add(pkg);
+		}
+	}
+	pkg_vec_free(available);
+
+	phase_begin(&p);
+	opkg_conf_write_status_files();
+	phase_end(&p, "opkg_conf_write_status_files");
+
+	if (o->files_in_ipk <= 0)
+		return 0;
+
+	pkg = pkg_new();
+	pkg->local_filename = generate_ipk(o);
+	if (pkg->local_filename == NULL) {
+		pkg_deinit(pkg);
+		free(pkg);
+		return -1;
+	}
+
+	phase_begin(&p);
+	file_digest_init(&digest, FILE_DIGEST_ALL);
+	file_digest_update_file(&digest, pkg->local_filename);
+	free(file_digest_md5_alloc(&digest));
+	file_digest_deinit(&digest);
+	phase_end(&p, "file_digest (all checksums)");
+
+	sprintf_alloc(&extract_dir, "%s/extract/", o->workdir);
+	file_mkdir_hier(extract_dir, 0755);
+
+	phase_begin(&p);
+	pkg_extract_data_files_to_dir(pkg, extract_dir);
+	phase_end(&p, "deb_extract (data to fs)");
+
+	null = fopen("/dev/null", "w");
+	if (null) {
+		phase_begin(&p);
+		pkg_extract_data_file_names_to_stream(pkg, null);
+		phase_end(&p, "deb_extract (file list)");
+		fclose(null);
+	}
+
+	free(extract_dir);
+	pkg_deinit(pkg);
+	free(pkg);
+
+	return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct bench_opts o = {
+		.packages = 1000,
+		.fanout = 4,
+		.provides_every = 10,
+		.installed = -1,
+		.files_per_pkg = 20,
+		.files_in_ipk = 1000,
+		.workdir = NULL,
+		.keep = 0,
+	};
+	char *workdir = NULL, *offline_root, *cmd;
+	int c, err;
+
+	while ((c = getopt(argc, argv, "n:f:p:i:l:x:d:k")) != -1) {
+		switch (c) {
+		case 'n': o.packages = atoi(optarg); break;
+		case 'f': o.fanout = atoi(optarg); break;
+		case 'p': o.provides_every = atoi(optarg); break;
+		case 'i': o.installed = atoi(optarg); break;
+		case 'l': o.files_per_pkg = atoi(optarg); break;
+		case 'x': o.files_in_ipk = atoi(optarg); break;
+		case 'd': o.workdir = optarg; break;
+		case 'k': o.keep = 1; break;
+		default: usage(argv[0]);
+		}
+	}
+
+	if (o.installed < 0)
+		o.installed = o.packages / 10;
+
+	if (o.workdir == NULL) {
+		workdir = xstrdup("/tmp/opkg-bench-XXXXXX");
+		if (mkdtemp(workdir) == NULL) {
+			perror(workdir);
+			return 1;
+		}
+		o.workdir = workdir;
+	}
+
+	if (write_conf(&o, &offline_root))
+		return 1;
+
+	opkg_conf_init();
+	conf->offline_root = offline_root;
+	conf->verbosity = ERROR;
+	if (opkg_conf_load()) {
+		print_error_list();
+		return 1;
+	}
+
+	err = run(&o);
+
+	print_error_list();
+	free_error_list();
+	opkg_conf_deinit();
+
+	if (!o.keep) {
+		sprintf_alloc(&cmd, "rm -rf %s", o.workdir);
+		if (system(cmd) != 0)
+			fprintf(stderr, "Failed to remove %s.\n", o.workdir);
+		free(cmd);
+	}
+	free(workdir);
+
+	return err ? 1 : 0;
+}
@@ -0,0 +1,97 @@
+#!/usr/bin/python3
+
+import os, sys, time, socket, hashlib, subprocess
+import opk, cfg, opkgcl
+
+opk.regress_init()
+
+cache_dir = "/tmp/opkg-cache"
+os.system("rm -rf {}".format(cache_dir))
+os.mkdir(cache_dir)
+
+s = socket.socket()
+s.bind(("127.0.0.1", 0))
+port = s.getsockname()[1]
+s.close()
+
+f = open("{}/etc/opkg/opkg.conf".format(cfg.offline_root), "w")
+f.write("arch all 1\n")
+f.write("src test http://127.0.0.1:{}\n".format(port))
+f.write("option cache {}\n".format(cache_dir))
+f.write("option cache_max_size 250\n")
+f.close()
+
+sums = {}
+plist = open("Packages", "w")
+for name in ["a", "b", "c"]:
+	data = "{}-data".format(name)
+	f = open(data, "wb")
+	f.write(os.urandom(100 * 1024))
+	f.close()
+	p = opk.Opk(Package=name)
+	p.write(data_files=[data])
+	os.unlink(data)
+	filename = "{}_1.0_all.opk".format(name)
+	sums[name] = hashlib.sha256(open(filename, "rb").read()).hexdigest()
+	plist.write("Package: {}\nVersion: 1.0\nArchitecture: all\n"
+			"Filename: {}\nSHA256sum: {}\n\n"
+			.format(name, filename, sums[name]))
+plist.close()
+
+server = subprocess.Popen([sys.executable, "-m", "http.server", str(port),
+		"--bind", "127.0.0.1"], cwd=cfg.opkdir,
+		stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+
+def cached(name):
+	return os.path.exists("{}/sha256-{}".format(cache_dir, sums[name]))
+
+def fail(msg):
+	server.kill()
+	print(__file__, ": {}".format(msg))
+	exit(False)
+
+for i in range(50):
+	try:
+		socket.create_connection(("127.0.0.1", port)).close()
+		break
+	except OSError:
+		time.sleep(0.1)
+
+opkgcl.update()
+
+for name in ["a", "b", "c"]:
+	opkgcl.install(name)
+	if not opkgcl.is_installed(name):
+		fail("package ``{}'' not installed.".format(name))
+	if not cached(name):
+		fail("package ``{}'' not cached by checksum.".format(name))
+	# Entries are aged in whole seconds.
+	time.sleep(1.1)
+
+# Three 100k packages do not fit in 250k, the oldest one goes.
+if cached("a") or not cached("b"):
+	fail("least recently used package was not evicted.")
+index = open("{}/index".format(cache_dir)).read()
+if sums["a"] in index or sums["c"] not in index:
+	fail("cache index does not match the cache.")
+
+# An entry cut short is downloaded again rather than installed.
+entry = "{}/sha256-{}".format(cache_dir, sums["c"])
+size = os.path.getsize(entry)
+os.truncate(entry, size // 2)
+opkgcl.remove("c")
+opkgcl.install("c")
+if not opkgcl.is_installed("c"):
+	fail("package ``c'' not reinstalled over a truncated cache entry.")
+if os.path.getsize(entry) != size:
+	fail("truncated cache entry was not replaced.")
+
+# A cache hit needs no feed.
+server.kill()
+server.wait()
+opkgcl.remove("c")
+opkgcl.install("c")
+if not opkgcl.is_installed("c"):
+	fail("package ``c'' not reinstalled from the cache.")
+
+os.system("rm -rf {}".format(cache_dir))
@@ -3,3 +3,4 @@ import os
 opkdir = "/tmp/opk"
 offline_root = "/tmp/opkg"
 opkgcl = os.path.realpath("../../src/opkg-cl")
+opkgd = os.path.realpath("../../src/opkgd")
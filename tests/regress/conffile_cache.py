@@ -0,0 +1,72 @@
+#!/usr/bin/python3
+
+import os, time, hashlib
+import opk, cfg, opkgcl
+
+opk.regress_init()
+
+os.makedirs("etc", exist_ok=True)
+f = open("etc/foo", "w")
+f.write("foo\n")
+f.close()
+md5 = hashlib.md5(b"foo\n").hexdigest()
+
+o = opk.OpkGroup()
+o.add(Package="a", Conffiles="\n /etc/foo {}".format(md5))
+o.opk_list[-1].write(data_files=["etc/foo"])
+o.write_list()
+os.unlink("etc/foo")
+os.rmdir("etc")
+
+opkgcl.update()
+opkgcl.install("a")
+if not opkgcl.is_installed("a"):
+	print(__file__, ": package ``a'' not installed.")
+	exit(False)
+
+foo = "{}/etc/foo".format(cfg.offline_root)
+cache = "{}/usr/lib/opkg/conffile.cache".format(cfg.offline_root)
+
+def changed_conffiles():
+	return opkgcl.opkgcl("list-changed-conffiles")[1]
+
+def set_cached_md5(md5sum):
+	f = open(cache)
+	lines = f.read().split("\n")
+	f.close()
+	f = open(cache, "w")
+	for line in lines:
+		if line.endswith(foo):
+			line = md5sum + line[32:]
+		if line:
+			f.write(line + "\n")
+	f.close()
+
+# Files changed within the last second are not remembered.
+time.sleep(2.1)
+
+if changed_conffiles() != "":
+	print(__file__, ": untouched conffile reported as changed.")
+	exit(False)
+if not os.path.exists(cache) or foo not in open(cache).read():
+	print(__file__, ": conffile md5sum was not cached.")
+	exit(False)
+
+# An unchanged file is answered from the cache, without reading it.
+set_cached_md5("0" * 32)
+if "/etc/foo" not in changed_conffiles():
+	print(__file__, ": conffile was rehashed despite an unchanged stat.")
+	exit(False)
+
+# Any change to its stat makes it be hashed again.
+os.utime(foo)
+if changed_conffiles() != "":
+	print(__file__, ": stale cache entry used after the file changed.")
+	exit(False)
+
+f = open(foo, "w")
+f.write("bar\n")
+f.close()
+if "/etc/foo" not in changed_conffiles():
+	print(__file__, ": modified conffile not reported.")
+	exit(False)
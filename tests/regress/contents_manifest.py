@@ -0,0 +1,116 @@
+#!/usr/bin/python3
+
+import os, gzip
+import opk, cfg, opkgcl
+
+opk.regress_init()
+
+files = ["foo", "bar", "dfile", "mvfile", "nfile", "pfile"]
+for name in files:
+	open(name, "w").close()
+o = opk.OpkGroup()
+o.add(Package="a")
+o.opk_list[-1].write(data_files=["foo"])
+o.add(Package="b")
+o.opk_list[-1].write(data_files=["foo"])
+o.add(Package="c")
+o.opk_list[-1].write(data_files=["bar"])
+# Only version 1.0 of 'd' has a file that clashes with 'a'. The manifest
+# gives versions for the files of 2.0 only.
+o.add(Package="d", Version="1.0")
+o.opk_list[-1].write(data_files=["foo"])
+o.add(Package="d", Version="2.0")
+o.opk_list[-1].write(data_files=["dfile"])
+# mvfile moves from 'm' to the new version of 'n', which needs 'p'.
+o.add(Package="m")
+o.opk_list[-1].write(data_files=["mvfile"])
+opk.Opk(Package="n", Version="1.0").write(data_files=["nfile"])
+o.add(Package="n", Version="2.0", Depends="p")
+o.opk_list[-1].write(data_files=["mvfile"])
+o.add(Package="p")
+o.opk_list[-1].write(data_files=["pfile"])
+o.write_list()
+for name in files:
+	os.unlink(name)
+
+# Debian style: path, then [section/]package[=version] list.
+def write_contents():
+	f = gzip.open("Contents.gz", "wt")
+	f.write("foo    base/a,misc/b,d\n")
+	f.write("bar    c\n")
+	f.write("dfile  d=2.0\n")
+	f.write("mvfile m,n\n")
+	f.write("pfile  p\n")
+	f.close()
+
+write_contents()
+contents = "{}/usr/lib/opkg/lists/test.contents".format(cfg.offline_root)
+
+def fail(msg):
+	os.unlink("Contents.gz")
+	print(__file__, ": {}".format(msg))
+	exit(False)
+
+# Version 1.0 of 'n' is not on the feed.
+opkgcl.install("n_1.0_all.opk")
+
+opkgcl.update()
+if not os.path.exists(contents):
+	fail("File manifest not fetched by update.")
+
+opkgcl.install("a")
+if not opkgcl.is_installed("a"):
+	fail("Package 'a' not installed.")
+
+# The clash is found from the manifest, without the package at hand.
+os.rename("b_1.0_all.opk", "b.opk")
+status, output = opkgcl.opkgcl("install b")
+os.rename("b.opk", "b_1.0_all.opk")
+if opkgcl.is_installed("b"):
+	fail("Clashing package 'b' installed.")
+if "Not downloading b" not in output:
+	fail("Clash not found before downloading 'b'.")
+
+opkgcl.install("c")
+if not opkgcl.is_installed("c"):
+	fail("Package 'c' not installed.")
+
+# Files of some other version of 'd' are no clash.
+opkgcl.install("d")
+if not opkgcl.is_installed("d", "2.0"):
+	fail("Package 'd' not installed for a clash of version 1.0.")
+
+# Installing 'p' first might take mvfile away from 'm', so the clash is
+# only judged once it is in.
+opkgcl.install("m")
+status, output = opkgcl.opkgcl("install n")
+if "Not downloading n" in output or not opkgcl.is_installed("p"):
+	fail("Clash of 'n' judged before its dependencies were installed.")
+if opkgcl.is_installed("n", "2.0"):
+	fail("Clashing package 'n' installed.")
+
+# A feed that drops its manifest must not leave a stale one behind.
+os.unlink("Contents.gz")
+opkgcl.update()
+if os.path.exists(contents):
+	print(__file__, ": Stale file manifest kept.")
+	exit(False)
+
+# Nor one whose package list failed to update.
+write_contents()
+opkgcl.update()
+os.rename("Packages", "Packages.bak")
+opkgcl.update()
+os.rename("Packages.bak", "Packages")
+if os.path.exists(contents):
+	fail("File manifest kept for a list that failed to update.")
+
+# With check_signature, a manifest that is not signed is not used.
+f = open("{}/etc/opkg/opkg.conf".format(cfg.offline_root), "a")
+f.write("option check_signature 1\n")
+f.close()
+opkgcl.update()
+os.unlink("Contents.gz")
+if os.path.exists(contents):
+	print(__file__, ": Unsigned file manifest used.")
+	exit(False)
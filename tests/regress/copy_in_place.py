@@ -0,0 +1,41 @@
+#!/usr/bin/python3
+
+import os
+import opk, cfg, opkgcl
+
+opk.regress_init()
+
+f = open("big", "wb")
+f.write(os.urandom(512 * 1024))
+f.close()
+
+o = opk.OpkGroup()
+o.add(Package="a", Version="1.0")
+o.opk_list[-1].write(data_files=["big"])
+o.write_list()
+os.unlink("big")
+
+opkgcl.update()
+
+# Installing from a file: feed reads the package where it is.
+opkgcl.install("a")
+if not opkgcl.is_installed("a"):
+	print(__file__, ": package ``a'' not installed.")
+	exit(False)
+if not os.path.exists("a_1.0_all.opk"):
+	print(__file__, ": feed package was consumed by install.")
+	exit(False)
+
+# Downloading still makes a copy.
+os.mkdir("dl")
+os.chdir("dl")
+status, output = opkgcl.opkgcl("download a")
+os.chdir("..")
+if status != 0 or not os.path.exists("dl/a_1.0_all.opk"):
+	print(__file__, ": download failed.")
+	exit(False)
+if open("dl/a_1.0_all.opk", "rb").read() != \
+		open("a_1.0_all.opk", "rb").read():
+	print(__file__, ": downloaded package differs from the feed.")
+	exit(False)
+os.system("rm -rf dl")
@@ -0,0 +1,63 @@
+#!/usr/bin/python3
+
+import os, sys, time, socket, hashlib, subprocess
+import opk, cfg, opkgcl
+
+opk.regress_init()
+
+s = socket.socket()
+s.bind(("127.0.0.1", 0))
+port = s.getsockname()[1]
+s.close()
+
+f = open("{}/etc/opkg/opkg.conf".format(cfg.offline_root), "w")
+f.write("arch all 1\n")
+f.write("src test http://127.0.0.1:{}\n".format(port))
+f.close()
+
+plist = open("Packages", "w")
+for name in ["a", "b"]:
+	p = opk.Opk(Package=name)
+	p.write()
+	filename = "{}_1.0_all.opk".format(name)
+	data = open(filename, "rb").read()
+	md5 = hashlib.md5(data).hexdigest()
+	sha256 = hashlib.sha256(data).hexdigest()
+	if name == "b":
+		md5 = hashlib.md5(b"not b").hexdigest()
+	plist.write("Package: {}\nVersion: 1.0\nArchitecture: all\n"
+			"Filename: {}\nMD5Sum: {}\nSHA256sum: {}\n\n"
+			.format(name, filename, md5, sha256))
+plist.close()
+
+server = subprocess.Popen([sys.executable, "-m", "http.server", str(port),
+		"--bind", "127.0.0.1"], cwd=cfg.opkdir,
+		stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+
+def fail(msg):
+	server.kill()
+	print(__file__, ": {}".format(msg))
+	exit(False)
+
+for i in range(50):
+	try:
+		socket.create_connection(("127.0.0.1", port)).close()
+		break
+	except OSError:
+		time.sleep(0.1)
+
+opkgcl.update()
+
+# Checksums taken during the download are checked against the feed.
+opkgcl.install("a")
+if not opkgcl.is_installed("a"):
+	fail("package ``a'' not installed.")
+
+status, output = opkgcl.opkgcl("install b")
+if opkgcl.is_installed("b"):
+	fail("package ``b'' installed despite an md5sum mismatch.")
+if "md5sum mismatch" not in output:
+	fail("md5sum mismatch not reported.")
+
+server.kill()
+server.wait()
@@ -0,0 +1,78 @@
+#!/usr/bin/python3
+
+import os
+import opk, cfg, opkgcl
+
+opk.regress_init()
+
+os.makedirs("usr/share/a/b/c")
+os.makedirs("usr/bin")
+f = open("usr/share/a/b/c/tool", "w")
+f.write("tool\n")
+f.close()
+os.chmod("usr/share/a/b/c/tool", 0o754)
+os.utime("usr/share/a/b/c/tool", (1000000000, 1000000000))
+os.symlink("../share/a/b/c/tool", "usr/bin/tool")
+a = opk.Opk(Package="a")
+a.write(data_files=["usr"])
+os.system("rm -rf usr")
+
+# Left behind by an interrupted install, it must be replaced.
+root = cfg.offline_root
+os.makedirs("{}/usr/bin".format(root))
+os.symlink("nowhere", "{}/usr/bin/tool.opkg-new".format(root))
+
+opkgcl.install("a_1.0_all.opk")
+if not opkgcl.is_installed("a"):
+	print(__file__, ": Package 'a' not installed.")
+	exit(False)
+
+tool = "{}/usr/share/a/b/c/tool".format(root)
+if not os.path.isfile(tool) or open(tool).read() != "tool\n":
+	print(__file__, ": File in new leading directories not extracted.")
+	exit(False)
+st = os.stat(tool)
+if st.st_mode & 0o7777 != 0o754:
+	print(__file__, ": File mode not preserved: {:o}.".format(st.st_mode))
+	exit(False)
+if st.st_mtime != 1000000000:
+	print(__file__, ": File date not preserved.")
+	exit(False)
+
+link = "{}/usr/bin/tool".format(root)
+if os.readlink(link) != "../share/a/b/c/tool":
+	print(__file__, ": Symlink not extracted.")
+	exit(False)
+if os.path.lexists(link + ".opkg-new"):
+	print(__file__, ": Stale staged symlink left behind.")
+	exit(False)
+
+# A directory where the previous version had a file replaces it.
+os.makedirs("usr/lib")
+open("usr/lib/ext", "w").close()
+b = opk.Opk(Package="b", Version="1.0")
+b.write(data_files=["usr"])
+os.system("rm -rf usr")
+os.makedirs("usr/lib/ext")
+open("usr/lib/ext/inner", "w").close()
+b = opk.Opk(Package="b", Version="2.0")
+b.write(data_files=["usr"])
+os.system("rm -rf usr")
+
+opkgcl.install("b_1.0_all.opk")
+opkgcl.install("b_2.0_all.opk")
+if opkgcl.is_installed("b", "1.0") or not opkgcl.is_installed("b", "2.0"):
+	print(__file__, ": Package 'b' not upgraded.")
+	exit(False)
+if not os.path.isfile("{}/usr/lib/ext/inner".format(root)):
+	print(__file__, ": File of version 1.0 not replaced by a directory.")
+	exit(False)
+
+# Nor may one that no package owns any more, which the upgrade above does
+# not see, it removes the files of 1.0 before extracting 2.0.
+opkgcl.remove("b")
+open("{}/usr/lib/ext".format(root), "w").close()
+opkgcl.install("b_2.0_all.opk")
+if not os.path.isfile("{}/usr/lib/ext/inner".format(root)):
+	print(__file__, ": Stray file not replaced by a directory.")
+	exit(False)
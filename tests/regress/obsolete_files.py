@@ -0,0 +1,47 @@
+#!/usr/bin/python3
+
+import os
+import opk, cfg, opkgcl
+
+opk.regress_init()
+
+old_files = ["ob_{}".format(i) for i in range(20)]
+new_files = old_files[5:] + ["ob_new"]
+for f in old_files + new_files:
+	open(f, "w").close()
+
+o = opk.OpkGroup()
+o.add(Package="a", Version="1.0")
+o.opk_list[-1].write(data_files=old_files)
+o.write_list()
+
+opkgcl.update()
+opkgcl.install("a")
+if not opkgcl.is_installed("a", "1.0"):
+	print(__file__, ": package 'a' not installed.")
+	exit(False)
+
+o = opk.OpkGroup()
+o.add(Package="a", Version="2.0")
+o.opk_list[-1].write(data_files=new_files)
+o.write_list()
+
+for f in old_files + new_files:
+	if os.path.exists(f):
+		os.unlink(f)
+
+opkgcl.update()
+opkgcl.upgrade()
+if not opkgcl.is_installed("a", "2.0"):
+	print(__file__, ": package 'a' not upgraded.")
+	exit(False)
+
+# Files dropped by the new version go, the others stay.
+for f in old_files[:5]:
+	if os.path.exists("{}/{}".format(cfg.offline_root, f)):
+		print(__file__, ": obsolete file {} not removed.".format(f))
+		exit(False)
+for f in new_files:
+	if not os.path.exists("{}/{}".format(cfg.offline_root, f)):
+		print(__file__, ": file {} missing after upgrade.".format(f))
+		exit(False)
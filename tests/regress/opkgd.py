@@ -0,0 +1,99 @@
+#!/usr/bin/python3
+
+import os, signal, subprocess, time, fcntl
+import opk, cfg, opkgcl
+
+opk.regress_init()
+
+sock = "{}/opkgd.sock".format(cfg.offline_root)
+lock_path = "{}/usr/lib/opkg/lock".format(cfg.offline_root)
+
+o = opk.OpkGroup()
+o.add(Package="a", Description="the a package", Source="a-src")
+o.add(Package="b", Depends="a")
+o.write_opk()
+o.write_list()
+
+opkgcl.update()
+opkgcl.install("a")
+
+daemon = subprocess.Popen([cfg.opkgd, "-o", cfg.offline_root, "-s", sock],
+		stdout=subprocess.DEVNULL)
+for i in range(50):
+	if os.path.exists(sock):
+		break
+	time.sleep(0.1)
+else:
+	print(__file__, ": opkgd did not create its socket.")
+	daemon.kill()
+	exit(False)
+
+def query(args):
+	return opkgcl.opkgcl("--daemon={} {}".format(sock, args))
+
+# Queries must be answered while another opkg holds the lock.
+lock = open(lock_path, "w")
+fcntl.lockf(lock, fcntl.LOCK_EX)
+
+(status, out) = query("list-installed")
+if status != 0 or out.find("a - 1.0") < 0:
+	print(__file__, ": opkgd did not list installed package 'a'.")
+	daemon.kill()
+	exit(False)
+
+(status, out) = query("-A whatdepends a")
+if status != 0 or out.find("b") < 0:
+	print(__file__, ": opkgd did not answer whatdepends.")
+	daemon.kill()
+	exit(False)
+
+fcntl.lockf(lock, fcntl.LOCK_UN)
+lock.close()
+
+# Fields a local run does not parse for a command are not printed either.
+for cmd in ["status a", "list-installed", "info a"]:
+	local = opkgcl.opkgcl(cmd)
+	served = query(cmd)
+	if served != local:
+		print(__file__, ": opkgd and local ``{}'' differ:".format(cmd))
+		print(served[1])
+		print(local[1])
+		daemon.kill()
+		exit(False)
+
+# A mutating command runs locally and the daemon picks up its result.
+query("install b")
+if not opkgcl.is_installed("b"):
+	print(__file__, ": Package 'b' not installed through --daemon.")
+	daemon.kill()
+	exit(False)
+
+(status, out) = query("list-installed")
+if out.find("b - 1.0") < 0:
+	print(__file__, ": opkgd did not notice the status file change.")
+	daemon.kill()
+	exit(False)
+
+# Another root, or an option opkgd is not told, is answered locally.
+other = "{}-other".format(cfg.offline_root)
+os.system("rm -fr {}".format(other))
+os.makedirs("{}/usr/lib/opkg".format(other))
+(status, out) = subprocess.getstatusoutput("{} -o {} --daemon={} list-installed"
+		.format(cfg.opkgcl, other, sock))
+os.system("rm -fr {}".format(other))
+if out.find("a - 1.0") >= 0:
+	print(__file__, ": opkgd answered for another offline root.")
+	daemon.kill()
+	exit(False)
+
+(status, out) = query("--add-arch=foo:5 print-architecture")
+if out.find("arch foo 5") < 0:
+	print(__file__, ": --add-arch ignored for a query sent to opkgd.")
+	daemon.kill()
+	exit(False)
+
+daemon.send_signal(signal.SIGTERM)
+daemon.wait()
+if os.path.exists(sock):
+	print(__file__, ": opkgd did not remove its socket.")
+	exit(False)
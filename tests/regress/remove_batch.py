@@ -0,0 +1,45 @@
+#!/usr/bin/python3
+
+import os
+import opk, cfg, opkgcl
+
+opk.regress_init()
+
+o = opk.OpkGroup()
+o.add(Package="a")
+o.add(Package="b", Depends="a")
+o.add(Package="c", Depends="d")
+o.add(Package="d", Depends="e")
+o.add(Package="e")
+o.write_opk()
+o.write_list()
+
+opkgcl.update()
+
+opkgcl.install("b")
+opkgcl.install("a")
+if not opkgcl.is_installed("a") or not opkgcl.is_installed("b"):
+	print(__file__, ": packages 'a' and 'b' not installed.")
+	exit(False)
+
+opkgcl.remove("a")
+if not opkgcl.is_installed("a"):
+	print(__file__, ": package 'a' removed while 'b' depends on it.")
+	exit(False)
+
+# Removed together, a dependent given after its dependency is fine.
+opkgcl.remove("a b")
+if opkgcl.is_installed("a") or opkgcl.is_installed("b"):
+	print(__file__, ": packages 'a' and 'b' not removed together.")
+	exit(False)
+
+# Orphans of orphans go too.
+opkgcl.install("c")
+if not opkgcl.is_installed("e"):
+	print(__file__, ": package 'e' not installed.")
+	exit(False)
+opkgcl.remove("c", "--autoremove")
+for p in ("c", "d", "e"):
+	if opkgcl.is_installed(p):
+		print(__file__, ": package '{}' not autoremoved.".format(p))
+		exit(False)
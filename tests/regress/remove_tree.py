@@ -0,0 +1,45 @@
+#!/usr/bin/python3
+
+import os, shutil
+import opk, cfg, opkgcl
+
+opk.regress_init()
+
+# A tree several levels deep, part of it shared with a second package.
+def make_tree(top, names):
+	for name in names:
+		os.makedirs(os.path.dirname("{}/{}".format(top, name)), exist_ok=True)
+		open("{}/{}".format(top, name), "w").close()
+
+make_tree("rt", ["d{}/e/f/file{}".format(i, j)
+		for i in range(3) for j in range(5)])
+o = opk.OpkGroup()
+o.add(Package="a")
+o.opk_list[-1].write(data_files=["rt"])
+shutil.rmtree("rt")
+
+make_tree("rt", ["d0/e/other"])
+o.add(Package="b")
+o.opk_list[-1].write(data_files=["rt"])
+shutil.rmtree("rt")
+o.write_list()
+
+opkgcl.update()
+opkgcl.install("a")
+opkgcl.install("b")
+if not opkgcl.is_installed("a") or not opkgcl.is_installed("b"):
+	print(__file__, ": packages not installed.")
+	exit(False)
+
+opkgcl.remove("a")
+root = cfg.offline_root
+for i in (1, 2):
+	if os.path.exists("{}/rt/d{}".format(root, i)):
+		print(__file__, ": directory rt/d{} left behind.".format(i))
+		exit(False)
+if not os.path.exists("{}/rt/d0/e/other".format(root)):
+	print(__file__, ": file of package 'b' removed with 'a'.")
+	exit(False)
+if os.path.exists("{}/rt/d0/e/f".format(root)):
+	print(__file__, ": directory rt/d0/e/f left behind.")
+	exit(False)
@@ -0,0 +1,56 @@
+#!/usr/bin/python3
+
+import os, fcntl, threading
+import opk, cfg, opkgcl
+
+opk.regress_init()
+
+lock_path = "{}/usr/lib/opkg/lock".format(cfg.offline_root)
+
+o = opk.OpkGroup()
+o.add(Package="a")
+o.add(Package="b")
+o.add(Package="c")
+o.write_opk()
+o.write_list()
+
+opkgcl.update()
+opkgcl.install("a")
+
+# Pretend a mutating opkg is running.
+lock = open(lock_path, "a")
+fcntl.lockf(lock, fcntl.LOCK_EX)
+
+(status, out) = opkgcl.opkgcl("list-installed")
+if status != 0 or out.find("a - 1.0") < 0:
+	print(__file__, ": Query failed while the database was locked.")
+	exit(False)
+
+opkgcl.install("b")
+if opkgcl.is_installed("b"):
+	print(__file__, ": Package 'b' installed despite the exclusive lock.")
+	exit(False)
+
+fcntl.lockf(lock, fcntl.LOCK_UN)
+lock.close()
+
+opkgcl.install("b")
+# As ever, the lock file goes with the exclusive lock.
+if os.path.exists(lock_path):
+	print(__file__, ": Lock file left behind by an exclusive holder.")
+	exit(False)
+if not opkgcl.is_installed("b"):
+	print(__file__, ": Package 'b' not installed after the lock was released.")
+	exit(False)
+
+# A query holding the lock for a moment makes a writer wait, not fail.
+lock = open(lock_path, "a+")
+fcntl.lockf(lock, fcntl.LOCK_SH)
+release = threading.Timer(1, lambda: fcntl.lockf(lock, fcntl.LOCK_UN))
+release.start()
+opkgcl.install("c")
+release.join()
+lock.close()
+if not opkgcl.is_installed("c"):
+	print(__file__, ": Writer did not wait for a query to release the lock.")
+	exit(False)
@@ -0,0 +1,99 @@
+#!/usr/bin/python3
+
+import os
+import opk, cfg, opkgcl
+
+opk.regress_init()
+
+def write_a(version, content):
+	f = open("foo", "w")
+	f.write(content)
+	f.close()
+	if os.path.exists("hl"):
+		os.unlink("hl")
+	os.link("foo", "hl")
+	f = open("big", "wb")
+	f.write(os.urandom(256 * 1024))
+	f.close()
+	a = opk.Opk(Package="a", Version=version)
+	a.write(data_files=["foo", "hl", "big"])
+	for name in ["foo", "hl", "big"]:
+		os.unlink(name)
+
+def read_root(name):
+	f = open("{}/{}".format(cfg.offline_root, name))
+	content = f.read()
+	f.close()
+	return content
+
+def staged_leftovers():
+	for root, dirs, files in os.walk(cfg.offline_root):
+		for name in files:
+			if name.endswith(".opkg-new"):
+				return True
+	return False
+
+write_a("1.0", "one")
+opkgcl.install("a_1.0_all.opk")
+if not opkgcl.is_installed("a", "1.0") or read_root("foo") != "one":
+	print(__file__, ": Package 'a' version 1.0 not installed.")
+	exit(False)
+
+# A package that breaks off in the middle of its data must leave the
+# files of the installed version alone.
+write_a("2.0", "two")
+size = os.path.getsize("a_2.0_all.opk")
+os.truncate("a_2.0_all.opk", size - 128 * 1024)
+opkgcl.install("a_2.0_all.opk")
+if read_root("foo") != "one" or read_root("hl") != "one":
+	print(__file__, ": Truncated package replaced installed files.")
+	exit(False)
+if staged_leftovers():
+	print(__file__, ": Staged files left behind by a failed extraction.")
+	exit(False)
+
+write_a("2.0", "two")
+opkgcl.install("a_2.0_all.opk")
+if not opkgcl.is_installed("a", "2.0"):
+	print(__file__, ": Package 'a' version 2.0 not installed.")
+	exit(False)
+if read_root("foo") != "two" or read_root("hl") != "two":
+	print(__file__, ": Files not replaced by the upgrade.")
+	exit(False)
+if os.stat("{}/foo".format(cfg.offline_root)).st_ino != \
+		os.stat("{}/hl".format(cfg.offline_root)).st_ino:
+	print(__file__, ": Hard link not preserved.")
+	exit(False)
+if staged_leftovers():
+	print(__file__, ": Staged files left behind.")
+	exit(False)
+
+opkgcl.remove("a")
+
+# A directory in use where the package has a file is a conflict found
+# before anything is renamed, the other files of the package stay out.
+for name in ["c1", "c2"]:
+	open(name, "w").close()
+c = opk.Opk(Package="c")
+c.write(data_files=["c1", "c2"])
+os.unlink("c1")
+os.unlink("c2")
+os.makedirs("{}/c2".format(cfg.offline_root))
+open("{}/c2/keep".format(cfg.offline_root), "w").close()
+opkgcl.install("c_1.0_all.opk")
+if os.path.exists("{}/c1".format(cfg.offline_root)):
+	print(__file__, ": Files committed despite a conflict.")
+	exit(False)
+if staged_leftovers():
+	print(__file__, ": Staged files left behind by a conflict.")
+	exit(False)
+
+# An empty one is replaced.
+os.unlink("{}/c2/keep".format(cfg.offline_root))
+opkgcl.install("c_1.0_all.opk")
+if not opkgcl.is_installed("c"):
+	print(__file__, ": Package 'c' not installed over an empty directory.")
+	exit(False)
+if not os.path.isfile("{}/c2".format(cfg.offline_root)):
+	print(__file__, ": Empty directory not replaced by a file.")
+	exit(False)
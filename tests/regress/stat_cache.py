@@ -0,0 +1,44 @@
+#!/usr/bin/python3
+
+import os
+import opk, cfg, opkgcl
+
+opk.regress_init()
+
+# Enough files in one directory for it to be read with readdir().
+c_files = ["sc_f{}".format(i) for i in range(10)]
+d_files = ["sc_g{}".format(i) for i in range(10)] + ["sc_f3"]
+for f in c_files + d_files:
+	open(f, "w").close()
+
+o = opk.OpkGroup()
+o.add(Package="c")
+o.opk_list[-1].write(data_files=c_files)
+o.add(Package="d")
+o.opk_list[-1].write(data_files=d_files)
+o.write_list()
+for f in c_files + d_files:
+	if os.path.exists(f):
+		os.unlink(f)
+
+opkgcl.update()
+
+# Files extracted for c must be seen by the checks for d.
+opkgcl.install("c d")
+if not opkgcl.is_installed("c"):
+	print(__file__, ": package 'c' not installed.")
+	exit(False)
+if opkgcl.is_installed("d"):
+	print(__file__, ": package 'd' installed despite clashing with 'c'.")
+	exit(False)
+
+opkgcl.remove("c")
+for f in c_files:
+	if os.path.exists("{}/{}".format(cfg.offline_root, f)):
+		print(__file__, ": {} left behind by removal of 'c'.".format(f))
+		exit(False)
+
+opkgcl.install("d")
+if not opkgcl.is_installed("d"):
+	print(__file__, ": package 'd' not installed after 'c' was removed.")
+	exit(False)
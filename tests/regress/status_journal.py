@@ -0,0 +1,104 @@
+#!/usr/bin/python3
+
+import os
+import opk, cfg, opkgcl
+
+opk.regress_init()
+
+f = open("{}/etc/opkg/opkg.conf".format(cfg.offline_root), "a")
+f.write("option status_journal_max 512\n")
+f.close()
+
+status_path = "{}/usr/lib/opkg/status".format(cfg.offline_root)
+journal_path = "{}/usr/lib/opkg/status.journal".format(cfg.offline_root)
+
+o = opk.OpkGroup()
+o.add(Package="a", Depends="b")
+o.add(Package="b")
+o.add(Package="c")
+o.add(Package="d")
+o.write_opk()
+o.write_list()
+
+opkgcl.update()
+
+opkgcl.install("a")
+if not opkgcl.is_installed("a") or not opkgcl.is_installed("b"):
+	print(__file__, ": Packages 'a' and 'b' not installed.")
+	exit(False)
+
+opkgcl.install("c")
+if not os.path.exists(journal_path):
+	print(__file__, ": Installing 'c' didn't append to the status journal.")
+	exit(False)
+if not opkgcl.is_installed("c"):
+	print(__file__, ": Package 'c' not installed after journal replay.")
+	exit(False)
+
+opkgcl.remove("a")
+if opkgcl.is_installed("a"):
+	print(__file__, ": Package 'a' still installed after journal replay.")
+	exit(False)
+if not opkgcl.is_installed("b") or not opkgcl.is_autoinstalled("b"):
+	print(__file__, ": Package 'b' lost its state.")
+	exit(False)
+
+# Grow the journal past status_journal_max to force compaction.
+for i in range(4):
+	opkgcl.opkgcl("flag hold c")
+	opkgcl.opkgcl("flag ok c")
+
+if os.path.exists(journal_path):
+	print(__file__, ": Status journal was not compacted.")
+	exit(False)
+
+status = open(status_path).read()
+if status.find("Package: a\n") >= 0:
+	print(__file__, ": Removed package 'a' survived compaction.")
+	exit(False)
+if status.find("Package: c\n") < 0:
+	print(__file__, ": Package 'c' lost during compaction.")
+	exit(False)
+
+# A torn record at the end of the journal must be ignored.
+opkgcl.opkgcl("flag hold c")
+f = open(journal_path, "a")
+f.write("Package: c\nVersion: 1.0\nStatus: deinstall ok not-")
+f.close()
+if not opkgcl.is_installed("c"):
+	print(__file__, ": Torn journal record was replayed.")
+	exit(False)
+
+# Queries leave it alone, it may be a record being appended. The next
+# command that changes the database drops it.
+if not open(journal_path).read().endswith("not-"):
+	print(__file__, ": Query truncated the status journal.")
+	exit(False)
+opkgcl.opkgcl("flag ok c")
+if open(journal_path).read().find("not-") >= 0:
+	print(__file__, ": Torn journal record was not dropped.")
+	exit(False)
+
+# A query reading between a compaction's rename of the new status file and
+# its unlink of the old journal must not replay that journal over it.
+opkgcl.install("d")
+status = open(status_path).read()
+if status.find("Package: d\n") >= 0:
+	print(__file__, ": Installing 'd' rewrote the status file.")
+	exit(False)
+f = open(status_path + ".new", "w")
+f.write(status)
+f.close()
+os.rename(status_path + ".new", status_path)
+if opkgcl.is_installed("d"):
+	print(__file__, ": Old journal replayed over a new status file.")
+	exit(False)
+
+# The next command that changes the database starts a new journal.
+opkgcl.opkgcl("flag hold c")
+if open(journal_path).read().find("Package: d\n") >= 0:
+	print(__file__, ": Old journal was appended to.")
+	exit(False)
+if opkgcl.is_installed("d") or not opkgcl.is_installed("c"):
+	print(__file__, ": New journal does not extend the status file.")
+	exit(False)
@@ -0,0 +1,68 @@
+#!/usr/bin/python3
+
+import os, pwd, grp
+import opk, cfg, opkgcl
+
+opk.regress_init()
+
+# Packages name their files' owner "daemon", a name the offline root maps
+# to different ids than the host.
+uid = pwd.getpwnam("daemon").pw_uid
+gid = grp.getgrnam("daemon").gr_gid
+
+def write_pkg(name, files, owner=None, **control):
+	for f in files:
+		os.makedirs(os.path.dirname(f) or ".", exist_ok=True)
+		if not os.path.exists(f):
+			open(f, "w").close()
+		if owner:
+			os.chown(f, owner[0], owner[1])
+	opk.Opk(Package=name, **control).write(data_files=files)
+	for f in files:
+		os.unlink(f)
+
+def write_ids(root, user, group):
+	f = open("{}/etc/passwd".format(root), "w")
+	f.write("root:x:0:0:root:/root:/bin/sh\n")
+	f.write("daemon:x:{}:{}:daemon:/:/bin/false\n".format(user, group))
+	f.close()
+	f = open("{}/etc/group".format(root), "w")
+	f.write("root:x:0:\ndaemon:x:{}:\n".format(group))
+	f.close()
+
+def owner(name):
+	st = os.lstat("{}/{}".format(cfg.offline_root, name))
+	return (st.st_uid, st.st_gid)
+
+write_pkg("a", ["a-file"], (uid, gid))
+# No name on the host, so the numeric ids are used.
+write_pkg("b", ["b-file"], (4242, 4343))
+
+write_ids(cfg.offline_root, 77, 78)
+opkgcl.install("a_1.0_all.opk")
+opkgcl.install("b_1.0_all.opk")
+if owner("a-file") != (77, 78):
+	print(__file__, ": Owner names not resolved against the offline root: {}."
+			.format(owner("a-file")))
+	exit(False)
+if owner("b-file") != (4242, 4343):
+	print(__file__, ": Numeric owner not used for an unknown name.")
+	exit(False)
+
+# A package installing /etc/passwd changes the ids of later packages.
+os.unlink("{}/etc/passwd".format(cfg.offline_root))
+os.unlink("{}/etc/group".format(cfg.offline_root))
+os.mkdir("etc")
+write_ids(".", 79, 80)
+write_pkg("c", ["etc/passwd", "etc/group"])
+os.rmdir("etc")
+write_pkg("d", ["d-file"], (uid, gid), Depends="c")
+
+opkgcl.install("c_1.0_all.opk d_1.0_all.opk")
+if not opkgcl.is_installed("d"):
+	print(__file__, ": Package 'd' not installed.")
+	exit(False)
+if owner("d-file") != (79, 80):
+	print(__file__, ": Stale owner ids used after /etc/passwd changed: {}."
+			.format(owner("d-file")))
+	exit(False)